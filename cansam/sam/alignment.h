@@ -1,7 +1,7 @@
 /// @file cansam/sam/alignment.h
 /// Classes and functions for SAM/BAM alignment records
 
-/*  Copyright (C) 2010-2014 Genome Research Ltd.
+/*  Copyright (C) 2010-2014, 2026 Genome Research Ltd.
     Portions copyright (C) 2020 University of Glasgow.
 
     Author: John Marshall <jm18@sanger.ac.uk>
@@ -46,6 +46,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 
 namespace sam {
 
+class alignment_view;
 class bamio;
 class samio;
 
@@ -677,6 +678,7 @@ public:
 
 private:
   // @cond private
+  friend class alignment_view;
   friend class bamio;
   friend class samio;
   // FIXME Only friend because of cigar stuff and its unpack_seq/_qual usage
@@ -685,6 +687,7 @@ private:
   struct block_header {
     uint16_t capacity;
     uint16_t cindex;
+    int32_t  span;  // Reference bases consumed by the CIGAR, or unknown_span
   };
 
   struct bamcore {
@@ -730,6 +733,11 @@ private:
   block* p;
 
   void assign(int nfields, const std::vector<char*>& fields, int cindex);
+  void assign(int nfields, const std::vector<char*>& fields, int cindex,
+	      const collection& headers);
+
+  static int pack_cigar(char* dest, const char* cigar, const char* end,
+			int32_t& span);
 
   void sync() const { bin(); }
 
@@ -775,6 +783,7 @@ private:
 			  const char* phred, int length);
 
   static const uint16_t unknown_bin = 0xffff;
+  static const int32_t unknown_span = -1;
   static const int order_value[];
   static block empty_block;
   // @endcond
@@ -819,6 +828,126 @@ inline int cmp_by_qname(const alignment& a, const alignment& b)
 /** @relatesalso alignment */
 inline void swap(alignment& a, alignment& b) { a.swap(b); }
 
+/** @class sam::alignment_view cansam/sam/alignment.h
+    @brief Read-only view of an alignment record within a stream's buffer
+
+Reading into an alignment_view rather than an alignment avoids copying each
+record out of the stream's buffer.  For BAM streams, a view usually refers
+directly to the record within the decompressed BGZF data; records that span
+BGZF blocks, and records from other formats, are instead copied into storage
+belonging to the view as usual.  This suits code that examines many records
+but retains few, such as filters that look only at flags and positions.
+
+The view provides the same const field accessors as sam::alignment, and can
+be used wherever a <tt>const alignment&</tt> is expected.  The record viewed
+remains valid only until the next record is read from the stream, or the
+stream is closed; to retain it, copy it into an alignment object.  */
+class alignment_view {
+public:
+  /// Construct a view of an empty alignment
+  alignment_view() : aln(&copy) { }
+
+  //  Destroy this view object (not interesting enough to warrant ///)
+  ~alignment_view() { release(); }
+
+  /// The alignment record being viewed
+  const alignment& get() const { return *aln; }
+  operator const alignment& () const { return *aln; }
+
+  /** @name Field accessors
+  These correspond to the const accessors of sam::alignment.  */
+  //@{
+  typedef alignment::const_iterator const_iterator;
+
+  int sam_length() const { return aln->sam_length(); }
+
+  std::string qname() const { return aln->qname(); }
+  int flags() const { return aln->flags(); }
+  int rindex() const { return aln->rindex(); }
+  std::string rname() const { return aln->rname(); }
+  coord_t pos() const  { return aln->pos(); }
+  coord_t zpos() const { return aln->zpos(); }
+  int mapq() const { return aln->mapq(); }
+
+  size_t cigar_length() const { return aln->cigar_length(); }
+  cigar_op cigar(size_t i) const { return aln->cigar(i); }
+  template <typename CigarType> CigarType cigar() const
+    { return aln->template cigar<CigarType>(); }
+  std::string& cigar(std::string& dest) const { return aln->cigar(dest); }
+  std::vector<cigar_op>& cigar(std::vector<cigar_op>& dest) const
+    { return aln->cigar(dest); }
+
+  int mate_rindex() const { return aln->mate_rindex(); }
+  std::string mate_rname() const { return aln->mate_rname(); }
+  coord_t mate_pos() const  { return aln->mate_pos(); }
+  coord_t mate_zpos() const { return aln->mate_zpos(); }
+  scoord_t isize() const { return aln->isize(); }
+
+  std::string seq() const { return aln->seq(); }
+  std::string qual() const { return aln->qual(); }
+  int length() const { return aln->length(); }
+  int bin() const { return aln->bin(); }
+
+  template <typename ValueType>
+  ValueType aux(const char* tag) const
+    { return aln->template aux<ValueType>(tag); }
+
+  template <typename ValueType>
+  ValueType aux(const char* tag, ValueType default_value) const
+    { return aln->aux(tag, default_value); }
+
+  const char* qname_c_str() const { return aln->qname_c_str(); }
+  int qname_length() const { return aln->qname_length(); }
+  std::string& qname(std::string& dest) const { return aln->qname(dest); }
+  const char* rname_c_str() const { return aln->rname_c_str(); }
+  const char* mate_rname_c_str() const { return aln->mate_rname_c_str(); }
+  std::string& seq(std::string& dest) const { return aln->seq(dest); }
+  const char* seq_raw_data() const { return aln->seq_raw_data(); }
+  std::string& qual(std::string& dest) const { return aln->qual(dest); }
+  const char* qual_raw_data() const { return aln->qual_raw_data(); }
+
+  std::string& aux(std::string& dest, const char* tag) const
+    { return aln->aux(dest, tag); }
+  std::string& aux(std::string& dest,
+		   const char* tag, const char* default_value) const
+    { return aln->aux(dest, tag, default_value); }
+  std::string& aux(std::string& dest,
+		   const char* tag, const std::string& default_value) const
+    { return aln->aux(dest, tag, default_value); }
+
+  const_iterator begin() const { return aln->begin(); }
+  const_iterator end() const { return aln->end(); }
+  const_iterator find(const char* tag) const { return aln->find(tag); }
+  bool empty() const { return aln->empty(); }
+
+  int strand() const { return aln->strand(); }
+  char strand_char() const { return aln->strand_char(); }
+  int mate_strand() const { return aln->mate_strand(); }
+  char mate_strand_char() const { return aln->mate_strand_char(); }
+  int order() const { return aln->order(); }
+  scoord_t cigar_span() const { return aln->cigar_span(); }
+  coord_t right_pos() const  { return aln->right_pos(); }
+  coord_t right_zpos() const { return aln->right_zpos(); }
+  //@}
+
+private:
+  // @cond private
+  friend class bamio;
+  friend class sambamio;
+
+  // The record being viewed is either  borrowed,  whose block lies within
+  // a stream's buffer and is not owned by it, or an ordinary  copy.
+  const alignment* aln;
+  alignment borrowed;
+  alignment copy;
+
+  void release() { borrowed.p = &alignment::empty_block; }
+
+  alignment_view(const alignment_view&) /* = delete */;
+  alignment_view& operator= (const alignment_view&) /* = delete */;
+  // @endcond
+};
+
 #if 0
 /** @brief Read an alignment from the stream
 @details Extracts a single SAM-formatted alignment record from the input
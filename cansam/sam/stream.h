@@ -1,7 +1,7 @@
 /// @file cansam/sam/stream.h
 /// Classes for SAM/BAM input/output streams
 
-/*  Copyright (C) 2010-2012 Genome Research Ltd.
+/*  Copyright (C) 2010-2012, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -34,6 +34,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 #include <ios>
 #include <string>
 
+#include <stdint.h>
+
 namespace sam {
 
 /*. @name Additional openmode flags */
@@ -49,10 +51,22 @@ const std::ios_base::openmode sam_format
 const std::ios_base::openmode bam_format = std::ios_base::binary | compressed;
 //.}
 
+/*. @name Special levels for osamstream::set_compression() */
+//.{
+/// Compress at the default level (equivalent to zlib's level 6)
+const int default_compression = -1;
+
+/// Vary the compression level according to throughput
+const int adaptive_compression = -2;
+//.}
+
 class alignment;
+class alignment_view;
+class bgzfio;
 class collection;
 class exception;
 class sambamio;
+class seqinterval;
 
 /** @class sam::samstream_base cansam/sam/stream.h
     @brief Base class for SAM/BAM streams
@@ -85,6 +99,25 @@ public:
   /// Set an associated filename
   void set_filename(const std::string& filename) { filename_ = filename; }
 
+  /// Use worker threads for decompression, compression, or parsing
+  /** By default, BAM and BGZF-compressed SAM streams decompress or compress
+  their BGZF blocks on the thread using the stream.  This method starts a pool
+  of @a nthreads worker threads that will instead read ahead and decompress
+  blocks in parallel, or compress filled blocks in parallel and write them out
+  in order.  When reading SAM text (whether uncompressed or compressed), a
+  further pool of @a nthreads worker threads parses chunks of lines read ahead
+  into alignment records in parallel.
+  Records are read in exactly the same order as they would be otherwise, and
+  the bytes written are identical to those written by a single thread.
+  Records that cannot be parsed produce their errors in their turn, just as
+  they would otherwise.
+  Using an @a nthreads of 0 returns the stream to single-threaded operation.
+
+  SAM files compressed with ordinary @e gzip rather than BGZF are still
+  decompressed serially.  While SAM text is being parsed in parallel, the
+  headers previously read from the stream should not be modified.  */
+  void set_threads(int nthreads);
+
   /// Set initial exceptions mask for subsequent samstream objects
   /** By default, each newly-constructed SAM/BAM stream object has an
   exceptions mask of @c failbit|badbit, so throws exceptions on all formatting
@@ -125,6 +158,77 @@ private:
   samstream_base& operator= (const samstream_base&) /* = delete */;
 };
 
+/** @class sam::block_cache cansam/sam/stream.h
+    @brief Cache of decompressed BGZF blocks
+
+Holds the decompressed contents of recently-read BGZF blocks, keyed by their
+positions within the file, so that BAM input streams revisiting the same parts
+of a file (for example, when seeking to many overlapping regions) need not
+decompress the same blocks repeatedly.  The least recently used blocks are
+discarded when the cache's capacity would otherwise be exceeded.
+
+A cache may be shared by several input streams, including streams used by
+different threads, but all of them must be reading the @e same file, as blocks
+are identified only by their file positions.  */
+class block_cache {
+public:
+  /// Construct a cache holding up to @a capacity bytes of decompressed data
+  explicit block_cache(size_t capacity = 64 << 20);
+  ~block_cache();
+
+  /// Returns the maximum amount of decompressed data, in bytes, to be cached
+  size_t capacity() const;
+
+  /// Change the cache's capacity, discarding blocks as necessary
+  void set_capacity(size_t capacity);
+
+  /// Returns the amount of decompressed data, in bytes, currently cached
+  size_t size() const;
+
+  /// Returns the number of blocks that were found in the cache
+  uint64_t hits() const;
+
+  /// Returns the number of blocks that were not found and were decompressed
+  uint64_t misses() const;
+
+  /// Discard all cached blocks and reset the hit and miss counters
+  void clear();
+
+private:
+  friend class bgzfio;
+
+  // Copy the data of the block at OFFSET into DEST, if present in the cache.
+  // Returns the length of the data, or 0 (counting a miss) if it is absent.
+  size_t find(uint64_t offset, char* dest);
+
+  // Add a copy of the LENGTH bytes at DATA as the block at OFFSET.
+  void insert(uint64_t offset, const char* data, size_t length);
+
+  class lru;  // Implemented in blockcache.cpp
+  lru* blocks;
+
+  block_cache(const block_cache&) /* = delete */;
+  block_cache& operator= (const block_cache&) /* = delete */;
+};
+
+/** @class sam::alignment_handler cansam/sam/stream.h
+    @brief Receives the alignment records read by isamstream::scan()
+
+Records are divided into parts, each of which is processed by a single thread
+at a time, so a handler may accumulate results for each part separately (for
+example, in a vector indexed by part) without locking, and combine them
+afterwards.  */
+class alignment_handler {
+public:
+  virtual ~alignment_handler() { }
+
+  /// Process an alignment record belonging to part number @a part
+  /** Invoked concurrently for records of different parts, but in turn and
+  in file order for the records within each part.  The record is valid only
+  for the duration of the call.  */
+  virtual void process(const alignment& aln, int part) = 0;
+};
+
 /** @class sam::isamstream cansam/sam/stream.h
     @brief SAM/BAM input stream
 */
@@ -169,14 +273,82 @@ public:
   as selected via @c exceptions().  */
   isamstream& operator>> (alignment& aln);
 
+  /// Read an alignment record, without copying it if possible
+  /** As for @c operator>>(alignment&), but @a view is usually left referring
+  to the record within the stream's own buffer, and so remains valid only
+  until the next record is read; see sam::alignment_view.  */
+  isamstream& operator>> (alignment_view& view);
+
+  /// Restrict reading to alignment records overlapping a region
+  /** Uses the index accompanying the stream's BAM file (@e file.bam.bai,
+  @e file.bai, or a CSI index @e file.bam.csi) to seek directly to the parts
+  of the file containing records overlapping @a region.  Subsequent extraction
+  operators read only such records, and then fail (without throwing an
+  exception) as if at the end of the file once all of them have been read.
+  The headers must already have been read, and the file must be sorted by
+  coordinate.
+
+  The stream's @c iostate flags are cleared beforehand, so @c seek() may be
+  used repeatedly to visit several regions in turn.  Streams that are not
+  in BAM format, have no index, or are not seekable fail accordingly.  */
+  isamstream& seek(const seqinterval& region);
+
+  /// Returns the position of the next alignment record
+  /** The position returned can be used with seek(uint64_t) to return to the
+  same record later, without needing an index.  For BAM files, this is a BGZF
+  virtual offset, i.e., the file offset of the BGZF block containing the start
+  of the record, shifted left 16 bits, plus the offset of the record within
+  that block's uncompressed data.  For SAM files, it is simply the byte offset
+  of the record's line within the file.
+
+  On errors, returns 0 and sets the stream's @c iostate flags accordingly.  */
+  uint64_t tell();
+
+  /// Return to a position previously returned by tell()
+  /** Subsequent extraction operators read records from @a offset onwards.
+  The stream's @c iostate flags are cleared beforehand, and any restriction
+  to a region set by seek(const seqinterval&) is lifted.  Streams that are
+  not seekable, such as pipes, fail accordingly.  */
+  isamstream& seek(uint64_t offset);
+
+  /// Process all remaining alignment records in parallel
+  /** Reads the remaining records, passing each to @a handler in no particular
+  order overall, and leaves the stream at EOF.  This is intended for passes
+  over a whole file, such as computing statistics.
+
+  For BAM files being read from memory (i.e., via a sam::membuf, as regular
+  files opened by name are), the remaining compressed data is divided at BGZF
+  block boundaries into up to @a nparts ranges of similar size, which are
+  decompressed and processed on separate threads without needing an index.
+  Each range after the first is resynchronised to its first record boundary
+  by checking that several consecutive plausible records follow; afterwards
+  it is verified that the ranges' records adjoin exactly, and the stream
+  fails if not.  Otherwise, including when a region has been selected with
+  seek(const seqinterval&), records are read in turn on the calling thread
+  and passed to @a handler as part 0.
+
+  If @a handler throws an exception, or if an error occurs, the stream's
+  @c iostate flags are set and exceptions are thrown accordingly as selected
+  via @c exceptions(); in that case the records already processed are
+  unspecified.  */
+  isamstream& scan(alignment_handler& handler, int nparts);
+
+  /// Use a cache of decompressed BGZF blocks
+  /** Subsequent reading consults @a cache before decompressing each BGZF
+  block, and adds newly-decompressed blocks to it.  The stream does not take
+  ownership of @a cache, which must outlive the stream or be detached by
+  using a @a cache of @c NULL.  Other streams reading the same file may use
+  the same cache.
+
+  This has no effect on streams that are not BGZF-compressed.  */
+  void set_block_cache(block_cache* cache);
+
 #if 0
   /// Seek back to the first alignment record in the stream
   // FIXME Or to the start of the stream, i.e., the collection?
   isamstream& rewind();
 #endif
 
-  // FIXME  Some form of seek/tell -- or maybe that's in samstream_base
-
 protected:
   // @cond infrastructure
   virtual void close_();
@@ -218,9 +390,54 @@ public:
   osamstream& operator<< (ios_base& (*manipulator)(ios_base&))
     { manipulator(*this); return *this; }
 
+  /// Set the compression level for BAM and BGZF-compressed SAM output
+  /** Compresses subsequently filled BGZF blocks at @a level, from 0 (no
+  compression, as for uncompressed BAM) to 9 (smallest output), or at
+  sam::default_compression.
+
+  With sam::adaptive_compression, the level is instead varied from block to
+  block according to how the time spent compressing compares with the time
+  spent producing records and waiting for output to be written, so that
+  compression does not become the bottleneck when writing to a pipe or a
+  slow filesystem.  As it depends on timing, such output is not reproducible.
+
+  This has no effect on uncompressed SAM streams.  */
+  void set_compression(int level);
+
+  /// Write behind in a background thread
+  /** Queues up to @a limit bytes of output (e.g., 16 to 64 MB) for a thread
+  to write, so that a slow or networked filesystem does not stall the
+  producer, or writes out the queue and stops the thread if @a limit is 0.
+  This has an effect only when the stream is writing to a sam::rawfilebuf,
+  e.g., when it has opened a regular file itself; see
+  sam::rawfilebuf::set_writebehind().  */
+  void set_writebehind(size_t limit);
+
+  /// Avoid filling the page cache with the data written
+  /** Useful when writing very large files, whose data would otherwise evict
+  other files' data from the page cache.  This has an effect only when the
+  stream is writing to a sam::rawfilebuf, e.g., when it has opened a regular
+  file itself; see sam::rawfilebuf::set_dropbehind().  */
+  void set_dropbehind(bool dropbehind);
+
   /// Flush any uncommitted output
+  /** Also synchronises the stream buffer, e.g., waiting for output queued by
+  sam::rawfilebuf::set_writebehind() to be written.  */
   osamstream& flush();
 
+  /// Build an index for the BAM file being written
+  /** Indexes the alignment records as they are written, saving the index
+  when the stream is closed.  This saves reading the whole file again in order
+  to index it afterwards.  The index is written to @a index_filename, or by
+  default to the stream's filename with @e .bai appended.  If any reference
+  sequence is longer than 2^29 bases, which the BAI format cannot represent,
+  a CSI index is produced instead (and the default filename is @e file.csi).
+
+  This must be used before the headers are written, and the records written
+  must then be sorted by coordinate; unsorted records cause failbit to be set.
+  Streams that are not in BAM format fail accordingly.  */
+  void build_index(const std::string& index_filename = std::string());
+
 protected:
   // @cond infrastructure
   virtual void close_();
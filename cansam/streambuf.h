@@ -1,7 +1,7 @@
 /// @file cansam/streambuf.h
 /// Low-level classes for input/output
 
-/*  Copyright (C) 2010-2012 Genome Research Ltd.
+/*  Copyright (C) 2010-2012, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -32,6 +32,10 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 #define CANSAM_STREAMBUF_H
 
 #include <streambuf>
+#include <vector>
+#include <cstddef>
+
+#include <sys/types.h>
 
 /** @file
 Provides low-level input/output classes derived from @c std::streambuf.
@@ -76,6 +80,17 @@ The usual public @c std::streambuf methods are available as follows:
     are not implemented and simply throw @c std::logic_error;
   - other methods (e.g., @c pubimbue()) have no effect.
 
+Optionally, input can instead be read ahead by a background thread, so that
+@c sgetn() usually just copies data that has already been read; see
+set_readahead().  Similarly output can be written behind by a background
+thread, so that @c sputn() usually just copies data into a queue; see
+set_writebehind().
+
+Alternatively the buffer can read and write at a position of its own, via
+@c pread(2) and @c pwrite(2), rather than at the file descriptor's offset;
+see set_positional().  Written data can be kept from accumulating in the
+page cache; see set_dropbehind().
+
 These methods retry their system calls if they are interrupted by signal
 delivery.  Thus calling code does not need to deal with @c EINTR or
 foreshortened interrupted writes itself.  If a system call fails for other
@@ -84,15 +99,20 @@ reasons, these methods throw sam::system_error exceptions accordingly.
 (To be precise, this class overrides the @c seekoff(), @c seekpos(),
 @c showmanyc(), @c xsgetn(), and @c xsputn() protected methods, and trivially
 overrides @c overflow(), @c uflow(), and @c underflow() as @c throw statements;
-all the others are inherited as no-ops from @c std::streambuf.)  */
+and @c sync() merely waits for any data queued by set_writebehind() to be
+written; all the others are inherited as no-ops from @c std::streambuf.)  */
 class rawfilebuf : public sam::streambuf {
 public:
   /// Construct a closed buffer
-  rawfilebuf() : fd_(-1), owned_(false) { }
+  rawfilebuf()
+    : fd_(-1), owned_(false), positional_(false), position_(0),
+      readahead_(NULL), window_(0), writebehind_(NULL), dropbehind_(NULL) { }
 
   /// Destroy this buffer object, optionally closing the underlying
   /// file descriptor
-  ~rawfilebuf() { if (owned_)  close_nothrow(); }
+  ~rawfilebuf()
+    { stop_readahead(); stop_writebehind(); stop_dropbehind();
+      if (owned_)  close_nothrow(); }
 
   /// Open a file that will be closed when this buffer is destroyed
   rawfilebuf* open(const char* fname, std::ios_base::openmode mode,
@@ -123,12 +143,72 @@ public:
   /// Returns the underlying file descriptor
   int fd() const { return fd_; }
 
+  /// Read ahead in a background thread
+  /** Starts a thread that reads up to @a window bytes (e.g., 8 to 64 MB)
+  beyond the current position into a ring of buffers, which is useful when
+  reading sequentially from slow or networked filesystems.  For regular files,
+  the kernel is also advised that access will be sequential; for pipes, the
+  pipe's capacity is increased if possible.
+
+  Seeking discards the buffered data and restarts reading ahead from the new
+  position, so this is not useful for random access.  Using a @a window of 0
+  stops reading ahead, except that for pipes and other unseekable files it
+  then continues until the file is closed, as the buffered data would
+  otherwise be lost.  */
+  void set_readahead(std::size_t window);
+
+  /// Write behind in a background thread
+  /** Starts a thread that writes the data given to @c sputn(), which then
+  merely appends it to a queue of up to @a limit bytes (e.g., 16 to 64 MB)
+  and returns without waiting for it to be written unless the queue is full.
+  The thread writes the queued data with as few @c writev(2) system calls as
+  possible, so that slow or networked filesystems do not stall the producer.
+
+  Errors encountered by the thread are reported by the next @c sputn(),
+  @c pubsync(), or close(), which throw sam::system_error accordingly.
+  Seeking or reading first waits for the queue to be written.  Using a
+  @a limit of 0 writes out the queue and stops the thread.  */
+  void set_writebehind(std::size_t limit);
+
+  /// Read and write at this buffer's own position, independent of others
+  /** Rather than using and updating the file descriptor's offset via
+  @c read(2), @c write(2), and @c lseek(2), the buffer instead keeps its own
+  position, starting from the descriptor's current offset, and uses
+  @c pread(2) and @c pwrite(2) at that position.  Seeking merely changes this
+  position.  Thus several buffers can share one file descriptor (for
+  example, each having used attach() with the same descriptor) and be used by
+  different threads, e.g., by an isamstream each, to read different regions
+  of the file concurrently, without reopening the file or serialising their
+  seeks.
+
+  Throws sam::system_error if the file is not seekable.  Closing the buffer
+  returns it to using the descriptor's offset.  */
+  void set_positional(bool positional);
+
+  /// Returns whether the buffer reads and writes at its own position
+  bool positional() const { return positional_; }
+
+  /// Drop written data from the page cache
+  /** Writing a very large file would otherwise fill the page cache with its
+  data, evicting other files' data that is more likely to be used again.
+  Instead, as each few megabytes are written, the kernel is asked to start
+  writing them back to disk, and the previous few megabytes, once written
+  back, are dropped from the cache via @c posix_fadvise(2).  Thus only a
+  bounded amount of recently written data remains cached.
+
+  This works with any filesystem, unlike @c O_DIRECT, and in conjunction with
+  set_writebehind() and set_positional().  Seeking or closing the file waits
+  for the data written so far to reach the disk.  It has no effect on pipes
+  and other unseekable files.  */
+  void set_dropbehind(bool dropbehind);
+
 protected:
   // @cond infrastructure
   virtual std::streamsize xsgetn(char*, std::streamsize);
   virtual std::streamsize xsputn(const char*, std::streamsize);
 
   virtual std::streamsize showmanyc();
+  virtual int sync();
 
   virtual std::streampos seekoff(std::streamoff, std::ios_base::seekdir,
 	    std::ios_base::openmode = std::ios_base::in | std::ios_base::out);
@@ -141,16 +221,167 @@ protected:
   // @endcond
 
 private:
+  class readahead;    // Implemented in rawfilebuf.cpp
+  class writebehind;  // Implemented in rawfilebuf.cpp
+  class dropbehind;   // Implemented in rawfilebuf.cpp
+
   int fd_;
   bool owned_;
+  bool positional_;
+  off_t position_;  // When positional_, the position for reading and writing
+  readahead* readahead_;
+  std::size_t window_;
+  writebehind* writebehind_;
+  dropbehind* dropbehind_;
 
   int close_nothrow();
+  off_t offset() const;
+  void set_offset(off_t offset);
+  off_t seek(off_t off, int whence);
+  off_t seek_positional(off_t off, int whence);
+  void start_readahead();
+  void stop_readahead();
+  void drain_writebehind();
+  int stop_writebehind();
+  void stop_dropbehind();
 
   // Prevent copy construction and assignment
   rawfilebuf(const rawfilebuf&);
   rawfilebuf& operator= (const rawfilebuf&);
 };
 
+/** @class sam::membuf cansam/streambuf.h
+    @brief In-memory stream buffer
+
+Provides stream access to data in memory, either a caller-owned block of
+bytes that is read in place without being copied, or a growable buffer owned
+by this object to which output is appended.  The data is exposed as the
+@c std::streambuf get area, so the usual public input methods, @c pubseekoff(),
+and @c pubseekpos() work as expected.  In particular, an isamstream reading
+from a membuf detects the data's format as usual, and decompresses BGZF blocks
+directly from the caller's memory.
+
+Output methods (@c sputn(), @c sputc(), etc) append to the buffer's own data,
+which can then also be read; they throw @c std::logic_error if the buffer
+refers to caller-owned data.  Closing the buffer does not discard its
+contents, so they remain available via data() and size() after, for example,
+an osamstream writing to the buffer has been closed.  */
+class membuf : public sam::streambuf {
+public:
+  /// Construct an open, empty buffer, to which output can be written
+  membuf() : open_(true), writable_(true) { }
+
+  /// Construct a buffer for reading @a length bytes at @a data in place
+  /** The caller's data is not copied, so must remain valid and unchanged
+  while the buffer is being read.  */
+  membuf(const char* data, std::size_t length) : open_(false)
+    { open(data, length); }
+
+  /// Destroy this buffer object, freeing any data written to it
+  virtual ~membuf() { }
+
+  /// Open the buffer for reading @a length bytes at @a data in place
+  /** Returns @c NULL if the buffer is already open.  */
+  membuf* open(const char* data, std::size_t length);
+
+  /// Open the buffer, empty, so that output can be written to it
+  /** Returns @c NULL if the buffer is already open.  */
+  membuf* open();
+
+  /// Returns whether the buffer is open
+  virtual bool is_open() const { return open_; }
+
+  /// Close the buffer, retaining its contents
+  virtual void close() { open_ = false; }
+
+  /// Returns the buffer's entire contents
+  const char* data() const { return eback(); }
+
+  /// Returns the size of the buffer's entire contents
+  std::size_t size() const { return egptr() - eback(); }
+
+  /// Returns the unread part of the buffer's contents
+  /** Sets @a length to the number of bytes available at the returned pointer,
+  which remain valid until the buffer is closed or written to.  */
+  const char* unread(std::streamsize& length) const
+    { length = egptr() - gptr(); return gptr(); }
+
+  /// Consume @a n bytes, as if they had been read
+  virtual void skip(std::streamsize n) { setg(eback(), gptr() + n, egptr()); }
+
+protected:
+  // @cond infrastructure
+  virtual std::streamsize xsgetn(char*, std::streamsize);
+  virtual std::streamsize xsputn(const char*, std::streamsize);
+
+  virtual std::streampos seekoff(std::streamoff, std::ios_base::seekdir,
+	    std::ios_base::openmode = std::ios_base::in | std::ios_base::out);
+  virtual std::streampos seekpos(std::streampos,
+	    std::ios_base::openmode = std::ios_base::in | std::ios_base::out);
+
+  virtual int_type overflow(int_type c = traits_type::eof());
+  // @endcond
+
+private:
+  std::vector<char> storage_;
+  bool open_;
+  bool writable_;
+
+  // Prevent copy construction and assignment
+  membuf(const membuf&);
+  membuf& operator= (const membuf&);
+};
+
+/** @class sam::mmapfilebuf cansam/streambuf.h
+    @brief Memory-mapped read-only file stream buffer
+
+Provides read access to a regular file by mapping the whole of it into memory,
+so that reading requires neither @c read(2) system calls nor, for callers that
+use unread() and skip() directly, copying.  The kernel is advised that the
+file will be read sequentially, and is asked to read ahead of the current
+position as reading progresses.
+
+This is a read-only membuf whose contents are the file's entire contents, so
+the usual public input methods (@c sgetn(), @c sgetc(), @c in_avail(), etc)
+and @c pubseekoff() and @c pubseekpos() work as expected; output methods are
+not available.  As with all memory-mapped files, the program may be sent
+@c SIGBUS if the file is truncated while it is being read.  */
+class mmapfilebuf : public sam::membuf {
+public:
+  /// Construct a closed buffer
+  mmapfilebuf() : membuf(NULL, 0), advised_(NULL) { membuf::close(); }
+
+  /// Destroy this buffer object, unmapping the file
+  ~mmapfilebuf() { close_nothrow(); }
+
+  /// Open and map a file, which must be a regular file
+  /** Returns @c NULL (with @c errno set accordingly) if the file cannot be
+  opened, is not a regular file, or cannot be mapped.  */
+  mmapfilebuf* open(const char* fname);
+
+  /// Unmap the file (if it is open)
+  virtual void close();
+
+  /// Consume @a n bytes, as if they had been read
+  virtual void skip(std::streamsize n) { membuf::skip(n); advise(); }
+
+protected:
+  // @cond infrastructure
+  virtual std::streampos seekpos(std::streampos,
+	    std::ios_base::openmode = std::ios_base::in | std::ios_base::out);
+  // @endcond
+
+private:
+  char* advised_;  // End of the region the kernel has been asked to read ahead
+
+  void advise();
+  int close_nothrow();
+
+  // Prevent copy construction and assignment
+  mmapfilebuf(const mmapfilebuf&);
+  mmapfilebuf& operator= (const mmapfilebuf&);
+};
+
 } // namespace sam
 
 #endif
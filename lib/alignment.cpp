@@ -1,6 +1,6 @@
 /*  alignment.cpp -- Classes and functions for SAM/BAM alignment records.
 
-    Copyright (C) 2010-2015 Genome Research Ltd.
+    Copyright (C) 2010-2015, 2026 Genome Research Ltd.
     Portions copyright (C) 2020 University of Glasgow.
 
     Author: John Marshall <jm18@sanger.ac.uk>
@@ -44,6 +44,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 
 #include <iostream> // FIXME NUKE-ME
 
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define CODEC_X86
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+
 #include "cansam/sam/header.h"
 #include "cansam/exception.h"
 #include "lib/utilities.h"
@@ -117,44 +124,283 @@ cigar_op alignment::cigar(size_t i) const {
   return cigar_op(p->cigar_data() + sizeof(uint32_t) * i);
 }
 
+namespace {
+
+/* Sequence and quality conversions are accelerated by kernels that convert
+a prefix of the data several bases at a time, returning how many bases they
+have converted; the remainder is then converted one or two bases at a time.
+Kernels that encounter invalid characters stop before them, so that the
+remainder code reports the error.  */
+typedef int codec_function(char* dest, const char* src, int length);
+
+int no_kernel(char*, const char*, int) { return 0; }
+
+/* Similarly, span kernels add the lengths of a prefix of the packed CIGAR
+operations that consume the reference to SPAN, returning how many operations
+they have examined.  */
+typedef int span_function(const char* cigar_data, int length, uint32_t& span);
+
+int no_span_kernel(const char*, int, uint32_t&) { return 0; }
+
+#ifdef CODEC_X86
+
+// The sequence codes (see decode_seq below) of the characters with
+// 0x6 and 0x7 as their high nibble, indexed by their low nibble.
+#define __ 16
+#define LETTER_CODES_6 __, 1,14, 2,13,__,__, 4,11,__,__,12,__, 3,15,__
+#define LETTER_CODES_7 __,__, 5, 6, 8,__, 7, 9,__,10,__,__,__,__,__,__
+
+/* Letters are folded to lower case, which also maps other characters in
+0x40-0x5F and 0x00-0x1F to their counterparts in 0x60-0x7F and 0x20-0x3F,
+and then looked up according to their low nibble in the 0x6 or 0x7 table.
+The only codes for other characters are those for '=' and '.', which are
+compared with the unfolded characters.  Invalid characters yield 16.  */
+__attribute__((target("sse2,ssse3")))
+int ssse3_pack_seq(char* dest, const char* seq, int length) {
+  const __m128i codes6 = _mm_setr_epi8(LETTER_CODES_6);
+  const __m128i codes7 = _mm_setr_epi8(LETTER_CODES_7);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+
+  int i = 0;
+  for (; length - i >= 16; i += 16) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&seq[i]));
+    __m128i folded = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i lo = _mm_and_si128(folded, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(folded, 4), nibble);
+
+    __m128i is6 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(0x6));
+    __m128i is7 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(0x7));
+    __m128i equals = _mm_cmpeq_epi8(c, _mm_set1_epi8('='));
+    __m128i dot = _mm_cmpeq_epi8(c, _mm_set1_epi8('.'));
+    __m128i other = _mm_or_si128(_mm_or_si128(is6, is7),
+				 _mm_or_si128(equals, dot));
+
+    __m128i code =
+      _mm_or_si128(_mm_or_si128(
+		     _mm_and_si128(is6, _mm_shuffle_epi8(codes6, lo)),
+		     _mm_and_si128(is7, _mm_shuffle_epi8(codes7, lo))),
+		   _mm_or_si128(
+		     _mm_and_si128(dot, _mm_set1_epi8(15)),
+		     _mm_andnot_si128(other, _mm_set1_epi8(16))));
+
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(code, _mm_set1_epi8(15))))  break;
+
+    // Combine each pair of codes, the first in the high nibble.
+    __m128i pairs = _mm_or_si128(_mm_slli_epi16(code, 4),
+				 _mm_srli_epi16(code, 8));
+    pairs = _mm_and_si128(pairs, _mm_set1_epi16(0x00ff));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(&dest[i / 2]),
+		     _mm_packus_epi16(pairs, pairs));
+  }
+
+  return i;
+}
+
+#undef LETTER_CODES_7
+#undef LETTER_CODES_6
+#undef __
+
+__attribute__((target("sse2,ssse3")))
+int ssse3_unpack_seq(char* dest, const char* raw_seq, int length) {
+  const __m128i bases = _mm_setr_epi8('=', 'A', 'C', 'M', 'G', 'R', 'S', 'V',
+				      'T', 'W', 'Y', 'H', 'K', 'D', 'B', 'N');
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+
+  int i = 0;
+  for (; length - i >= 32; i += 32) {
+    __m128i packed =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(&raw_seq[i / 2]));
+    __m128i hi = _mm_shuffle_epi8(bases,
+		   _mm_and_si128(_mm_srli_epi16(packed, 4), nibble));
+    __m128i lo = _mm_shuffle_epi8(bases, _mm_and_si128(packed, nibble));
+
+    __m128i* out = reinterpret_cast<__m128i*>(&dest[i]);
+    _mm_storeu_si128(out, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(hi, lo));
+  }
+
+  return i;
+}
+
+__attribute__((target("sse2")))
+int sse2_pack_qual(char* dest, const char* qual, int length) {
+  int i = 0;
+  for (; length - i >= 16; i += 16) {
+    __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&qual[i]));
+    __m128i invalid = _mm_or_si128(_mm_cmplt_epi8(q, _mm_set1_epi8(33)),
+				   _mm_cmpgt_epi8(q, _mm_set1_epi8(126)));
+    if (_mm_movemask_epi8(invalid))  break;
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[i]),
+		     _mm_sub_epi8(q, _mm_set1_epi8(33)));
+  }
+
+  return i;
+}
+
+// SSE2 lacks signed byte minimum and maximum, so the signed values are
+// offset by 0x80 to be clamped as unsigned bytes.
+__attribute__((target("sse2")))
+int sse2_unpack_qual(char* dest, const char* phred, int length) {
+  const __m128i offset = _mm_set1_epi8(-0x80);
+  const __m128i lowest = _mm_set1_epi8(0 - 0x80);
+  const __m128i highest = _mm_set1_epi8((126 - 33) - 0x80);
+
+  int i = 0;
+  for (; length - i >= 16; i += 16) {
+    __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&phred[i]));
+    q = _mm_xor_si128(q, offset);
+    q = _mm_min_epu8(_mm_max_epu8(q, lowest), highest);
+    q = _mm_add_epi8(_mm_xor_si128(q, offset), _mm_set1_epi8(33));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[i]), q);
+  }
+
+  return i;
+}
+
+// Each lane accumulates the lengths of every fourth operation, selected by
+// comparing its opcode with each of those that consume the reference.
+__attribute__((target("sse2")))
+int sse2_reference_span(const char* cigar_data, int length, uint32_t& span) {
+  const __m128i opcode = _mm_set1_epi32(0xf);
+  __m128i total = _mm_setzero_si128();
+
+  int i = 0;
+  for (; length - i >= 4; i += 4) {
+    __m128i ops = _mm_loadu_si128(
+		    reinterpret_cast<const __m128i*>(&cigar_data[4 * i]));
+    __m128i op = _mm_and_si128(ops, opcode);
+    __m128i consumes =
+      _mm_or_si128(_mm_or_si128(
+		     _mm_cmpeq_epi32(op, _mm_set1_epi32(MATCH)),
+		     _mm_cmpeq_epi32(op, _mm_set1_epi32(DELETION))),
+		   _mm_or_si128(_mm_or_si128(
+		     _mm_cmpeq_epi32(op, _mm_set1_epi32(REF_SKIP)),
+		     _mm_cmpeq_epi32(op, _mm_set1_epi32(MATCH_EQUAL))),
+		     _mm_cmpeq_epi32(op, _mm_set1_epi32(MATCH_DIFF))));
+    total = _mm_add_epi32(total,
+			  _mm_and_si128(consumes, _mm_srli_epi32(ops, 4)));
+  }
+
+  total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0x4e));
+  total = _mm_add_epi32(total, _mm_shuffle_epi32(total, 0xb1));
+  span += _mm_cvtsi128_si32(total);
+  return i;
+}
+
+#endif
+
+struct codec_functions {
+  codec_function* pack_seq;
+  codec_function* unpack_seq;
+  codec_function* pack_qual;
+  codec_function* unpack_qual;
+  span_function* reference_span;
+};
+
+codec_functions select_codec() {
+  codec_functions codec =
+    { no_kernel, no_kernel, no_kernel, no_kernel, no_span_kernel };
+
+#ifdef CODEC_X86
+  unsigned eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2)) {
+    codec.pack_qual = sse2_pack_qual;
+    codec.unpack_qual = sse2_unpack_qual;
+    codec.reference_span = sse2_reference_span;
+
+    if (ecx & bit_SSSE3) {
+      codec.pack_seq = ssse3_pack_seq;
+      codec.unpack_seq = ssse3_unpack_seq;
+    }
+  }
+#endif
+
+  return codec;
+}
+
+// Chosen once, according to the CPU's capabilities.
+const codec_functions best_codec = select_codec();
+
+// Codes for each character of a SAM sequence string, or 16 if invalid.
+struct sequence_codes { char code[UCHAR_MAX + 1]; };
+
+sequence_codes make_sequence_codes() {
+  typedef unsigned char uchar;
+  sequence_codes codes;
+  char* encode = codes.code;
+
+  for (int i = 0; i <= UCHAR_MAX; i++)  encode[i] = 16;
+  encode[uchar('=')] = 0;
+  encode[uchar('A')] = encode[uchar('a')] = 1;
+  encode[uchar('C')] = encode[uchar('c')] = 2;
+  encode[uchar('M')] = encode[uchar('m')] = 3;
+  encode[uchar('G')] = encode[uchar('g')] = 4;
+  encode[uchar('R')] = encode[uchar('r')] = 5;
+  encode[uchar('S')] = encode[uchar('s')] = 6;
+  encode[uchar('V')] = encode[uchar('v')] = 7;
+  encode[uchar('T')] = encode[uchar('t')] = 8;
+  encode[uchar('W')] = encode[uchar('w')] = 9;
+  encode[uchar('Y')] = encode[uchar('y')] = 10;
+  encode[uchar('H')] = encode[uchar('h')] = 11;
+  encode[uchar('K')] = encode[uchar('k')] = 12;
+  encode[uchar('D')] = encode[uchar('d')] = 13;
+  encode[uchar('B')] = encode[uchar('b')] = 14;
+  encode[uchar('N')] = encode[uchar('n')] = 15;
+  encode[uchar('.')] = 15;
+
+  return codes;
+}
+
+// Built during static initialisation, so that it is complete before any
+// SAM parsing threads share it.
+const sequence_codes seq_encoding = make_sequence_codes();
+
+} // unnamed namespace
+
+// For testing: the number of leading characters that the pack_seq() and
+// pack_qual() kernels chosen for this CPU convert, before leaving the rest
+// to be converted singly.
+int pack_seq_kernel(char* dest, const char* seq, int length) {
+  return best_codec.pack_seq(dest, seq, length);
+}
+
+int pack_qual_kernel(char* dest, const char* qual, int length) {
+  return best_codec.pack_qual(dest, qual, length);
+}
+
+/* The span is cached in the block header, as it is needed repeatedly (for
+bin(), right_zpos(), and indexing) and long reads' CIGARs may have thousands
+of operations.  It is recorded while packing SAM CIGAR strings, and computed
+here on first use for records read from BAM.  */
 scoord_t alignment::cigar_span() const {
   if (p->c.flags & UNMAPPED)  return 1;
 
-  int cigar_length = p->c.cigar_length;
-  const char* cigar_data = p->cigar_data();
+  if (p->h.span == unknown_span) {
+    int cigar_length = p->c.cigar_length;
+    const char* cigar_data = p->cigar_data();
 
-  scoord_t span = 0;
-  for (int i = 0; i < cigar_length; i++, cigar_data += sizeof(uint32_t)) {
-    cigar_op cigar(cigar_data);
-    if (cigar.consumes_reference())  span += cigar.length();
+    uint32_t span = 0;
+    int i = best_codec.reference_span(cigar_data, cigar_length, span);
+    for (cigar_data += sizeof(uint32_t) * i; i < cigar_length;
+	 i++, cigar_data += sizeof(uint32_t)) {
+      cigar_op cigar(cigar_data);
+      if (cigar.consumes_reference())  span += cigar.length();
+    }
+
+    p->h.span = span;
   }
-  return (span > 0)? span : 1;
+
+  return (p->h.span > 0)? p->h.span : 1;
 }
 
 void alignment::pack_seq(char* dest, const char* seq, int seq_length) {
-  static char encode[UCHAR_MAX + 1];
-  typedef unsigned char uchar;
+  const char* encode = seq_encoding.code;
 
-  if (encode[uchar('A')] == '\0') {
-    for (int i = 0; i <= UCHAR_MAX; i++)  encode[i] = 16;
-    encode[uchar('=')] = 0;
-    encode[uchar('A')] = encode[uchar('a')] = 1;
-    encode[uchar('C')] = encode[uchar('c')] = 2;
-    encode[uchar('M')] = encode[uchar('m')] = 3;
-    encode[uchar('G')] = encode[uchar('g')] = 4;
-    encode[uchar('R')] = encode[uchar('r')] = 5;
-    encode[uchar('S')] = encode[uchar('s')] = 6;
-    encode[uchar('V')] = encode[uchar('v')] = 7;
-    encode[uchar('T')] = encode[uchar('t')] = 8;
-    encode[uchar('W')] = encode[uchar('w')] = 9;
-    encode[uchar('Y')] = encode[uchar('y')] = 10;
-    encode[uchar('H')] = encode[uchar('h')] = 11;
-    encode[uchar('K')] = encode[uchar('k')] = 12;
-    encode[uchar('D')] = encode[uchar('d')] = 13;
-    encode[uchar('B')] = encode[uchar('b')] = 14;
-    encode[uchar('N')] = encode[uchar('n')] = 15;
-    encode[uchar('.')] = 15;
-  }
+  int converted = best_codec.pack_seq(dest, seq, seq_length);
+  dest += converted / 2;
+  seq += converted;
+  seq_length -= converted;
 
   const unsigned char* unpacked = reinterpret_cast<const unsigned char*>(seq);
 
@@ -198,9 +444,12 @@ namespace {
     "N=NANCNMNGNRNSNVNTNWNYNHNKNDNBNN"; // 15 = N
 }
 
-// FIXME Use inline template to avoid writing the code twice
-
 char* alignment::unpack_seq(char* dest, const char* raw_seq, int seq_length) {
+  int converted = best_codec.unpack_seq(dest, raw_seq, seq_length);
+  dest += converted;
+  raw_seq += converted / 2;
+  seq_length -= converted;
+
   const unsigned char* packed = reinterpret_cast<const unsigned char*>(raw_seq);
 
   int even_length = seq_length & ~1;
@@ -223,23 +472,15 @@ char* alignment::unpack_seq(char* dest, const char* raw_seq, int seq_length) {
 // all this (c.f. unpack_seq()).
 void alignment::unpack_seq(string::iterator dest,
 			   const char* raw_seq, int seq_length) {
-  const unsigned char* packed = reinterpret_cast<const unsigned char*>(raw_seq);
-
-  int even_length = seq_length & ~1;
-  for (int i = 0; i < even_length; i += 2) {
-    int ndx = 2 * *packed++;
-    *dest++ = decode_seq[ndx];
-    *dest++ = decode_seq[ndx+1];
-  }
-
-  if (even_length < seq_length) {
-    int ndx = 2 * *packed;
-    *dest = decode_seq[ndx];
-  }
+  if (seq_length > 0)  unpack_seq(&*dest, raw_seq, seq_length);
 }
 
 void alignment::pack_qual(char* dest, const char* qual, int seq_length) {
-  for (int i = 0; i < seq_length; i++) {
+  int converted = best_codec.pack_qual(dest, qual, seq_length);
+  dest += converted;
+  qual += converted;
+
+  for (int i = converted; i < seq_length; i++) {
     char q = *qual++;
     if (q < 33 || q > 126)
       throw bad_format(make_string()
@@ -249,7 +490,11 @@ void alignment::pack_qual(char* dest, const char* qual, int seq_length) {
 }
 
 char* alignment::unpack_qual(char* dest, const char* phred, int seq_length) {
+  int converted = best_codec.unpack_qual(dest, phred, seq_length);
+  dest += converted;
+
   const char* phredlim = &phred[seq_length];
+  phred += converted;
   while (phred < phredlim) {
     char q = *phred++;
     if (q < 0)  q = 0;
@@ -262,13 +507,7 @@ char* alignment::unpack_qual(char* dest, const char* phred, int seq_length) {
 
 void alignment::unpack_qual(string::iterator dest,
 			    const char* phred, int seq_length) {
-  for (int i = 0; i < seq_length; i++) {
-    char q = *phred++;
-    if (q < 0)  q = 0;
-    else if (q > 126 - 33)  q = 126 - 33;
-
-    *dest++ = q + 33;
-  }
+  if (seq_length > 0)  unpack_qual(&*dest, phred, seq_length);
 }
 
 // FIXME Hmmm... static method of cigar class?
@@ -287,23 +526,30 @@ int cigar_operator_count(const char* s) {
   return n;
 }
 
-// FIXME Either should be static alignment::pack_cigar(), or hello cigar class
-// FIXME Think about how much this can write and whether it throws on all cigar
-// syntax errors; and whether cigar_operator_count() is named right and is
-// always a bound on how much this can write.
-void pack_cigar(char* dest, const char* cigar) {
+/* Packs the CIGAR string into DEST in a single pass, returning the number of
+operations written and setting SPAN to the number of reference bases they
+consume.  Each operation occupies at least two characters, so DEST needs
+space for at most half as many operations as there are characters.  The
+characters before END may be read in bulk by parse::decimal().  */
+int alignment::pack_cigar(char* dest, const char* cigar, const char* end,
+			  int32_t& span) {
   static const string cigar_operators = "MIDNSHP=X";
 
+  const char* dest0 = dest;
+  span = 0;
+
   const char *s = cigar;
   while (*s) {
     const char* sdigit = s;
-    int len = 0;
-    while (isdigit(*s))
-      len = 10 * len + *s++ - '0';
+    uint32_t len;
+    s = parse::decimal(s, end, len);
 
-    if (s == sdigit)
+    if (s == sdigit || *sdigit == '+')
       throw bad_format(make_string()
 	  << "Missing digits in CIGAR string ('" << cigar << "')");
+    else if (len >= (1 << 28) || isdigit(*s))
+      throw bad_format(make_string()
+	  << "Operation length too large in CIGAR string ('" << cigar << "')");
 
     char op_char = *s++;
     size_t op = cigar_operators.find(op_char);
@@ -318,8 +564,11 @@ void pack_cigar(char* dest, const char* cigar) {
     }
 
     convert::set_bam_uint32(dest, (len << 4) | op);
+    if (cigar_op(dest).consumes_reference())  span += len;
     dest += sizeof(uint32_t);
   }
+
+  return (dest - dest0) / sizeof(uint32_t);
 }
 
 bool operator< (const alignment& a, const alignment& b) {
@@ -390,8 +639,10 @@ void alignment::set_cigar(const char* cigar) {
 		      sizeof(uint32_t) * new_cigar_length);
 
   p->c.cigar_length = new_cigar_length;
+  p->c.bin = unknown_bin;
+  p->h.span = 0;
   if (! (cigar[0] == '*' && cigar[1] == '\0'))
-    pack_cigar(cbuffer, cigar);
+    pack_cigar(cbuffer, cigar, cigar + strlen(cigar), p->h.span);
 }
 
 void alignment::set_cigar(const std::vector<cigar_op>& cigar) {
@@ -401,9 +652,13 @@ void alignment::set_cigar(const std::vector<cigar_op>& cigar) {
 		      sizeof(uint32_t) * new_cigar_length);
 
   p->c.cigar_length = new_cigar_length;
+  p->c.bin = unknown_bin;
+  p->h.span = 0;
   for (std::vector<cigar_op>::const_iterator it = cigar.begin();
-       it != cigar.end(); ++it, cbuffer += sizeof(uint32_t))
+       it != cigar.end(); ++it, cbuffer += sizeof(uint32_t)) {
     convert::set_bam_uint32(cbuffer, it->data_);
+    if (it->consumes_reference())  p->h.span += it->length();
+  }
 }
 
 void alignment::set_mate_rindex(int rindex) {
@@ -463,7 +718,7 @@ have a constant-time default constructor.)  This block lies about its capacity
 so that tests of the form "p->capacity() < some_size" always trigger when  p
 is the empty block.  */
 alignment::block alignment::empty_block = {
-  { 0 /* 37, if truth be told */, 0 },
+  { 0 /* 37, if truth be told */, 0, 0 },
   { 33, -1, 0, 1, 0, 0, 0, 0, 0, -1, 0, 0 },
   { '\0' /* an empty qname C-string */ }
 };
@@ -480,7 +735,9 @@ alignment::block* alignment::block::create(int payload_size) {
 // Copy the block contents (but don't overwrite DEST's capacity field),
 // assuming that the destination's capacity suffices for the source's size.
 void alignment::block::copy(block* dest, const block* src) {
-  memcpy(&dest->h.cindex, &src->h.cindex, sizeof(src->h.cindex) + src->size());
+  const char* start = reinterpret_cast<const char*>(&src->h.cindex);
+  const char* limit = reinterpret_cast<const char*>(&src->c) + src->size();
+  memcpy(&dest->h.cindex, start, limit - start);
 }
 
 // Deallocate the block (which must not be empty_block).
@@ -542,9 +799,9 @@ alignment& alignment::assign(const string& /*line*/) {
 #endif
 
 // FIXME This is pretty crap, and ought to be in utilities.h
-int decimal(const char* s, const char* field_name) {
+int decimal(const char* s, const char* end, const char* field_name) {
   int x;
-  if (*parse::decimal(s, x) != '\0')
+  if (*parse::decimal(s, end, x) != '\0')
     throw bad_format(make_string()
 	<< "Trailing gunge in decimal " << field_name
 	<< " field ('" << s << "')");
@@ -793,6 +1050,13 @@ char* format_sam(char* dest, const alignment::tagfield& aux) {
 }
 
 void alignment::assign(int nfields, const std::vector<char*>& fields, int cindex) {
+  assign(nfields, fields, cindex, collection::find(cindex));
+}
+
+// As above, but with the headers corresponding to CINDEX already looked up.
+// Reference names are only looked up, so this may be called concurrently.
+void alignment::assign(int nfields, const std::vector<char*>& fields,
+		       int cindex, const collection& headers) {
   // An alignment in SAM format is a tab-separated line containing fields
   // ordered as:
   // qname flag rname pos mapq cigar mrname mpos isize seq qual aux...
@@ -804,7 +1068,7 @@ void alignment::assign(int nfields, const std::vector<char*>& fields, int cindex
     throw bad_format("Too few fields in SAM record");
 
   int name_length = fields[qname+1] - fields[qname]; // including terminator
-  int cigar_length = cigar_operator_count(fields[cigar]);
+  int cigar_text_length = fields[cigar+1] - fields[cigar] - 1;
   int seq_length = fields[seq+1] - fields[seq] - 1;
   int qual_length = fields[qual+1] - fields[qual] - 1;
 
@@ -820,8 +1084,10 @@ void alignment::assign(int nfields, const std::vector<char*>& fields, int cindex
       throw bad_format("SEQ and QUAL differ in length");
   }
 
-  int size = sizeof(bamcore) + name_length + (cigar_length * sizeof(uint32_t))
-	     + (seq_length+1)/2 + seq_length;
+  // The CIGAR string is packed in place before its operations are counted,
+  // so initially only an upper bound on its packed size is known.
+  int size = sizeof(bamcore) + name_length + (seq_length+1)/2 + seq_length;
+  int cigar_size_bound = (cigar_text_length / 2) * sizeof(uint32_t);
 
   int aux_size = 0;
   // These aux fields will be properly validated in push_back_sam() below.
@@ -829,21 +1095,16 @@ void alignment::assign(int nfields, const std::vector<char*>& fields, int cindex
     aux_size +=
 	alignment::tagfield::size_sam(fields[i], fields[i+1] - fields[i] - 1);
 
-  if (p->capacity() < size + aux_size)
-    resize_unshare_discard(size + aux_size);
+  if (p->capacity() < size + cigar_size_bound + aux_size)
+    resize_unshare_discard(size + cigar_size_bound + aux_size);
 
   p->h.cindex = cindex;
-  collection& collection = collection::find(cindex);
-
-  // The aux space will be added to rest_length during push_back_sam() below.
-  p->c.rest_length = size - sizeof(p->c.rest_length);
 
-  p->c.rindex = collection.findseq(fields[rname]).index(); // a name or "*"
-  p->c.zpos = decimal(fields[pos], "POS") - 1; // a 1-based pos or 0
+  p->c.rindex = headers.findseq(fields[rname]).index(); // a name or "*"
+  p->c.zpos = decimal(fields[pos], fields[pos+1], "POS") - 1; // 1-based or 0
   p->c.name_length = name_length;
-  p->c.mapq = decimal(fields[mapq], "MAPQ"); // 0..255
+  p->c.mapq = decimal(fields[mapq], fields[mapq+1], "MAPQ"); // 0..255
   p->c.bin = -1;
-  p->c.cigar_length = cigar_length;
   p->c.flags = parse_flags(fields[flag]);
   p->c.read_length = seq_length;
 
@@ -851,15 +1112,27 @@ void alignment::assign(int nfields, const std::vector<char*>& fields, int cindex
   if (fields[mrname][0] == '=' && fields[mrname][1] == '\0')
     p->c.mate_rindex = p->c.rindex;
   else
-    p->c.mate_rindex = collection.findseq(fields[mrname]).index();
+    p->c.mate_rindex = headers.findseq(fields[mrname]).index();
 
-  p->c.mate_zpos = decimal(fields[mpos], "MPOS") - 1; // a 1-based pos or 0
-  p->c.isize = decimal(fields[isize], "ISIZE"); // an insert size or 0
+  p->c.mate_zpos = decimal(fields[mpos], fields[mpos+1], "MPOS") - 1;
+  p->c.isize = decimal(fields[isize], fields[isize+1], "ISIZE"); // or 0
 
   memcpy(p->name_data(), fields[qname], name_length);
 
-  if (! (fields[cigar][0] == '*' || fields[cigar][1] == '\0'))
-    pack_cigar(p->cigar_data(), fields[cigar]);
+  int cigar_length = 0;
+  p->h.span = 0;
+  if (! (fields[cigar][0] == '*' && fields[cigar][1] == '\0'))
+    cigar_length = pack_cigar(p->cigar_data(), fields[cigar], fields[cigar+1],
+			      p->h.span);
+
+  if (cigar_length > UINT16_MAX)
+    throw bad_format("Too many operations in CIGAR string");
+
+  p->c.cigar_length = cigar_length;
+  size += cigar_length * sizeof(uint32_t);
+
+  // The aux space will be added to rest_length during push_back_sam() below.
+  p->c.rest_length = size - sizeof(p->c.rest_length);
 
   // In BAM: int32_t read_len is given, seq is (read_len+1)/2 bytes;
   //         qual is read_len bytes (Phred qualities), maybe 0xFF x read_len.
@@ -898,7 +1171,7 @@ void alignment::push_back_sam(const char* aux, int length) {
   case 'i': {
     // TODO  Conceivably take heroic steps to represent unsigned [2^31, 2^32)
     int ivalue;
-    if (*parse::decimal(value, ivalue) != '\0')
+    if (*parse::decimal(value, &aux[length], ivalue) != '\0')
       throw bad_format(make_string()
 	  << "Numeric aux field has non-numeric value '" << value << "')");
     push_back(tag, ivalue);
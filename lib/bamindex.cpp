@@ -0,0 +1,522 @@
+/*  bamindex.cpp -- BAI/CSI indexes for BAM files.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#include "lib/bamindex.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+
+#include <errno.h>
+
+#include "cansam/exception.h"
+#include "lib/bgzf.h"
+#include "lib/wire.h"
+
+using std::string;
+
+namespace sam {
+
+namespace {
+
+// Marks linear index windows not (yet) overlapped by any records.
+const uint64_t unset_offset = ~uint64_t(0);
+
+// Sequential reader for the little-endian binary fields of an index file.
+class index_reader {
+public:
+  index_reader(const string& data, const string& filename)
+    : p(data.data()), limit(data.data() + data.length()), name(filename) { }
+
+  const char* bytes(size_t n) {
+    if (size_t(limit - p) < n)
+      throw bad_format("Truncated index file " + name);
+
+    const char* s = p;
+    p += n;
+    return s;
+  }
+
+  int32_t  int32()  { return convert::int32(bytes(4)); }
+  uint32_t uint32() { return convert::uint32(bytes(4)); }
+  uint64_t uint64() { return convert::uint64(bytes(8)); }
+
+  // Returns a count field, which must be non-negative.
+  int32_t count() {
+    int32_t n = int32();
+    if (n < 0)  throw bad_format("Invalid count in index file " + name);
+    return n;
+  }
+
+private:
+  const char* p;
+  const char* limit;
+  const string& name;
+};
+
+// Sequential writer for the little-endian binary fields of an index file.
+class index_writer {
+public:
+  index_writer(string& data) : s(data) { }
+
+  void bytes(const char* data, size_t n) { s.append(data, n); }
+
+  void int32(int32_t x)
+    { char buf[4]; convert::set_bam_int32(buf, x); s.append(buf, 4); }
+  void uint32(uint32_t x)
+    { char buf[4]; convert::set_bam_uint32(buf, x); s.append(buf, 4); }
+  void uint64(uint64_t x)
+    { char buf[8]; convert::set_bam_uint64(buf, x); s.append(buf, 8); }
+
+private:
+  string& s;
+};
+
+// Returns the concatenated contents of the BGZF blocks comprising DATA.
+string inflate_blocks(const string& data, const string& filename) {
+  block_inflater inflater;
+  std::vector<char> buffer(BGZF::uncompressed_max_size);
+  string text;
+
+  size_t pos = 0;
+  while (pos < data.length()) {
+    const char* block = data.data() + pos;
+    size_t length = data.length() - pos;
+    if (! BGZF::is_bgzf_header(block, std::min(length, size_t(BGZF::hsize))))
+      throw bad_format("Invalid BGZF block in index file " + filename);
+
+    size_t size = BGZF::block_size(block);
+    if (size > length || size < size_t(BGZF::hsize + BGZF::tsize))
+      throw bad_format("Truncated BGZF block in index file " + filename);
+
+    text.append(&buffer[0],
+		inflater.inflate(&buffer[0], buffer.size(), block, size));
+    pos += size;
+  }
+
+  return text;
+}
+
+} // anonymous namespace
+
+void bam_index::load(const string& filename) {
+  std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+  if (! file)  throw sam::system_error("can't open ", filename, errno);
+
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  if (file.bad())  throw sam::system_error("can't read ", filename, errno);
+
+  // BAI files are uncompressed, while CSI files are BGZF-compressed.
+  const string data = contents.str();
+  if (BGZF::is_gzip_header(data.data(), data.length()))
+    parse(inflate_blocks(data, filename), filename);
+  else
+    parse(data, filename);
+}
+
+void bam_index::parse(const string& data, const string& filename) {
+  index_reader in(data, filename);
+
+  int new_min_shift = 14;
+  int new_depth = 5;
+  bool new_csi;
+
+  const char* magic = in.bytes(4);
+  if (memcmp(magic, "BAI\1", 4) == 0)
+    new_csi = false;
+  else if (memcmp(magic, "CSI\1", 4) == 0) {
+    new_csi = true;
+    new_min_shift = in.int32();
+    new_depth = in.int32();
+    in.bytes(in.count());  // Auxiliary data is ignored
+
+    if (new_min_shift < 0 || new_depth < 0 || new_depth > 9 ||
+	new_min_shift + 3 * new_depth > 62)
+      throw bad_format("Invalid CSI binning parameters in " + filename);
+  }
+  else
+    throw bad_format("Invalid BAI/CSI magic number in " + filename);
+
+  std::vector<reference> newrefs(in.count());
+  for (size_t i = 0; i < newrefs.size(); i++) {
+    reference& ref = newrefs[i];
+
+    int32_t nbins = in.count();
+    for (int32_t j = 0; j < nbins; j++) {
+      bin& b = ref.bins[in.uint32()];
+      if (new_csi)  b.loffset = in.uint64();
+      int32_t nchunks = in.count();
+      b.chunks.reserve(b.chunks.size() + nchunks);
+      for (int32_t k = 0; k < nchunks; k++) {
+	uint64_t begin = in.uint64();
+	uint64_t end = in.uint64();
+	b.chunks.push_back(chunk(begin, end));
+      }
+    }
+
+    if (! new_csi) {
+      ref.linear.resize(in.count());
+      for (size_t j = 0; j < ref.linear.size(); j++)
+	ref.linear[j] = in.uint64();
+    }
+  }
+
+  // Any trailing count of unplaced unmapped reads is ignored.
+
+  refs.swap(newrefs);
+  min_shift = new_min_shift;
+  depth = new_depth;
+  csi = new_csi;
+  building = chunk_open = false;
+}
+
+namespace {
+
+bool chunk_less(const bam_index::chunk& a, const bam_index::chunk& b) {
+  return a.begin < b.begin;
+}
+
+} // anonymous namespace
+
+// Returns the bin number of the smallest bin containing [ZSTART,ZLIMIT).
+unsigned bam_index::reg2bin(int64_t zstart, int64_t zlimit) const {
+  int64_t zlast = zlimit - 1;
+  int shift = min_shift;
+  for (int level = depth; level > 0; level--, shift += 3)
+    if (zstart >> shift == zlast >> shift)
+      return ((1 << (3 * level)) - 1) / 7 + (zstart >> shift);
+
+  return 0;
+}
+
+// Returns the index of the first linear index window covered by BIN.
+unsigned bam_index::bin_window(unsigned bin) const {
+  int level = 0;
+  for (unsigned b = bin; b > 0; b = (b - 1) >> 3)  level++;
+
+  return (bin - ((1 << (3 * level)) - 1) / 7) << (3 * (depth - level));
+}
+
+// CSI indexes have no linear index, so use the lowest offset of the nearest
+// bin at or before ZSTART at the lowest level of the hierarchy, or failing
+// that, of its nearest ancestor.  (This is the same as htslib's approach.)
+uint64_t bam_index::csi_min_offset(const reference& ref, coord_t zstart) const {
+  int64_t window = int64_t(zstart) >> min_shift;
+  int64_t nwindows = int64_t(1) << (3 * depth);
+  if (window >= nwindows)  window = nwindows - 1;
+
+  unsigned bin = ((1 << (3 * depth)) - 1) / 7 + window;
+  bin_map::const_iterator it;
+  while ((it = ref.bins.find(bin)) == ref.bins.end() && bin > 0) {
+    unsigned first_sibling = (((bin - 1) >> 3) << 3) + 1;
+    bin = (bin > first_sibling)? bin - 1 : (bin - 1) >> 3;
+  }
+
+  return (it != ref.bins.end())? it->second.loffset : 0;
+}
+
+void bam_index::find_chunks(std::vector<chunk>& chunks,
+			    int rindex, coord_t zstart, coord_t zlimit) const {
+  chunks.clear();
+  if (rindex < 0 || rindex >= int(refs.size()) || zstart >= zlimit)  return;
+
+  const reference& ref = refs[rindex];
+
+  // Records ending before the linear index's offset for the window containing
+  // ZSTART cannot overlap the region.
+  uint64_t min_offset = 0;
+  if (csi)
+    min_offset = csi_min_offset(ref, zstart);
+  else if (! ref.linear.empty()) {
+    size_t window = zstart >> min_shift;
+    min_offset = ref.linear[std::min(window, ref.linear.size() - 1)];
+  }
+
+  // Visit the bins overlapping the region at each level of the hierarchy,
+  // from the single top-level bin (level 0) downwards.
+  int shift = min_shift + depth * 3;
+  int64_t last = zlimit - 1;
+  if (last >= (int64_t(1) << shift))  last = (int64_t(1) << shift) - 1;
+
+  unsigned level_first = 0;
+  for (int level = 0; level <= depth; level++, shift -= 3) {
+    unsigned first = level_first + (int64_t(zstart) >> shift);
+    unsigned limit = level_first + (last >> shift) + 1;
+
+    for (bin_map::const_iterator it = ref.bins.lower_bound(first);
+	 it != ref.bins.end() && it->first < limit; ++it)
+      for (std::vector<chunk>::const_iterator c = it->second.chunks.begin();
+	   c != it->second.chunks.end(); ++c)
+	if (c->end > min_offset)  chunks.push_back(*c);
+
+    level_first += 1 << (level * 3);
+  }
+
+  std::sort(chunks.begin(), chunks.end(), chunk_less);
+
+  // Merge chunks that overlap or abut, or that meet within a BGZF block.
+  std::vector<chunk>::iterator out = chunks.begin();
+  for (std::vector<chunk>::iterator c = chunks.begin(); c != chunks.end(); ++c)
+    if (out != chunks.begin() &&
+	(c->begin <= (out-1)->end || c->begin >> 16 == (out-1)->end >> 16)) {
+      if (c->end > (out-1)->end)  (out-1)->end = c->end;
+    }
+    else
+      *out++ = *c;
+
+  chunks.erase(out, chunks.end());
+}
+
+void bam_index::start(const std::vector<coord_t>& lengths) {
+  coord_t max_length = 0;
+  for (size_t i = 0; i < lengths.size(); i++)
+    if (lengths[i] > max_length)  max_length = lengths[i];
+
+  min_shift = 14;
+  depth = 5;
+  csi = int64_t(max_length) > (int64_t(1) << (min_shift + 3 * depth));
+
+  if (csi) {
+    // Use just enough levels to cover the longest reference sequence, with
+    // some leeway for records extending beyond its end (as htslib does).
+    depth = 0;
+    int64_t size = int64_t(1) << min_shift;
+    for (int64_t limit = int64_t(max_length) + 256; limit > size; size <<= 3)
+      depth++;
+  }
+
+  refs.assign(lengths.size(), reference());
+
+  building = true;
+  chunk_open = false;
+  last_rindex = -1;
+  last_zstart = 0;
+  last_end = 0;
+  nunplaced = 0;
+}
+
+// Add the chunk being extended (if any) to its bin.
+void bam_index::end_chunk() {
+  if (chunk_open) {
+    refs[last_rindex].bins[chunk_bin].chunks.push_back(
+					      chunk(chunk_begin, last_end));
+    chunk_open = false;
+  }
+}
+
+void bam_index::add(int rindex, coord_t zstart, coord_t zlimit, bool mapped,
+		    uint64_t begin, uint64_t end) {
+  if (! building)  throw std::logic_error("bam_index::add() without start()");
+
+  if (rindex < 0) {
+    // Unplaced records come last, and are merely counted.
+    end_chunk();
+    nunplaced++;
+    last_end = end;
+    return;
+  }
+
+  if (rindex >= int(refs.size()))
+    throw bad_format("Alignment record's reference sequence is not listed "
+		     "in the headers, so can't be indexed");
+
+  if (nunplaced > 0 || rindex < last_rindex ||
+      (rindex == last_rindex && zstart < last_zstart))
+    throw bad_format("Alignment records are not sorted by coordinate, "
+		     "so can't be indexed");
+
+  if (rindex != last_rindex) {
+    end_chunk();
+    last_rindex = rindex;
+    refs[rindex].begin = begin;
+  }
+
+  last_zstart = zstart;
+
+  if (zstart < 0)  zstart = 0;
+  if (zlimit <= zstart)  zlimit = zstart + 1;
+
+  unsigned bin = reg2bin(zstart, zlimit);
+  if (! chunk_open || bin != chunk_bin) {
+    end_chunk();
+    chunk_open = true;
+    chunk_bin = bin;
+    chunk_begin = begin;
+  }
+
+  reference& ref = refs[rindex];
+  if (mapped) {
+    size_t first = zstart >> min_shift;
+    size_t last = (zlimit - 1) >> min_shift;
+    if (ref.linear.size() <= last)  ref.linear.resize(last + 1, unset_offset);
+
+    for (size_t window = first; window <= last; window++)
+      if (ref.linear[window] == unset_offset)  ref.linear[window] = begin;
+
+    ref.nmapped++;
+  }
+  else
+    ref.nunmapped++;
+
+  ref.end = end;
+  last_end = end;
+}
+
+void bam_index::finish(const bgzf_offset_map& offsets) {
+  end_chunk();
+  building = false;
+
+  for (std::vector<reference>::iterator ref = refs.begin();
+       ref != refs.end(); ++ref) {
+    if (ref->bins.empty())  continue;
+
+    ref->begin = offsets.voffset(ref->begin);
+    ref->end = offsets.voffset(ref->end);
+
+    // Translate each bin's chunks, merging those that meet within a block.
+    for (bin_map::iterator it = ref->bins.begin(); it != ref->bins.end(); ++it){
+      std::vector<chunk>& chunks = it->second.chunks;
+      std::vector<chunk>::iterator out = chunks.begin();
+      for (std::vector<chunk>::iterator c = chunks.begin();
+	   c != chunks.end(); ++c) {
+	chunk vc(offsets.voffset(c->begin), offsets.voffset(c->end));
+	if (out != chunks.begin() && vc.begin >> 16 == (out-1)->end >> 16)
+	  (out-1)->end = vc.end;
+	else
+	  *out++ = vc;
+      }
+
+      chunks.erase(out, chunks.end());
+    }
+
+    // Fill in the linear index's gaps from the preceding window, or from
+    // the start of the reference sequence's records.
+    uint64_t previous = ref->begin;
+    for (std::vector<uint64_t>::iterator it = ref->linear.begin();
+	 it != ref->linear.end(); ++it)
+      if (*it == unset_offset)  *it = previous;
+      else  previous = *it = offsets.voffset(*it);
+
+    if (csi) {
+      for (bin_map::iterator it = ref->bins.begin();
+	   it != ref->bins.end(); ++it) {
+	size_t window = bin_window(it->first);
+	it->second.loffset =
+	    (window < ref->linear.size())? ref->linear[window] : 0;
+      }
+
+      ref->linear.clear();
+    }
+
+    // The metadata pseudo-bin's second "chunk" holds counts, not offsets.
+    std::vector<chunk>& meta = ref->bins[bin_limit() + 1].chunks;
+    meta.push_back(chunk(ref->begin, ref->end));
+    meta.push_back(chunk(ref->nmapped, ref->nunmapped));
+  }
+}
+
+void bam_index::save(const string& filename) const {
+  string data;
+  index_writer out(data);
+
+  if (csi) {
+    out.bytes("CSI\1", 4);
+    out.int32(min_shift);
+    out.int32(depth);
+    out.int32(0);  // No auxiliary data
+  }
+  else
+    out.bytes("BAI\1", 4);
+
+  out.int32(refs.size());
+  for (std::vector<reference>::const_iterator ref = refs.begin();
+       ref != refs.end(); ++ref) {
+    out.int32(ref->bins.size());
+    for (bin_map::const_iterator it = ref->bins.begin();
+	 it != ref->bins.end(); ++it) {
+      out.uint32(it->first);
+      if (csi)  out.uint64(it->second.loffset);
+      out.int32(it->second.chunks.size());
+      for (std::vector<chunk>::const_iterator c = it->second.chunks.begin();
+	   c != it->second.chunks.end(); ++c) {
+	out.uint64(c->begin);
+	out.uint64(c->end);
+      }
+    }
+
+    if (! csi) {
+      out.int32(ref->linear.size());
+      for (std::vector<uint64_t>::const_iterator it = ref->linear.begin();
+	   it != ref->linear.end(); ++it)
+	out.uint64(*it);
+    }
+  }
+
+  out.uint64(nunplaced);
+
+  std::ofstream file(filename.c_str(),
+		     std::ios::out | std::ios::trunc | std::ios::binary);
+  if (! file)  throw sam::system_error("can't write ", filename, errno);
+
+  if (csi) {
+    // CSI files are BGZF-compressed, ending with an empty block as EOF marker.
+    block_deflater deflater(Z_DEFAULT_COMPRESSION);
+    std::vector<char> block(BGZF::full_block_size);
+    size_t pos = 0;
+    do {
+      size_t length = std::min(data.length() - pos,
+			       size_t(BGZF::uncompressed_block_size));
+      file.write(&block[0], deflater.deflate(&block[0], &data[pos], length));
+      pos += length;
+    } while (pos < data.length());
+
+    file.write(&block[0], deflater.deflate(&block[0], NULL, 0));
+  }
+  else
+    file.write(data.data(), data.length());
+
+  file.close();
+  if (! file)  throw sam::system_error("can't write ", filename, errno);
+}
+
+uint64_t bgzf_offset_map::voffset(uint64_t uoffset) const {
+  // Find the last block starting at or before UOFFSET.
+  std::vector<uint64_t>::const_iterator it =
+    std::upper_bound(upos.begin(), upos.end(), uoffset);
+  if (it == upos.begin())
+    throw std::logic_error("offset precedes the first BGZF block");
+
+  size_t i = (it - upos.begin()) - 1;
+  return (fpos[i] << 16) | (uoffset - upos[i]);
+}
+
+} // namespace sam
@@ -0,0 +1,170 @@
+/*  bamindex.h -- BAI/CSI indexes for BAM files.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#ifndef BAMINDEX_H
+#define BAMINDEX_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "cansam/types.h"
+
+namespace sam {
+
+class bgzf_offset_map;
+
+/* A BAM index maps genomic regions to the parts of a BAM file containing
+the alignment records that overlap them.  Each reference sequence's records
+are assigned to bins within a hierarchy of ever-smaller intervals; each bin
+lists chunks of the file, delimited by BGZF virtual file offsets (i.e., the
+offset of the start of a BGZF block in the file, shifted left 16 bits, plus
+an offset within that block's uncompressed data).  A linear index records,
+for each 2^min_shift-sized window, the lowest offset of any record overlapping
+that window, which is used to discard chunks that end before any overlapping
+records could appear.  The BAI format uses min_shift 14 and depth 5, so can
+only represent reference sequences of up to 2^29 bases.  The CSI format has
+a variable depth, and replaces the linear index with a lowest offset stored
+with each bin.  */
+class bam_index {
+public:
+  struct chunk {
+    chunk() { }
+    chunk(uint64_t b, uint64_t e) : begin(b), end(e) { }
+    uint64_t begin, end;
+  };
+
+  bam_index() : min_shift(14), depth(5), csi(false),
+      building(false), chunk_open(false) { }
+  ~bam_index() { }
+
+  // Load the BAI or CSI file FILENAME, throwing an exception if it is
+  // unreadable or invalid.
+  void load(const std::string& filename);
+
+  // Returns whether an index has been loaded or started.
+  bool empty() const { return refs.empty(); }
+
+  // Returns whether this is (or will be saved as) a CSI index.
+  bool is_csi() const { return csi; }
+
+  // Fill CHUNKS with the sorted, disjoint list of chunks that may contain
+  // records on reference sequence RINDEX that overlap [ZSTART,ZLIMIT).
+  void find_chunks(std::vector<chunk>& chunks,
+		   int rindex, coord_t zstart, coord_t zlimit) const;
+
+  // Start building a new index for reference sequences of the given LENGTHS.
+  // A CSI index is built if any of them is too long for the BAI format.
+  void start(const std::vector<coord_t>& lengths);
+
+  // Add a record spanning [ZSTART,ZLIMIT) on reference sequence RINDEX (or
+  // unplaced, if RINDEX is negative), and occupying [BEGIN,END) in the file.
+  // Records must be added in coordinate order; the offsets can be positions
+  // within the uncompressed data, which finish() will translate.
+  void add(int rindex, coord_t zstart, coord_t zlimit, bool mapped,
+	   uint64_t begin, uint64_t end);
+
+  // Complete the index, translating the offsets given to add() via OFFSETS.
+  void finish(const bgzf_offset_map& offsets);
+
+  // Write the completed index to FILENAME, in BAI or CSI format as needed.
+  void save(const std::string& filename) const;
+
+private:
+  struct bin {
+    bin() : loffset(0) { }
+    uint64_t loffset;  // Used only by CSI indexes
+    std::vector<chunk> chunks;
+  };
+
+  typedef std::map<unsigned, bin> bin_map;
+
+  struct reference {
+    reference() : begin(0), end(0), nmapped(0), nunmapped(0) { }
+    bin_map bins;
+    std::vector<uint64_t> linear;
+
+    // Metadata written as a pseudo-bin: the extent of the reference
+    // sequence's records within the file, and how many are (un)mapped.
+    uint64_t begin, end;
+    uint64_t nmapped, nunmapped;
+  };
+
+  unsigned reg2bin(int64_t zstart, int64_t zlimit) const;
+  unsigned bin_limit() const { return ((1 << (3 * (depth+1))) - 1) / 7; }
+  unsigned bin_window(unsigned bin) const;
+  uint64_t csi_min_offset(const reference& ref, coord_t zstart) const;
+  void parse(const std::string& data, const std::string& filename);
+  void end_chunk();
+
+  std::vector<reference> refs;
+  int min_shift;
+  int depth;
+  bool csi;
+
+  // State used while adding records: the reference sequence and position of
+  // the previous record, the end of the file data added so far, and the bin
+  // and starting offset of the chunk currently being extended.
+  bool building;
+  bool chunk_open;
+  int last_rindex;
+  coord_t last_zstart;
+  uint64_t last_end;
+  unsigned chunk_bin;
+  uint64_t chunk_begin;
+  uint64_t nunplaced;
+};
+
+// Translates positions within a BGZF file's uncompressed data to virtual
+// offsets, given the positions of the start of each of the file's blocks
+// within the uncompressed data and within the file.
+class bgzf_offset_map {
+public:
+  bgzf_offset_map() { }
+  ~bgzf_offset_map() { }
+
+  void clear() { upos.clear(); fpos.clear(); }
+
+  // Record that the block at file offset FOFFSET contains the uncompressed
+  // data starting at UOFFSET.  Blocks must be added in order, followed by
+  // the final end of the uncompressed data and of the file.
+  void add(uint64_t uoffset, uint64_t foffset)
+    { upos.push_back(uoffset); fpos.push_back(foffset); }
+
+  uint64_t voffset(uint64_t uoffset) const;
+
+private:
+  std::vector<uint64_t> upos, fpos;
+};
+
+} // namespace sam
+
+#endif
@@ -0,0 +1,527 @@
+/*  bgzf.cpp -- BGZF block format utilities.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#include "lib/bgzf.h"
+
+#include <new>
+#include <stdexcept>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define CRC32_PCLMUL
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#elif defined __ARM_FEATURE_CRC32 && defined __AARCH64EL__
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#endif
+
+#include "cansam/exception.h"
+#include "lib/utilities.h"
+
+namespace sam {
+
+std::string zlib_message(const char* function, const z_stream& z) {
+  make_string s;
+  s << "zlib::" << function << "() failed";
+  if (z.msg)  s << ": " << z.msg;
+  return s;
+}
+
+class block_inflater::backend {
+public:
+  virtual ~backend() { }
+  virtual size_t inflate(char* dest, size_t capacity,
+			 const char* data, size_t length) = 0;
+};
+
+class block_deflater::backend {
+public:
+  virtual ~backend() { }
+
+  // Compress the data into at most CAPACITY bytes at DEST, returning the size
+  // of the compressed data or 0 if it does not fit.
+  virtual size_t deflate(char* dest, size_t capacity,
+			 const char* data, size_t length) = 0;
+};
+
+namespace {
+
+typedef unsigned char uchar;  // For casting to the pointers exposed by zlib
+
+uint32_t zlib_crc32(const char* data, size_t length) {
+  return ::crc32(::crc32(0, NULL, 0),
+		 reinterpret_cast<const uchar*>(data), length);
+}
+
+#ifdef CRC32_PCLMUL
+
+/* Folds 64 bytes at a time using carry-less multiplication, following Intel's
+"Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+white paper, with constants for the bit-reflected GZIP polynomial.  LENGTH
+must be a multiple of 16 and at least 64.  CRC and the result are the
+un-inverted intermediate CRC values.  */
+__attribute__((target("sse2,pclmul")))
+uint32_t pclmul_crc32_fold(uint32_t crc, const char* data, size_t length) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  const __m128i* p = reinterpret_cast<const __m128i*>(data);
+  __m128i x1 = _mm_loadu_si128(p++);
+  __m128i x2 = _mm_loadu_si128(p++);
+  __m128i x3 = _mm_loadu_si128(p++);
+  __m128i x4 = _mm_loadu_si128(p++);
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  length -= 64;
+
+  for (; length >= 64; length -= 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(p++));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(p++));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(p++));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(p++));
+  }
+
+  // Fold the four accumulators, and then any remaining 16-byte blocks,
+  // into a single 128-bit value.
+  __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  for (; length >= 16; length -= 16) {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(p++)), x5);
+  }
+
+  // Fold 128 bits down to 64, and then Barrett-reduce to 32 bits.
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+uint32_t pclmul_crc32(const char* data, size_t length) {
+  if (length < 64)  return zlib_crc32(data, length);
+
+  size_t fold_length = length & ~size_t(15);
+  uint32_t crc = ~pclmul_crc32_fold(~uint32_t(0), data, fold_length);
+  return ::crc32(crc, reinterpret_cast<const uchar*>(data + fold_length),
+		 length - fold_length);
+}
+
+#endif
+
+#ifdef CRC32_ARMV8
+
+uint32_t armv8_crc32(const char* data, size_t length) {
+  uint32_t crc = ~uint32_t(0);
+
+  for (; length >= 8; data += 8, length -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof word);
+    crc = __crc32d(crc, word);
+  }
+
+  for (; length > 0; data++, length--)
+    crc = __crc32b(crc, *data);
+
+  return ~crc;
+}
+
+#endif
+
+typedef uint32_t crc32_function(const char*, size_t);
+
+crc32_function* select_crc32() {
+#if defined CRC32_PCLMUL
+  unsigned eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+      (ecx & bit_PCLMUL) && (edx & bit_SSE2))
+    return pclmul_crc32;
+#elif defined CRC32_ARMV8
+  return armv8_crc32;
+#endif
+
+  return zlib_crc32;
+}
+
+// Chosen once, according to the CPU's capabilities.
+crc32_function* const best_crc32 = select_crc32();
+
+class zlib_inflater : public block_inflater::backend {
+public:
+  zlib_inflater() : active(false) { }
+  virtual ~zlib_inflater();
+  virtual size_t inflate(char*, size_t, const char*, size_t);
+
+private:
+  z_stream z;
+  bool active;
+};
+
+zlib_inflater::~zlib_inflater() {
+  // In general, destructors should not throw exceptions, but Z_STREAM_ERRORs
+  // reported here represent bugs in the calling program; since this Can't
+  // Happen, we'd like to hear about it, either by exception or terminate().
+  if (active) {
+    if (inflateEnd(&z) != Z_OK)
+      throw std::logic_error(zlib_message("inflateEnd", z));
+  }
+}
+
+size_t zlib_inflater::inflate(char* dest, size_t capacity,
+			      const char* data, size_t length) {
+  z.next_in  = reinterpret_cast<uchar*>(const_cast<char*>(data));
+  z.avail_in = length;
+
+  if (active) {
+    if (inflateReset(&z) != Z_OK)
+      throw std::logic_error(zlib_message("inflateReset", z));
+  }
+  else {
+    z.zalloc = Z_NULL;
+    z.zfree  = Z_NULL;
+    if (inflateInit2(&z, -15) != Z_OK)
+      throw std::logic_error(zlib_message("inflateInit2", z));
+    active = true;
+  }
+
+  z.next_out  = reinterpret_cast<uchar*>(dest);
+  z.avail_out = capacity;
+  if (::inflate(&z, Z_FINISH) != Z_STREAM_END)
+    throw bad_format(zlib_message("inflate", z));
+
+  return z.total_out;
+}
+
+class zlib_deflater : public block_deflater::backend {
+public:
+  zlib_deflater(int level) : level(level), active(false) { }
+  virtual ~zlib_deflater();
+  virtual size_t deflate(char*, size_t, const char*, size_t);
+
+private:
+  int level;
+  z_stream z;
+  bool active;
+};
+
+zlib_deflater::~zlib_deflater() {
+  // As for zlib_inflater, except that Z_DATA_ERROR is ignored as it will
+  // already have been reported by deflate() and we are likely unwinding.
+  if (active) {
+    int status = deflateEnd(&z);
+    if (status != Z_OK && status != Z_DATA_ERROR)
+      throw std::logic_error(zlib_message("deflateEnd", z));
+  }
+}
+
+size_t zlib_deflater::deflate(char* dest, size_t capacity,
+			      const char* data, size_t length) {
+  z.next_in  = reinterpret_cast<uchar*>(const_cast<char*>(data));
+  z.avail_in = length;
+
+  if (active) {
+    if (deflateReset(&z) != Z_OK)
+      throw std::logic_error(zlib_message("deflateReset", z));
+  }
+  else {
+    z.zalloc = Z_NULL;
+    z.zfree  = Z_NULL;
+    if (deflateInit2(&z, level, Z_DEFLATED,
+		     -15, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::logic_error(zlib_message("deflateInit2", z));
+    active = true;
+  }
+
+  z.next_out  = reinterpret_cast<uchar*>(dest);
+  z.avail_out = capacity;
+
+  int status = ::deflate(&z, Z_FINISH);
+  if (status == Z_OK)  return 0;  // The output space was exhausted
+  else if (status != Z_STREAM_END)
+    throw sam::exception(zlib_message("deflate", z));
+
+  return z.total_out;
+}
+
+#ifdef HAVE_LIBDEFLATE
+
+class libdeflate_inflater : public block_inflater::backend {
+public:
+  libdeflate_inflater();
+  virtual ~libdeflate_inflater() { libdeflate_free_decompressor(d); }
+  virtual size_t inflate(char*, size_t, const char*, size_t);
+
+private:
+  libdeflate_decompressor* d;
+};
+
+libdeflate_inflater::libdeflate_inflater()
+  : d(libdeflate_alloc_decompressor()) {
+  if (d == NULL)  throw std::bad_alloc();
+}
+
+size_t libdeflate_inflater::inflate(char* dest, size_t capacity,
+				    const char* data, size_t length) {
+  size_t size;
+  switch (libdeflate_deflate_decompress(d, data, length,
+					dest, capacity, &size)) {
+  case LIBDEFLATE_SUCCESS:
+    return size;
+
+  case LIBDEFLATE_INSUFFICIENT_SPACE:
+    throw bad_format("libdeflate: decompressed data exceeds BGZF block size");
+
+  default:
+    throw bad_format("libdeflate: invalid compressed data");
+  }
+}
+
+class libdeflate_deflater : public block_deflater::backend {
+public:
+  libdeflate_deflater(int level);
+  virtual ~libdeflate_deflater() { libdeflate_free_compressor(c); }
+  virtual size_t deflate(char*, size_t, const char*, size_t);
+
+private:
+  libdeflate_compressor* c;
+};
+
+// Libdeflate's levels extend beyond zlib's 0 to 9, and its default is also 6.
+libdeflate_deflater::libdeflate_deflater(int level)
+  : c(libdeflate_alloc_compressor((level == Z_DEFAULT_COMPRESSION)? 6 : level)){
+  if (c == NULL)  throw std::bad_alloc();
+}
+
+size_t libdeflate_deflater::deflate(char* dest, size_t capacity,
+				    const char* data, size_t length) {
+  return libdeflate_deflate_compress(c, data, length, dest, capacity);
+}
+
+#endif
+
+} // unnamed namespace
+
+uint32_t BGZF::crc32(const char* data, size_t length) {
+  return best_crc32(data, length);
+}
+
+bool codec_available(codec c) {
+  switch (c) {
+  case zlib_codec:
+    return true;
+
+  case libdeflate_codec:
+#ifdef HAVE_LIBDEFLATE
+    return true;
+#else
+    return false;
+#endif
+
+  default:
+    return false;
+  }
+}
+
+codec default_codec() {
+  return codec_available(libdeflate_codec)? libdeflate_codec : zlib_codec;
+}
+
+const char* codec_name(codec c) {
+  switch (c) {
+  case zlib_codec:  return "zlib";
+  case libdeflate_codec:  return "libdeflate";
+  default:  return "(unknown codec)";
+  }
+}
+
+/* A deflate stored block consists of a header byte containing the BFINAL and
+BTYPE fields (with BTYPE 00 indicating no compression), padding to the next
+byte boundary, the 16-bit LEN and its ones' complement NLEN, and then LEN
+bytes of literal data.  As a BGZF payload starts on a byte boundary, a final
+stored block's header is simply the five bytes 01 LL LL NN NN.  */
+enum { stored_hsize = 5 };
+
+// Returns the length of the data in PAYLOAD if it consists of a single final
+// stored block, or -1 otherwise.
+static long stored_block_length(const char* payload, size_t size) {
+  if (size < size_t(stored_hsize) || payload[0] != '\1')  return -1;
+
+  unsigned length = convert::uint16(&payload[1]);
+  unsigned nlength = convert::uint16(&payload[3]);
+  if ((length ^ nlength) != 0xffff || size != stored_hsize + length)  return -1;
+
+  return length;
+}
+
+static size_t
+write_stored_block(char* dest, const char* data, size_t length) {
+  dest[0] = '\1';
+  convert::set_bam_uint16(&dest[1], length);
+  convert::set_bam_uint16(&dest[3], ~length);
+  memcpy(&dest[stored_hsize], data, length);
+  return stored_hsize + length;
+}
+
+block_inflater::block_inflater(codec c) {
+  switch (c) {
+  case zlib_codec:  engine = new zlib_inflater;  break;
+#ifdef HAVE_LIBDEFLATE
+  case libdeflate_codec:  engine = new libdeflate_inflater;  break;
+#endif
+  default:
+    throw std::invalid_argument(make_string()
+	<< "BGZF codec " << codec_name(c) << " is not available");
+  }
+}
+
+block_inflater::~block_inflater() {
+  delete engine;
+}
+
+size_t block_inflater::inflate(char* dest, size_t capacity,
+			       const char* block, size_t size) {
+  if (size < size_t(BGZF::hsize + BGZF::tsize))
+    throw bad_format("Invalid BGZF block size");
+
+  const char* trailer = block + size - BGZF::tsize;
+  const char* payload = block + BGZF::hsize;
+  size_t payload_size = size - BGZF::hsize - BGZF::tsize;
+
+  size_t length;
+  long stored_length = stored_block_length(payload, payload_size);
+  if (stored_length >= 0) {
+    if (size_t(stored_length) > capacity)
+      throw bad_format("Stored BGZF block exceeds BGZF block size");
+    length = stored_length;
+    memcpy(dest, &payload[stored_hsize], length);
+  }
+  else
+    length = engine->inflate(dest, capacity, payload, payload_size);
+
+  if (length != convert::uint32(&trailer[4]))
+    throw bad_format("BGZF block's uncompressed size does not match trailer");
+  if (BGZF::crc32(dest, length) != convert::uint32(trailer))
+    throw bad_format("BGZF block's CRC-32 checksum does not match trailer");
+
+  return length;
+}
+
+static block_deflater::backend* new_deflater(int level, codec c) {
+  switch (c) {
+  case zlib_codec:  return new zlib_deflater(level);
+#ifdef HAVE_LIBDEFLATE
+  case libdeflate_codec:  return new libdeflate_deflater(level);
+#endif
+  default:
+    throw std::invalid_argument(make_string()
+	<< "BGZF codec " << codec_name(c) << " is not available");
+  }
+}
+
+block_deflater::block_deflater(int level, codec c)
+  : engine(new_deflater(level, c)), level_(level), codec_(c) {
+}
+
+void block_deflater::set_level(int level) {
+  if (level == level_)  return;
+
+  backend* new_engine = new_deflater(level, codec_);
+  delete engine;
+  engine = new_engine;
+  level_ = level;
+}
+
+block_deflater::~block_deflater() {
+  delete engine;
+}
+
+size_t block_deflater::deflate(char* dest, const char* data, size_t length) {
+  size_t payload_size = (level_ == 0)
+    ? write_stored_block(dest + BGZF::hsize, data, length)
+    : engine->deflate(dest + BGZF::hsize, BGZF::payload_max_size, data, length);
+
+  // The output space was exhausted, which cannot happen for at most
+  // uncompressed_block_size bytes of input.
+  if (payload_size == 0)
+    throw std::logic_error("implausibly incompressible data");
+
+  size_t size = BGZF::hsize + payload_size + BGZF::tsize;
+  BGZF::write_bgzf_header(dest, size);
+  BGZF::write_bgzf_trailer(dest + BGZF::hsize + payload_size,
+			   BGZF::crc32(data, length), length);
+  return size;
+}
+
+int adaptive_level::update(double compress_seconds, double other_seconds) {
+  compress += compress_seconds;
+  other += other_seconds;
+
+  if (++nblocks >= window) {
+    if (compress > other && level_ > min_level)  level_--;
+    else if (2.0 * compress < other && level_ < max_level)  level_++;
+
+    nblocks = 0;
+    compress = other = 0.0;
+  }
+
+  return level_;
+}
+
+} // namespace sam
@@ -0,0 +1,207 @@
+/*  bgzf.h -- BGZF block format utilities.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#ifndef BGZF_H
+#define BGZF_H
+
+#include <string>
+#include <cstring>
+
+#include <stdint.h>
+#include <zlib.h>
+
+#include "lib/wire.h"
+
+namespace sam {
+
+namespace BGZF {
+/* BAM files consist of BGZF blocks, which are RFC 1952 GZIP members with
+a "BC" extra subfield in their headers, typically as follows:
+
+    0  1  2  3  4  5  6  7  8  9 10 11 12 13 14 15 16 17   Offset from start
+   1f 8b .. *4 .. .. .. .. .. .. 06 00 42 43 02 00 .. ..   BGZF signature
+   magic    ^bit 2 is FEXTRA flag      ^B ^C
+
+These BGZF utilities provide what we need for identifying GZIP and BGZF headers
+and extracting the interesting field from the "BC" subfield.  */
+
+// Size, in bytes, of a BGZF block header
+enum { hsize = 18, tsize = 8, full_block_size = 65536,
+       payload_max_size = full_block_size - hsize - tsize };
+
+enum { uncompressed_max_size = 65536 };
+
+// Amount of data compressed into each BGZF block written, chosen so that the
+// block fits within full_block_size even if the data is incompressible.  As
+// each block is then a function of its own data only, blocks can be compressed
+// independently (and in parallel) without affecting the output produced.
+enum { uncompressed_block_size = 0xff00 };
+
+// Returns whether the specified memory block starts with a GZIP member header
+inline bool is_gzip_header(const char* s, int length) {
+  return length >= 2 && s[0] == '\x1f' && s[1] == '\x8b';
+}
+
+// Returns whether the specified memory block starts with a valid BGZF header
+inline bool is_bgzf_header(const char* s, int length) {
+  return length >= 18 && s[0] == '\x1f' && s[1] == '\x8b' &&
+	 (s[3] & 4) && memcmp(&s[10], "\6\0\x42\x43\2\0", 6) == 0;
+}
+
+// For a valid BGZF header, returns the block_size field
+inline int block_size(const char* s) {
+  return convert::uint16(&s[16]) + 1;
+}
+
+// Write a BGZF block header, and return the number of bytes written
+inline int write_bgzf_header(char* s, int block_size) {
+  static const char boilerplate[] =
+    { '\x1f', '\x8b', 8, '\x04', 0,0,0,0, 0, '\xff', 6,0, '\x42','\x43', 2,0 };
+
+  memcpy(s, boilerplate, sizeof boilerplate);
+  convert::set_bam_uint16(&s[16], block_size - 1);
+  return hsize;
+}
+
+// Returns the CRC-32 checksum of the data, as used in GZIP member trailers.
+// Where the CPU supports them, this uses carry-less multiplication (x86
+// PCLMULQDQ) or dedicated CRC-32 (ARMv8) instructions, so is considerably
+// faster than zlib's table-driven crc32().
+uint32_t crc32(const char* data, size_t length);
+
+// Write a BGZF block trailer, and return the number of bytes written
+inline int write_bgzf_trailer(char* s, uint32_t crc, int uncompressed_size) {
+  convert::set_bam_uint32(s, crc);
+  convert::set_bam_uint32(&s[4], uncompressed_size);
+  return tsize;
+}
+
+} // namespace BGZF
+
+// Returns a description of a zlib failure, including zlib's own message.
+std::string zlib_message(const char* function, const z_stream& z);
+
+/* BGZF block payloads can be compressed and decompressed either by zlib,
+which is always available, or by libdeflate, which works on whole buffers
+rather than streams and so is considerably faster for BGZF's small blocks.
+The latter is available when the library is built with HAVE_LIBDEFLATE.  */
+enum codec { zlib_codec, libdeflate_codec };
+
+// Returns whether the specified codec has been built into the library.
+bool codec_available(codec c);
+
+// Returns the codec used by default, i.e., libdeflate if it is available.
+codec default_codec();
+
+// Returns the name of the specified codec, e.g., "zlib".
+const char* codec_name(codec c);
+
+/* Decompresses individual BGZF blocks, verifying the CRC-32 checksum and
+uncompressed size recorded in each block's trailer.  The underlying codec
+state is reused from one block to the next.  Blocks whose payload is a single
+deflate stored block, as in uncompressed BAM files, are simply copied.  */
+class block_inflater {
+public:
+  explicit block_inflater(codec c = default_codec());
+  ~block_inflater();
+
+  // Decompress the complete BGZF block of SIZE bytes at BLOCK into DEST,
+  // which has space for CAPACITY bytes.  Returns the number of bytes written
+  // to DEST, or throws bad_format if the data is invalid or does not match
+  // the block's trailer.
+  size_t inflate(char* dest, size_t capacity, const char* block, size_t size);
+
+  class backend;  // Implemented for each codec in bgzf.cpp
+
+private:
+  backend* engine;
+
+  block_inflater(const block_inflater&) /* = delete */;
+  block_inflater& operator= (const block_inflater&) /* = delete */;
+};
+
+/* Compresses data into complete BGZF blocks, each comprising header, raw
+deflate payload, and trailer.  The underlying codec state is reused from one
+block to the next.  LEVEL is a zlib-style compression level from 0 to 9,
+or Z_DEFAULT_COMPRESSION.  At level 0, each payload is written directly as a
+single deflate stored block, without involving the codec at all.  */
+class block_deflater {
+public:
+  explicit block_deflater(int level, codec c = default_codec());
+  ~block_deflater();
+
+  // Compress the LENGTH bytes at DATA, which must be no more than
+  // BGZF::uncompressed_block_size, into a complete BGZF block at DEST, which
+  // has space for BGZF::full_block_size bytes.  Returns the size of the block.
+  size_t deflate(char* dest, const char* data, size_t length);
+
+  // Compress subsequent blocks at LEVEL, replacing the codec state if the
+  // level differs from the current one.
+  void set_level(int level);
+
+  int level() const { return level_; }
+
+  class backend;  // Implemented for each codec in bgzf.cpp
+
+private:
+  backend* engine;
+  int level_;
+  codec codec_;
+
+  block_deflater(const block_deflater&) /* = delete */;
+  block_deflater& operator= (const block_deflater&) /* = delete */;
+};
+
+/* Chooses compression levels for successive blocks so that compressing them
+keeps pace with the rest of the pipeline.  For each block, the caller reports
+the time spent compressing it (divided by the number of threads sharing the
+work) and the time otherwise spent producing its data and writing out the
+compressed output.  Every few blocks, the level is lowered if compression has
+been taking longer than everything else, or raised if it has been taking less
+than half as long.  */
+class adaptive_level {
+public:
+  adaptive_level() : level_(6), nblocks(0), compress(0.0), other(0.0) { }
+
+  enum { min_level = 1, max_level = 9, window = 16 };
+
+  int level() const { return level_; }
+
+  // Account for a block, and return the level to be used for the next one.
+  int update(double compress_seconds, double other_seconds);
+
+private:
+  int level_;
+  int nblocks;
+  double compress, other;
+};
+
+} // namespace sam
+
+#endif
@@ -0,0 +1,155 @@
+/*  blockcache.cpp -- Cache of decompressed BGZF blocks.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#include "cansam/sam/stream.h"
+
+#include <list>
+#include <map>
+#include <vector>
+#include <cstring>
+
+#include "lib/thread.h"
+
+namespace sam {
+
+/* Cached blocks are kept in order of use, most recently used first, and
+indexed by file position.  All access is serialised by  lock,  as the cache
+may be shared by streams on different threads.  */
+class block_cache::lru {
+public:
+  struct entry {
+    uint64_t offset;
+    std::vector<char> data;
+  };
+
+  typedef std::list<entry> entry_list;
+  typedef std::map<uint64_t, entry_list::iterator> entry_map;
+
+  lru(size_t capacity)
+    : capacity(capacity), size(0), hits(0), misses(0) { }
+
+  // Discard least recently used blocks until there is room for LENGTH bytes.
+  void make_room(size_t length);
+
+  entry_list entries;
+  entry_map index;
+  size_t capacity, size;
+  uint64_t hits, misses;
+  mutex lock;
+};
+
+void block_cache::lru::make_room(size_t length) {
+  while (! entries.empty() && size + length > capacity) {
+    entry& victim = entries.back();
+    size -= victim.data.size();
+    index.erase(victim.offset);
+    entries.pop_back();
+  }
+}
+
+block_cache::block_cache(size_t capacity) : blocks(new lru(capacity)) {
+}
+
+block_cache::~block_cache() {
+  delete blocks;
+}
+
+size_t block_cache::capacity() const {
+  scoped_lock guard(blocks->lock);
+  return blocks->capacity;
+}
+
+void block_cache::set_capacity(size_t capacity) {
+  scoped_lock guard(blocks->lock);
+  blocks->capacity = capacity;
+  blocks->make_room(0);
+}
+
+size_t block_cache::size() const {
+  scoped_lock guard(blocks->lock);
+  return blocks->size;
+}
+
+uint64_t block_cache::hits() const {
+  scoped_lock guard(blocks->lock);
+  return blocks->hits;
+}
+
+uint64_t block_cache::misses() const {
+  scoped_lock guard(blocks->lock);
+  return blocks->misses;
+}
+
+void block_cache::clear() {
+  scoped_lock guard(blocks->lock);
+  blocks->entries.clear();
+  blocks->index.clear();
+  blocks->size = 0;
+  blocks->hits = blocks->misses = 0;
+}
+
+size_t block_cache::find(uint64_t offset, char* dest) {
+  scoped_lock guard(blocks->lock);
+
+  lru::entry_map::iterator it = blocks->index.find(offset);
+  if (it == blocks->index.end()) {
+    blocks->misses++;
+    return 0;
+  }
+
+  // Move the entry to the front, as it is now the most recently used.
+  blocks->entries.splice(blocks->entries.begin(), blocks->entries, it->second);
+  blocks->hits++;
+
+  const std::vector<char>& data = it->second->data;
+  memcpy(dest, &data[0], data.size());
+  return data.size();
+}
+
+void block_cache::insert(uint64_t offset, const char* data, size_t length) {
+  scoped_lock guard(blocks->lock);
+
+  // Empty blocks are not worth caching, and overly large ones would evict
+  // everything else to no avail.
+  if (length == 0 || length > blocks->capacity)  return;
+
+  // Another stream sharing the cache may have added this block already.
+  if (blocks->index.find(offset) != blocks->index.end())  return;
+
+  blocks->make_room(length);
+
+  blocks->entries.push_front(lru::entry());
+  lru::entry& e = blocks->entries.front();
+  e.offset = offset;
+  e.data.assign(data, data + length);
+  blocks->index[offset] = blocks->entries.begin();
+  blocks->size += length;
+}
+
+} // namespace sam
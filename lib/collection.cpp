@@ -1,6 +1,6 @@
 /*  collection.cpp -- Class for a set of SAM/BAM headers.
 
-    Copyright (C) 2010-2012 Genome Research Ltd.
+    Copyright (C) 2010-2012, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -79,6 +79,8 @@ void collection::clear() {
 // FIXME Make me class static?
 static refsequence unmapped_refseq("*", 0, -1);
 
+// These lookups do not modify the collection, so they may be made concurrently
+// by several threads (as when SAM text is being parsed in parallel).
 refsequence& collection::findseq_(int index) const {
   if (index >= 0 && index < int(refseqs.size()))
     return *refseqs[index];
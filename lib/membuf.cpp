@@ -0,0 +1,109 @@
+/*  membuf.cpp -- In-memory stream buffer.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#include "cansam/streambuf.h"
+
+#include <ios>
+#include <stdexcept>
+#include <cstring>
+
+namespace sam {
+
+membuf* membuf::open(const char* data, std::size_t length) {
+  if (is_open())  return NULL;
+
+  std::vector<char>().swap(storage_);
+  char* begin = const_cast<char*>(data);
+  setg(begin, begin, begin + length);
+  open_ = true;
+  writable_ = false;
+  return this;
+}
+
+membuf* membuf::open() {
+  if (is_open())  return NULL;
+
+  storage_.clear();
+  setg(NULL, NULL, NULL);
+  open_ = true;
+  writable_ = true;
+  return this;
+}
+
+std::streamsize membuf::xsgetn(char* s, std::streamsize n) {
+  if (n > egptr() - gptr())  n = egptr() - gptr();
+
+  memcpy(s, gptr(), n);
+  skip(n);
+  return n;
+}
+
+// Append to  storage_,  which may move it, so the get area is reestablished.
+std::streamsize membuf::xsputn(const char* s, std::streamsize n) {
+  if (! writable_ || ! open_)
+    throw std::logic_error("membuf is not open for writing");
+
+  // Nothing to append, and  storage_  may still be empty.
+  if (n == 0)  return 0;
+
+  std::streamoff pos = gptr() - eback();
+  storage_.insert(storage_.end(), s, s + n);
+
+  char* begin = &storage_[0];
+  setg(begin, begin + pos, begin + storage_.size());
+  return n;
+}
+
+std::streambuf::int_type membuf::overflow(int_type c) {
+  if (traits_type::eq_int_type(c, traits_type::eof()))  return 0;
+
+  char ch = traits_type::to_char_type(c);
+  xsputn(&ch, 1);
+  return c;
+}
+
+std::streampos
+membuf::seekoff(std::streamoff off, std::ios_base::seekdir way,
+		std::ios_base::openmode which) {
+  std::streamoff base = (way == std::ios::beg)? 0 :
+			(way == std::ios::cur)? gptr() - eback() :
+						egptr() - eback();
+  return seekpos(base + off, which);
+}
+
+std::streampos membuf::seekpos(std::streampos pos, std::ios_base::openmode) {
+  std::streamoff off = pos;
+  if (! is_open() || off < 0 || off > egptr() - eback())
+    return std::streampos(std::streamoff(-1));
+
+  setg(eback(), eback() + off, egptr());
+  return pos;
+}
+
+} // namespace sam
@@ -0,0 +1,140 @@
+/*  mmapfilebuf.cpp -- Memory-mapped read-only file stream buffer.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#include "cansam/streambuf.h"
+
+#include <algorithm>
+#include <ios>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "cansam/exception.h"
+
+namespace sam {
+
+namespace {
+
+// Amount of the file that the kernel is asked to read ahead at a time.
+const std::streamsize readahead_size = 8 << 20;
+
+} // anonymous namespace
+
+mmapfilebuf* mmapfilebuf::open(const char* fname) {
+  if (is_open())  return NULL;
+
+  int fd;
+  do fd = ::open(fname, O_RDONLY); while (fd < 0 && errno == EINTR);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  int saved_errno = 0;
+  if (::fstat(fd, &st) < 0)  saved_errno = errno;
+  else if (! S_ISREG(st.st_mode))  saved_errno = ENODEV;
+  else if (st.st_size != off_t(size_t(st.st_size)))  saved_errno = EFBIG;
+
+  if (saved_errno != 0) {
+    ::close(fd);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  char* data = NULL;
+  if (st.st_size > 0) {
+    void* addr = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      saved_errno = errno;
+      ::close(fd);
+      errno = saved_errno;
+      return NULL;
+    }
+
+    data = static_cast<char*>(addr);
+#ifdef MADV_SEQUENTIAL
+    ::madvise(data, st.st_size, MADV_SEQUENTIAL);
+#endif
+  }
+
+  // The mapping remains valid after the file descriptor has been closed.
+  ::close(fd);
+
+  membuf::open(data, st.st_size);
+  advised_ = data;
+  advise();
+  return this;
+}
+
+// Unmap the file, failing (i.e., returning negative) on hard errors rather
+// than throwing an exception.
+int mmapfilebuf::close_nothrow() {
+  if (! is_open())  return 0;
+
+  int ret = 0;
+  if (eback())  ret = ::munmap(eback(), egptr() - eback());
+
+  setg(NULL, NULL, NULL);
+  advised_ = NULL;
+  membuf::close();
+  return ret;
+}
+
+void mmapfilebuf::close() {
+  if (close_nothrow() < 0)
+    throw sam::system_error("munmap() failed", errno);
+}
+
+// Ask the kernel to read ahead, if the current position is approaching the
+// end of the region previously so advised.
+void mmapfilebuf::advise() {
+#ifdef MADV_WILLNEED
+  if (advised_ - gptr() > readahead_size / 2 || advised_ >= egptr())  return;
+
+  // The region's start must be page-aligned.
+  static const long page_size = sysconf(_SC_PAGESIZE);
+  char* start = (gptr() > advised_)? gptr() : advised_;
+  start -= (start - eback()) % page_size;
+
+  std::streamsize length = std::min(readahead_size, egptr() - start);
+  ::madvise(start, length, MADV_WILLNEED);
+  advised_ = start + length;
+#endif
+}
+
+std::streampos
+mmapfilebuf::seekpos(std::streampos pos, std::ios_base::openmode which) {
+  std::streampos ret = membuf::seekpos(pos, which);
+  advise();
+  return ret;
+}
+
+} // namespace sam
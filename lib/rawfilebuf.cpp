@@ -1,6 +1,6 @@
 /*  rawfilebuf.cpp -- Low-level class for input/output.
 
-    Copyright (C) 2010-2012 Genome Research Ltd.
+    Copyright (C) 2010-2012, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -29,19 +29,473 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 
 #include "cansam/streambuf.h"
 
+#include <algorithm>
+#include <deque>
 #include <ios>
 #include <stdexcept>
+#include <vector>
+#include <cstring>
 
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include "cansam/exception.h"
+#include "lib/thread.h"
 
 namespace sam {
 
+/* A background thread reads the file into a ring of buffers, which are
+consumed in turn by read().  Seekable files are read via pread(2) from the
+thread's own offset, so the file descriptor's offset is unaffected and the
+owning rawfilebuf can reposition it freely.
+
+As the thread may be blocked indefinitely reading from a pipe, it is never
+joined.  Instead stop() detaches the object from its owner, and whichever of
+the owner and the thread finishes with it last deletes it.  The thread reads
+from its own duplicate of the file descriptor, so that the owner may close
+the original at any time without the thread ever reading from some unrelated
+file that has reused that descriptor.  */
+class rawfilebuf::readahead {
+public:
+  // Start reading ahead from FD, at OFFSET if it is seekable or -1 if not.
+  readahead(int fd, off_t offset, size_t window);
+
+  // Copy up to N bytes to S, waiting only if no data has yet been read.
+  std::streamsize read(char* s, std::streamsize n);
+
+  // Returns the number of bytes that have been read ahead.
+  std::streamsize buffered();
+
+  // Returns the offset of the next byte to be returned by read(), or -1.
+  off_t position() const { return position_; }
+
+  // Relinquish this object, which the thread will delete if it is still
+  // running.  The owner must not use the object afterwards.
+  void stop();
+
+private:
+  struct chunk {
+    std::vector<char> data;
+    size_t begin, end;
+  };
+
+  ~readahead() { ::close(fd); }
+
+  static void* thread_main(void* ra);
+  void work();
+
+  int fd;
+  off_t position_, read_offset;
+  std::vector<chunk> ring;
+  size_t head, tail, nfull;
+  bool stopping, finished;
+  int error;
+
+  mutex lock;
+  condition filled, emptied;
+};
+
+rawfilebuf::readahead::readahead(int fd, off_t offset, size_t window)
+  : fd(::dup(fd)), position_(offset), read_offset(offset),
+    head(0), tail(0), nfull(0), stopping(false), finished(false), error(0) {
+  if (this->fd < 0)  throw sam::system_error("dup() failed", errno);
+
+  const size_t max_chunk_size = 1 << 20;
+  size_t chunk_size = std::max(std::min(window / 2, max_chunk_size),
+			       size_t(65536));
+  ring.resize(std::max(window / chunk_size, size_t(2)));
+  for (size_t i = 0; i < ring.size(); i++)
+    ring[i].data.resize(chunk_size);
+
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, thread_main, this);
+  if (err != 0) {
+    ::close(this->fd);
+    throw sam::system_error("pthread_create() failed", err);
+  }
+  pthread_detach(thread);
+}
+
+void* rawfilebuf::readahead::thread_main(void* ra) {
+  static_cast<readahead*>(ra)->work();
+  return NULL;
+}
+
+void rawfilebuf::readahead::work() {
+  lock.lock();
+
+  while (true) {
+    while (nfull == ring.size() && ! stopping)
+      emptied.wait(lock);
+
+    if (stopping)  break;
+
+    // The chunk at  tail  is not in use by the consumer while it's not full.
+    chunk& c = ring[tail];
+    lock.unlock();
+
+    ssize_t nread;
+    do nread = (read_offset >= 0)
+		? ::pread(fd, &c.data[0], c.data.size(), read_offset)
+		: ::read(fd, &c.data[0], c.data.size());
+    while (nread < 0 && errno == EINTR);
+    int saved_errno = errno;
+
+    lock.lock();
+    if (nread <= 0) {
+      if (nread < 0)  error = saved_errno;
+      break;
+    }
+
+    c.begin = 0;
+    c.end = nread;
+    if (read_offset >= 0)  read_offset += nread;
+    tail = (tail + 1) % ring.size();
+    nfull++;
+    filled.signal();
+  }
+
+  finished = true;
+  filled.signal();
+
+  bool orphaned = stopping;
+  lock.unlock();
+  if (orphaned)  delete this;
+}
+
+std::streamsize rawfilebuf::readahead::read(char* s, std::streamsize n) {
+  scoped_lock guard(lock);
+
+  while (nfull == 0 && ! finished)
+    filled.wait(lock);
+
+  if (nfull == 0) {
+    if (error != 0)  throw sam::system_error("read() failed", error);
+    return 0;
+  }
+
+  // The consumer owns the full chunks, so the copying can be done unlocked.
+  size_t navailable = nfull;
+  lock.unlock();
+
+  std::streamsize total = 0;
+  size_t nconsumed = 0;
+  for (size_t i = head; n > 0 && nconsumed < navailable;) {
+    chunk& c = ring[i];
+    size_t length = std::min(size_t(n), c.end - c.begin);
+    memcpy(s, &c.data[c.begin], length);
+    c.begin += length;
+    s += length;
+    n -= length;
+    total += length;
+
+    if (c.begin == c.end)  nconsumed++, i = (i + 1) % ring.size();
+  }
+
+  lock.lock();
+  head = (head + nconsumed) % ring.size();
+  nfull -= nconsumed;
+  if (position_ >= 0)  position_ += total;
+  if (nconsumed > 0)  emptied.signal();
+
+  return total;
+}
+
+std::streamsize rawfilebuf::readahead::buffered() {
+  scoped_lock guard(lock);
+
+  std::streamsize total = 0;
+  for (size_t i = 0, j = head; i < nfull; i++, j = (j + 1) % ring.size())
+    total += ring[j].end - ring[j].begin;
+
+  return total;
+}
+
+void rawfilebuf::readahead::stop() {
+  lock.lock();
+  stopping = true;
+  emptied.signal();
+
+  bool orphaned = finished;
+  lock.unlock();
+  if (orphaned)  delete this;
+}
+
+/* Data written is dropped from the page cache a window at a time: once a
+window's worth has been written since writeback was last started, writeback
+of the new window is started and the previous window, whose writeback should
+by now be complete, is waited for and dropped.  Thus  written()  rarely
+actually waits, and at most about two windows' worth of data remain cached.
+The data before  dropped  has been dropped, and writeback of the data between
+dropped  and  started  has been started.  */
+class rawfilebuf::dropbehind {
+public:
+  // Start dropping data written to FD from OFFSET onwards.
+  dropbehind(int fd, off_t offset)
+    : fd(fd), dropped(offset), started(offset), end(offset) { }
+
+  // Note that the data before END has been written.
+  void written(off_t end);
+
+  // Write back and drop all the data written so far.
+  void finish();
+
+  // Continue with data written from OFFSET onwards.
+  void restart(off_t offset) { dropped = started = end = offset; }
+
+private:
+  static const off_t window = 8 << 20;
+
+  void start(off_t end);
+  void drop(off_t end);
+
+  int fd;
+  off_t dropped, started, end;
+};
+
+void rawfilebuf::dropbehind::written(off_t new_end) {
+  end = new_end;
+  if (end - started < window)  return;
+
+  off_t previous = started;
+  start(end);
+  drop(previous);
+}
+
+void rawfilebuf::dropbehind::finish() {
+  if (end > started)  start(end);
+  drop(started);
+}
+
+// Start writing back the data between started and END.  These system calls
+// are merely advisory, so their failures are ignored.
+void rawfilebuf::dropbehind::start(off_t new_started) {
+#ifdef SYNC_FILE_RANGE_WRITE
+  ::sync_file_range(fd, started, new_started - started, SYNC_FILE_RANGE_WRITE);
+#endif
+  started = new_started;
+}
+
+// Wait for the data between dropped and END to be written back, and drop it.
+void rawfilebuf::dropbehind::drop(off_t new_dropped) {
+  if (new_dropped <= dropped)  return;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+  ::sync_file_range(fd, dropped, new_dropped - dropped,
+		    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		    SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+  ::fdatasync(fd);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+  ::posix_fadvise(fd, dropped, new_dropped - dropped, POSIX_FADV_DONTNEED);
+#endif
+  dropped = new_dropped;
+}
+
+/* A background thread writes out the chunks appended to the queue by write().
+Each time it wakes, the thread takes the entire queue, so that the producer
+can carry on appending to a fresh queue while the taken chunks are written
+with as few writev(2) calls as possible, or pwritev(2) calls when writing on
+behalf of a positional rawfilebuf.  The queued byte count includes the chunks
+being written, so that drain() can wait for it to reach zero.
+
+Unlike the readahead thread, this thread is always joined: the owner must in
+any case wait for the queued data to be written before it can close the file.
+After an error, all further data is discarded and the error is reported to
+the producer by the next write() or drain().  */
+class rawfilebuf::writebehind {
+public:
+  // Start writing behind to FD, queueing up to LIMIT bytes, and writing
+  // at OFFSET or, if it is -1, at the file descriptor's offset.
+  writebehind(int fd, size_t limit, off_t offset);
+
+  // Queue N bytes from S, waiting only if the queue is full.
+  void write(const char* s, std::streamsize n);
+
+  // Wait for the queue to be written.
+  void drain();
+
+  // Write subsequently queued data at OFFSET, as for the constructor.
+  // The queue must already have been drained.
+  void reposition(off_t offset);
+
+  // Inform DROPPER (or none) of the data subsequently written.
+  // The queue must already have been drained.
+  void set_dropbehind(dropbehind* dropper);
+
+  // Wait for the queue to be written and stop the thread, returning 0 or
+  // the errno value of the first failed write.
+  int stop();
+
+private:
+  typedef std::deque<std::vector<char> > chunk_queue;
+
+  static void* thread_main(void* wb);
+  void work();
+  int write_chunks(const chunk_queue& chunks);
+
+  int fd;
+  off_t offset;
+  dropbehind* dropper;
+  size_t limit, chunk_size;
+  chunk_queue queue;
+  size_t queued;
+  bool stopping;
+  int error;
+  pthread_t thread;
+
+  mutex lock;
+  condition nonempty, written;
+};
+
+rawfilebuf::writebehind::writebehind(int fd, size_t limit, off_t offset)
+  : fd(fd), offset(offset), dropper(NULL), limit(limit),
+    chunk_size(std::min(limit, size_t(1 << 20))),
+    queued(0), stopping(false), error(0) {
+  int err = pthread_create(&thread, NULL, thread_main, this);
+  if (err != 0)  throw sam::system_error("pthread_create() failed", err);
+}
+
+int rawfilebuf::writebehind::stop() {
+  lock.lock();
+  stopping = true;
+  nonempty.signal();
+  lock.unlock();
+
+  pthread_join(thread, NULL);
+  return error;
+}
+
+void* rawfilebuf::writebehind::thread_main(void* wb) {
+  static_cast<writebehind*>(wb)->work();
+  return NULL;
+}
+
+void rawfilebuf::writebehind::work() {
+  chunk_queue chunks;
+  scoped_lock guard(lock);
+
+  while (true) {
+    while (queue.empty() && ! stopping)
+      nonempty.wait(lock);
+
+    if (queue.empty())  break;
+
+    chunks.swap(queue);
+    lock.unlock();
+
+    int err = (error == 0)? write_chunks(chunks) : 0;
+
+    size_t total = 0;
+    for (chunk_queue::iterator it = chunks.begin(); it != chunks.end(); ++it)
+      total += it->size();
+    chunks.clear();
+
+    lock.lock();
+    if (err != 0)  error = err;
+    queued -= total;
+    written.broadcast();
+  }
+}
+
+// Write out all of CHUNKS, returning 0 or the errno value of a failed write.
+int rawfilebuf::writebehind::write_chunks(const chunk_queue& chunks) {
+#ifdef IOV_MAX
+  const size_t max_iov = IOV_MAX;
+#else
+  const size_t max_iov = 16;
+#endif
+
+  std::vector<struct iovec> iov;
+  iov.reserve(std::min(chunks.size(), max_iov));
+
+  chunk_queue::const_iterator next = chunks.begin();
+  while (next != chunks.end() || ! iov.empty()) {
+    while (iov.size() < max_iov && next != chunks.end()) {
+      struct iovec v;
+      v.iov_base = const_cast<char*>(&(*next)[0]);
+      v.iov_len = next->size();
+      iov.push_back(v);
+      ++next;
+    }
+
+    ssize_t nwritten;
+    do nwritten = (offset >= 0)? ::pwritev(fd, &iov[0], iov.size(), offset)
+				: ::writev(fd, &iov[0], iov.size());
+    while (nwritten < 0 && errno == EINTR);
+    if (nwritten < 0)  return errno;
+
+    if (offset >= 0)  offset += nwritten;
+
+    // Discard the fully written buffers, and advance past any partial write.
+    size_t i = 0;
+    while (i < iov.size() && size_t(nwritten) >= iov[i].iov_len)
+      nwritten -= iov[i++].iov_len;
+    iov.erase(iov.begin(), iov.begin() + i);
+    if (nwritten > 0) {
+      iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + nwritten;
+      iov[0].iov_len -= nwritten;
+    }
+  }
+
+  if (dropper)
+    dropper->written((offset >= 0)? offset : ::lseek(fd, 0, SEEK_CUR));
+
+  return 0;
+}
+
+void rawfilebuf::writebehind::write(const char* s, std::streamsize n) {
+  scoped_lock guard(lock);
+
+  while (queued > 0 && queued + n > limit && error == 0)
+    written.wait(lock);
+
+  if (error != 0)  throw sam::system_error("write() failed", error);
+
+  while (n > 0) {
+    // Coalesce small writes into the chunk at the back of the queue,
+    // which is not yet being written by the thread.
+    if (queue.empty() || queue.back().size() >= chunk_size) {
+      queue.push_back(std::vector<char>());
+      queue.back().reserve(chunk_size);
+    }
+
+    std::vector<char>& chunk = queue.back();
+    size_t length = std::min(size_t(n), chunk_size - chunk.size());
+    chunk.insert(chunk.end(), s, s + length);
+    s += length;
+    n -= length;
+    queued += length;
+  }
+
+  nonempty.signal();
+}
+
+void rawfilebuf::writebehind::drain() {
+  scoped_lock guard(lock);
+
+  while (queued > 0 && error == 0)
+    written.wait(lock);
+
+  if (error != 0)  throw sam::system_error("write() failed", error);
+}
+
+void rawfilebuf::writebehind::reposition(off_t new_offset) {
+  scoped_lock guard(lock);
+  offset = new_offset;
+}
+
+void rawfilebuf::writebehind::set_dropbehind(dropbehind* new_dropper) {
+  scoped_lock guard(lock);
+  dropper = new_dropper;
+}
+
 rawfilebuf*
 rawfilebuf::open(const char* fname, std::ios_base::openmode mode, int perm) {
   using std::ios;
@@ -134,20 +588,177 @@ rawfilebuf* rawfilebuf::open(const char* fname, int flags, int perm) {
 int rawfilebuf::close_nothrow() {
   if (! is_open())  return 0;
 
+  stop_readahead();
+  window_ = 0;
+  stop_writebehind();
+  stop_dropbehind();
+
   int ret;
   do ret = ::close(fd_); while (ret < 0 && errno == EINTR);
 
   fd_ = -1;
+  positional_ = false;
   return ret;
 }
 
 void rawfilebuf::close() {
+  int write_error = stop_writebehind();
+
   if (close_nothrow() < 0)
     throw sam::system_error("close() failed", errno);
+
+  if (write_error != 0)
+    throw sam::system_error("write() failed", write_error);
+}
+
+void rawfilebuf::set_readahead(size_t window) {
+  if (readahead_) {
+    // Unseekable files' buffered data can't be recovered by seeking back.
+    if (window == window_ || readahead_->position() < 0)  return;
+    stop_readahead();
+  }
+
+  window_ = window;
+  if (window_ > 0 && is_open())  start_readahead();
+}
+
+void rawfilebuf::set_positional(bool positional) {
+  if (positional == positional_ || ! is_open())  return;
+
+  // Stop the threads, which would otherwise use the old mode's offset.
+  stop_readahead();
+  drain_writebehind();
+
+  if (positional) {
+    position_ = ::lseek(fd_, 0, SEEK_CUR);
+    if (position_ < 0)  throw sam::system_error("lseek() failed", errno);
+  }
+  else {
+    // Leave the descriptor's offset where this buffer had got to.
+    if (::lseek(fd_, position_, SEEK_SET) < 0)
+      throw sam::system_error("lseek() failed", errno);
+  }
+
+  positional_ = positional;
+
+  if (writebehind_)  writebehind_->reposition(positional_? position_ : -1);
+  if (window_ > 0)  start_readahead();
+}
+
+// Returns the current position of the buffer or file descriptor, or -1.
+off_t rawfilebuf::offset() const {
+  return positional_? position_ : ::lseek(fd_, 0, SEEK_CUR);
+}
+
+void rawfilebuf::set_offset(off_t offset) {
+  if (positional_)  position_ = offset;
+  else  ::lseek(fd_, offset, SEEK_SET);
+}
+
+void rawfilebuf::start_readahead() {
+  off_t offset = this->offset();
+
+  if (offset >= 0) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(fd_, offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+  else {
+#ifdef F_SETPIPE_SZ
+    struct stat st;
+    if (::fstat(fd_, &st) == 0 && S_ISFIFO(st.st_mode)) {
+      // Unprivileged processes are limited to /proc/sys/fs/pipe-max-size,
+      // which is typically 1 MB, so fall back to that if necessary.
+      int size = std::min(window_, size_t(1 << 30));
+      if (::fcntl(fd_, F_SETPIPE_SZ, size) < 0 && size > (1 << 20))
+	::fcntl(fd_, F_SETPIPE_SZ, 1 << 20);
+    }
+#endif
+  }
+
+  readahead_ = new readahead(fd_, offset, window_);
+}
+
+// Stop reading ahead, leaving the file descriptor positioned (if seekable)
+// after the data that has actually been consumed.
+void rawfilebuf::stop_readahead() {
+  if (! readahead_)  return;
+
+  off_t position = readahead_->position();
+  readahead_->stop();
+  readahead_ = NULL;
+
+  if (position >= 0)  set_offset(position);
+}
+
+void rawfilebuf::set_writebehind(size_t limit) {
+  int write_error = stop_writebehind();
+  if (write_error != 0)
+    throw sam::system_error("write() failed", write_error);
+
+  if (limit > 0 && is_open()) {
+    writebehind_ = new writebehind(fd_, limit, positional_? position_ : -1);
+    writebehind_->set_dropbehind(dropbehind_);
+  }
+}
+
+// Wait for any queued output to be written, throwing if it could not be.
+void rawfilebuf::drain_writebehind() {
+  if (writebehind_)  writebehind_->drain();
+}
+
+// Write out any queued output and stop writing behind, returning 0 or the
+// errno value describing why the output could not be written.
+int rawfilebuf::stop_writebehind() {
+  if (! writebehind_)  return 0;
+
+  int error = writebehind_->stop();
+  delete writebehind_;
+  writebehind_ = NULL;
+  return error;
+}
+
+void rawfilebuf::set_dropbehind(bool dropbehind) {
+  if (dropbehind == (dropbehind_ != NULL) || ! is_open())  return;
+
+  drain_writebehind();
+  if (writebehind_)  writebehind_->set_dropbehind(NULL);
+
+  if (dropbehind) {
+    off_t pos = offset();
+    if (pos >= 0)  dropbehind_ = new rawfilebuf::dropbehind(fd_, pos);
+  }
+  else
+    stop_dropbehind();
+
+  if (writebehind_)  writebehind_->set_dropbehind(dropbehind_);
+}
+
+// Write back and drop the data written so far, and stop dropping.
+// Any write-behind thread must already have been stopped or detached.
+void rawfilebuf::stop_dropbehind() {
+  if (! dropbehind_)  return;
+
+  dropbehind_->finish();
+  delete dropbehind_;
+  dropbehind_ = NULL;
 }
 
 std::streamsize rawfilebuf::xsgetn(char* s, std::streamsize n) {
+  if (readahead_)  return readahead_->read(s, n);
+  drain_writebehind();
+
   ssize_t nread;
+  if (positional_) {
+    do nread = ::pread(fd_, s, n, position_);
+    while (nread < 0 && errno == EINTR);
+    if (nread < 0)
+      throw sam::system_error("pread() failed", errno);
+
+    position_ += nread;
+    return nread;
+  }
+
   do nread = ::read(fd_, s, n); while (nread < 0 && errno == EINTR);
   if (nread < 0)
     throw sam::system_error("read() failed", errno);
@@ -156,24 +767,51 @@ std::streamsize rawfilebuf::xsgetn(char* s, std::streamsize n) {
 }
 
 std::streamsize rawfilebuf::xsputn(const char* s, std::streamsize n) {
+  if (writebehind_) {
+    writebehind_->write(s, n);
+    if (positional_)  position_ += n;
+    return n;
+  }
+
   std::streamsize total = 0;
 
   while (n > 0) {
     ssize_t nwritten;
-    do nwritten = ::write(fd_, s, n); while (nwritten < 0 && errno == EINTR);
-    if (nwritten < 0)
-      throw sam::system_error("write() failed", errno);
+    if (positional_) {
+      do nwritten = ::pwrite(fd_, s, n, position_);
+      while (nwritten < 0 && errno == EINTR);
+      if (nwritten < 0)
+	throw sam::system_error("pwrite() failed", errno);
+
+      position_ += nwritten;
+    }
+    else {
+      do nwritten = ::write(fd_, s, n);
+      while (nwritten < 0 && errno == EINTR);
+      if (nwritten < 0)
+	throw sam::system_error("write() failed", errno);
+    }
 
     total += nwritten;
     s += nwritten;
     n -= nwritten;
   }
 
+  if (dropbehind_)  dropbehind_->written(offset());
+
   return total;
 }
 
 std::streamsize rawfilebuf::showmanyc() {
-  off_t pos = ::lseek(fd_, 0, SEEK_CUR);
+  if (readahead_) {
+    std::streamsize n = readahead_->buffered();
+    off_t pos = readahead_->position();
+    struct stat st;
+    if (pos >= 0 && ::fstat(fd_, &st) == 0)  n = st.st_size - pos;
+    return n;
+  }
+
+  off_t pos = offset();
   if (pos >= 0) {
     struct stat st;
     if (::fstat(fd_, &st) == 0)
@@ -192,18 +830,74 @@ std::streamsize rawfilebuf::showmanyc() {
   return 0;
 }
 
+int rawfilebuf::sync() {
+  drain_writebehind();
+  return 0;
+}
+
 std::streampos
 rawfilebuf::seekoff(std::streamoff off, std::ios_base::seekdir way,
 		    std::ios_base::openmode) {
+  drain_writebehind();
+
   int whence = (way == std::ios::beg)? SEEK_SET :
 	       (way == std::ios::cur)? SEEK_CUR : SEEK_END;
 
-  return ::lseek(fd_, off, whence);
+  if (readahead_) {
+    // Unseekable files' buffered data must not be discarded.
+    if (readahead_->position() < 0) {
+      errno = ESPIPE;
+      return std::streampos(std::streamoff(-1));
+    }
+
+    // Merely reporting the current position needn't disturb reading ahead.
+    if (whence == SEEK_CUR && off == 0)  return readahead_->position();
+
+    stop_readahead();
+    off_t pos = seek(off, whence);
+    start_readahead();
+    return pos;
+  }
+
+  return seek(off, whence);
+}
+
+// Reposition the buffer or file descriptor, as for lseek(2).
+off_t rawfilebuf::seek(off_t off, int whence) {
+  off_t pos = positional_? seek_positional(off, whence)
+			 : ::lseek(fd_, off, whence);
+
+  // The data written hitherto need not be kept in the page cache any longer.
+  if (dropbehind_ && pos >= 0 && ! (whence == SEEK_CUR && off == 0)) {
+    dropbehind_->finish();
+    dropbehind_->restart(pos);
+  }
+
+  return pos;
+}
+
+off_t rawfilebuf::seek_positional(off_t off, int whence) {
+  off_t base = 0;
+  if (whence == SEEK_CUR)  base = position_;
+  else if (whence == SEEK_END) {
+    struct stat st;
+    if (::fstat(fd_, &st) < 0)  return -1;
+    base = st.st_size;
+  }
+
+  if (base + off < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  position_ = base + off;
+  if (writebehind_)  writebehind_->reposition(position_);
+  return position_;
 }
 
 std::streampos
-rawfilebuf::seekpos(std::streampos pos, std::ios_base::openmode) {
-  return ::lseek(fd_, pos, SEEK_SET);
+rawfilebuf::seekpos(std::streampos pos, std::ios_base::openmode which) {
+  return seekoff(pos, std::ios::beg, which);
 }
 
 std::streambuf::int_type rawfilebuf::uflow() {
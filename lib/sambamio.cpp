@@ -1,6 +1,6 @@
 /*  sambamio.cpp -- SAM/BAM input/output formatting.
 
-    Copyright (C) 2010, 2012, 2014 Genome Research Ltd.
+    Copyright (C) 2010, 2012, 2014, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -33,17 +33,34 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 #include <string>
 #include <utility>
 #include <vector>
+#include <deque>
+#include <algorithm>
 #include <cstddef>
 #include <cstring>
 
+#include <unistd.h>  // for access()
+
 #include <iostream> // FIXME NUKE-ME
 
 #include <zlib.h>
 
+#if defined __GNUC__ && defined __SSE2__
+#define SPLIT_SSE2
+#include <emmintrin.h>
+#elif defined __GNUC__ && defined __ARM_NEON && defined __AARCH64EL__
+#define SPLIT_NEON
+#include <arm_neon.h>
+#endif
+
 #include "cansam/sam/alignment.h"
 #include "cansam/sam/header.h"
 #include "cansam/sam/stream.h"
 #include "cansam/exception.h"
+#include "cansam/interval.h"
+#include "cansam/streambuf.h"
+#include "lib/bamindex.h"
+#include "lib/bgzf.h"
+#include "lib/thread.h"
 #include "lib/utilities.h"
 #include "lib/wire.h"
 
@@ -55,58 +72,6 @@ using std::string;
 
 namespace sam {
 
-namespace BGZF {
-/* BAM files consist of BGZF blocks, which are RFC 1952 GZIP members with
-a "BC" extra subfield in their headers, typically as follows:
-
-    0  1  2  3  4  5  6  7  8  9 10 11 12 13 14 15 16 17   Offset from start
-   1f 8b .. *4 .. .. .. .. .. .. 06 00 42 43 02 00 .. ..   BGZF signature
-   magic    ^bit 2 is FEXTRA flag      ^B ^C
-
-These BGZF utilities provide what we need for identifying GZIP and BGZF headers
-and extracting the interesting field from the "BC" subfield.  */
-
-// Size, in bytes, of a BGZF block header
-enum { hsize = 18, tsize = 8, full_block_size = 65536,
-       payload_max_size = full_block_size - hsize - tsize };
-
-enum { uncompressed_max_size = 65536 };
-
-// Returns whether the specified memory block starts with a GZIP member header
-inline bool is_gzip_header(const char* s, int length) {
-  return length >= 2 && s[0] == '\x1f' && s[1] == '\x8b';
-}
-
-// Returns whether the specified memory block starts with a valid BGZF header
-inline bool is_bgzf_header(const char* s, int length) {
-  return length >= 18 && s[0] == '\x1f' && s[1] == '\x8b' &&
-	 (s[3] & 4) && memcmp(&s[10], "\6\0\x42\x43\2\0", 6) == 0;
-}
-
-// For a valid BGZF header, returns the block_size field
-inline int block_size(const char* s) {
-  return convert::uint16(&s[16]) + 1;
-}
-
-// Write a BGZF block header, and return the number of bytes written
-inline int write_bgzf_header(char* s, int block_size) {
-  static const char boilerplate[] =
-    { '\x1f', '\x8b', 8, '\x04', 0,0,0,0, 0, '\xff', 6,0, '\x42','\x43', 2,0 };
-
-  memcpy(s, boilerplate, sizeof boilerplate);
-  convert::set_bam_uint16(&s[16], block_size - 1);
-  return hsize;
-}
-
-// Write a BGZF block trailer, and return the number of bytes written
-inline int write_bgzf_trailer(char* s, uint32_t crc, int uncompressed_size) {
-  convert::set_bam_uint32(s, crc);
-  convert::set_bam_uint32(&s[4], uncompressed_size);
-  return tsize;
-}
-
-} // namespace BGZF
-
 namespace CRAM {
 
 // Returns whether the memory block starts with a valid file definition
@@ -120,9 +85,11 @@ inline bool is_cram_file_definition(const char* s, int length) {
 class char_buffer {
 public:
   // Allocate a buffer with the specified capacity
-  char_buffer(size_t sz) : array(new char[sz]), capacity(sz) { clear(); }
+  char_buffer(size_t sz)
+    : array(new char[sz]), capacity(sz), segment(NULL), stitched(NULL)
+    { clear(); }
 
-  ~char_buffer() { delete [] array; }
+  ~char_buffer() { delete stitched; delete segment; delete [] array; }
 
   char* begin;
   char* end;
@@ -136,6 +103,17 @@ public:
   // Empty the buffer, updating begin/end to point to its start
   void clear() { begin = end = array; }
 
+  // Returns the number of character positions preceding  begin.
+  size_t consumed() const { return begin - array; }
+
+  // Exchange contents (including begin/end) with another buffer
+  void swap(char_buffer& other) {
+    std::swap(begin, other.begin);
+    std::swap(end, other.end);
+    std::swap(array, other.array);
+    std::swap(capacity, other.capacity);
+  }
+
   // Move any unread characters to the start of the buffer, updating
   // begin/end accordingly
   void flush() {
@@ -155,16 +133,34 @@ public:
     }
   }
 
-  // Move any unread characters to the start of the buffer and ensure there is
-  // reasonable space available beyond  end, possibly by enlarging the buffer.
-  // Updates begin/end and the specified pointers accordingly.
-  void flush_make_space(char*& ptr, std::vector<char*>& ptrvec);
+  // Append  n  characters, enlarging the buffer geometrically as needed.
+  void append(const char* s, size_t n) {
+    if (available() < n) {
+      if (begin > array)  flush();
+      if (available() < n)  reserve_(std::max(2 * capacity, size() + n));
+    }
+    memcpy(end, s, n);
+    end += n;
+  }
+
+  // Auxiliary buffers used by sambamio::getline() for lines that extend
+  // beyond the characters currently in this buffer: a further segment of
+  // input, and a buffer in which such lines are stitched together.
+  char_buffer& next_segment()
+    { if (! segment)  segment = new char_buffer(32768); return *segment; }
+  char_buffer& stitch_buffer()
+    { if (! stitched)  stitched = new char_buffer(32768); return *stitched; }
 
 private:
+  char_buffer(const char_buffer&) /* = delete */;
+  char_buffer& operator= (const char_buffer&) /* = delete */;
+
   void reserve_(size_t sz);
 
   char* array;
   size_t capacity;
+  char_buffer* segment;
+  char_buffer* stitched;
 };
 
 void char_buffer::reserve_(size_t sz) {
@@ -183,36 +179,6 @@ void char_buffer::reserve_(size_t sz) {
   delete [] oldarray;
 }
 
-void char_buffer::flush_make_space(char*& ptr, std::vector<char*>& ptrvec) {
-  char* oldarray = NULL;
-  char* oldbegin = begin;
-
-  if (begin > array) {
-    memmove(array, begin, end - begin);
-  }
-  else if (available() < 1024 + capacity / 4) {
-    size_t newcapacity = capacity * 2;
-    char* newarray = new char[newcapacity];
-    oldarray = array;
-    memcpy(newarray, begin, end - begin);
-    array = newarray;
-    capacity = newcapacity;
-  }
-  else
-    return;  // Don't bother rewiring the pointers when nothing has changed.
-
-  begin = array;
-  end = &begin[end - oldbegin];
-  ptr = &begin[ptr - oldbegin];
-
-  for (std::vector<char*>::iterator it = ptrvec.begin();
-       it != ptrvec.end(); ++it)
-    *it = &begin[*it - oldbegin];
-
-  delete [] oldarray;
-}
-
-
 /* Pointers to the read buffer are arranged as follows:
 
   [---------ABCDEF/GHIJKL/MNO
@@ -234,18 +200,86 @@ int sambamio::peek(char_buffer& b, isamstream& stream) {
   if (b.begin < b.end)
     return *b.begin;
 
-  if (! stream.eof()) {
-    b.flush();
-    // Read more characters, leaving one position spare for the sentinel.
-    b.end += xsgetn(stream, b.end, b.available() - 1);
-    *b.end = '\n';
-  }
+  // The stream's eofbit may have been set by reading ahead while data remains
+  // to be decoded, so it's left to xsgetn() to decide whether we're at EOF.
+  b.clear();
+  // Read more characters, leaving one position spare for the sentinel.
+  b.end += xsgetn(stream, b.end, b.available() - 1);
+  *b.end = '\n';
 
   return (b.begin < b.end)? *b.begin : EOF;
 }
 
+namespace {
+
+#if defined SPLIT_SSE2 || defined SPLIT_NEON
+#ifdef SPLIT_SSE2
+// Bits per character in the masks returned by delimiters().
+const int delimiter_bits = 1;
+
+// Sets TABS and NEWLINES to masks of the tabs and newlines among the
+// 16 characters at S.
+inline void delimiters(const char* s, uint64_t& tabs, uint64_t& newlines) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+  tabs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+  newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+}
+#else
+const int delimiter_bits = 4;
+
+// NEON has no movemask, but narrowing the byte comparison results to four
+// bits each gives an equivalent mask, of which one bit per character is kept.
+inline uint64_t movemask(uint8x16_t cmp) {
+  uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) &
+	 0x1111111111111111ULL;
+}
+
+inline void delimiters(const char* s, uint64_t& tabs, uint64_t& newlines) {
+  uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(s));
+  tabs = movemask(vceqq_u8(v, vdupq_n_u8('\t')));
+  newlines = movemask(vceqq_u8(v, vdupq_n_u8('\n')));
+}
+#endif
+
+// Splits the characters from S into fields as getline() does, 16 at a time
+// for as long as at least that many precede END.  Returns the position of the
+// first newline found, or of the remaining characters to be examined singly.
+char* split_tabs(char* s, const char* end, std::vector<char*>& fields) {
+  while (end - s >= 16) {
+    uint64_t tabs, newlines;
+    delimiters(s, tabs, newlines);
+
+    // Only the tabs preceding a newline are part of this line.
+    if (newlines)  tabs &= (newlines & -newlines) - 1;
+
+    for (; tabs; tabs &= tabs - 1) {
+      char* tab = s + __builtin_ctzll(tabs) / delimiter_bits;
+      *tab = '\0';
+      fields.push_back(tab + 1);
+    }
+
+    if (newlines)  return s + __builtin_ctzll(newlines) / delimiter_bits;
+    s += 16;
+  }
+
+  return s;
+}
+#else
+inline char* split_tabs(char* s, const char*, std::vector<char*>&) {
+  return s;
+}
+#endif
+
+} // unnamed namespace
+
 /* Reads a newline-terminated line of tab-delimited text into  fields,
 and returns the number of fields present (or 0 at EOF).
+
+Lines are usually parsed in place within  b.  Rather than moving a partial
+line to the start of  b  when the buffer is exhausted, any further characters
+are read into a separate segment, and only a line that actually spans the two
+is copied, into a stitch buffer, by getline_spanning().
 */
 int sambamio::getline(char_buffer& b, isamstream& stream,
 		      std::vector<char*>& fields) {
@@ -253,7 +287,9 @@ int sambamio::getline(char_buffer& b, isamstream& stream,
   fields.push_back(b.begin);
 
   char* s = b.begin;
-  while (true)
+  while (true) {
+    s = split_tabs(s, b.end, fields);
+
     if (*s == '\t') {
       *s++ = '\0';
       fields.push_back(s);
@@ -266,38 +302,108 @@ int sambamio::getline(char_buffer& b, isamstream& stream,
 
 	break;
       }
-      else if (stream.eof()) {
-	// This is the sentinel and no further characters are forthcoming.
-	// If any characters have been read, they constitute a final line
-	// (which is unterminated); otherwise we are properly at EOF.
-	if (s > b.begin) {
-	  // Move the sentinel one character later, to make room for a \0.
-	  b.end++;
-	  if (b.available() == 0)  b.flush_make_space(s, fields);
+      else if (b.begin < b.end && b.available() < 1024)
+	return getline_spanning(b, stream, fields);
+      else {
+	// This is the sentinel, and there is room to read more characters
+	// without disturbing those already read, leaving one position spare
+	// for the sentinel.  (As in peek(), eofbit alone does not mean that
+	// no further characters are forthcoming.)
+	if (b.begin == b.end) {
+	  b.clear();
+	  *b.end = '\n';
+	  s = fields[0] = b.begin;
+	}
+
+	size_t n = xsgetn(stream, b.end, b.available() - 1);
+	if (n > 0) {
+	  b.end += n;
 	  *b.end = '\n';
+	  continue;
+	}
 
+	// No further characters are forthcoming.  If any characters have been
+	// read, they constitute a final line (which is unterminated); otherwise
+	// we are properly at EOF.  There is room to move the sentinel one
+	// character later, to make room for a \0.
+	if (s > b.begin) {
+	  *++b.end = '\n';
 	  *s++ = '\0';
 	  fields.push_back(s);
 	}
 
 	break;
       }
-      else {
-	// This is the sentinel, and there are more characters to be read.
-	b.flush_make_space(s, fields);
-
-	// Read more characters, leaving one position spare for the sentinel.
-	b.end += xsgetn(stream, b.end, b.available() - 1);
-	*b.end = '\n';
-      }
     }
     else
       s++;
+  }
 
   b.begin = s;
   return fields.size() - 1;
 }
 
+/* Completes a line that began at  b.begin  but extends beyond the characters
+currently in  b  (with  fields  as already parsed from them).  The rest of the
+line is read into  b.next_segment(),  and the line is stitched together in
+b.stitch_buffer(),  where  fields  are left pointing.  The segment containing
+any following characters then becomes  b.  */
+int sambamio::getline_spanning(char_buffer& b, isamstream& stream,
+			       std::vector<char*>& fields) {
+  char_buffer& line = b.stitch_buffer();
+  char_buffer& segment = b.next_segment();
+
+  size_t partial_size = b.size();
+  line.clear();
+  line.append(b.begin, partial_size);
+
+  bool terminated = false;
+  do {
+    segment.clear();
+    size_t n = xsgetn(stream, segment.end, segment.available() - 1);
+    segment.end += n;
+    *segment.end = '\n';
+    if (n == 0)  break;
+
+    char* eol = static_cast<char*>(memchr(segment.begin, '\n', n));
+    if (eol) {
+      segment.begin = eol + 1;
+      terminated = true;
+    }
+    else
+      segment.begin = segment.end;
+
+    line.append(segment.end - n, segment.begin - (segment.end - n));
+  } while (! terminated);
+
+  // Make room for a \0 to terminate an unterminated final line.
+  if (! terminated)  line.append("", 1);
+
+  // Now that  line  will not be reallocated, point the fields already parsed
+  // into it.  The unread characters are all in the segment, so it becomes
+  // the buffer.
+  for (std::vector<char*>::iterator it = fields.begin();
+       it != fields.end(); ++it)
+    *it = &line.begin[*it - b.begin];
+
+  b.swap(segment);
+
+  char* eol = line.end - 1;
+  char* s = split_tabs(&line.begin[partial_size], eol, fields);
+  for (; s < eol; s++)
+    if (*s == '\t') {
+      *s = '\0';
+      fields.push_back(s + 1);
+    }
+
+  if (terminated && s > line.begin && s[-1] == '\r')
+    s[-1] = '\0', fields.push_back(s);
+  else
+    *s = '\0', fields.push_back(s + 1);
+
+  return fields.size() - 1;
+}
+
 // Called from get(collection&); allocates a new cindex, as we're effectively
 // assigning a new collection that's unrelated to whatever was previously
 // in  headers.  Caches the new cindex for use in get(alignment&).
@@ -306,6 +412,33 @@ void sambamio::set_cindex(collection& headers) {
   header_cindex = headers.cindex;
 }
 
+bool sambamio::get(isamstream& stream, alignment_view& view) {
+  view.aln = &view.copy;
+  return get(stream, view.copy);
+}
+
+void sambamio::scan(isamstream& stream, alignment_handler& handler, int) {
+  alignment aln;
+  while (get(stream, aln))
+    handler.process(aln, 0);
+}
+
+void sambamio::seek(isamstream&, const seqinterval&) {
+  throw sam::exception("Region queries are supported only for BAM files");
+}
+
+uint64_t sambamio::tell(isamstream&) {
+  throw sam::exception("Stream positioning is not supported for this format");
+}
+
+void sambamio::seek(isamstream&, uint64_t) {
+  throw sam::exception("Stream positioning is not supported for this format");
+}
+
+void sambamio::build_index(osamstream&, const string&) {
+  throw sam::exception("Indexes can be built only for BAM files");
+}
+
 inline size_t min(size_t a, size_t b) { return (a < b)? a : b; }
 
 /* A sam::alignment object contains only a pointer to a variable-sized memory
@@ -323,102 +456,234 @@ file, except that the variable-length fields have been rearranged so that the
 packed cigar and seq fields are first and thus naturally aligned.  */
 
 
-// Binary BAM files
-// ================
-
-class bamio : public sambamio {
-public:
-  bamio(const char* text, std::streamsize textsize);
-  bamio(bool compression);
-  virtual ~bamio();
-
-  virtual bool get(isamstream&, collection&);
-  virtual bool get(isamstream&, alignment&);
-  virtual void put(osamstream&, const collection&);
-  virtual void put(osamstream&, const alignment&);
-  virtual void flush(osamstream&);
+// BGZF block input/output
+// =======================
 
+/* BAM files, and BGZF-compressed SAM files, consist of a series of BGZF blocks.
+When reading, blocks are decompressed in turn into  buffer,  from which read()
+returns the uncompressed data.  When writing, data is accumulated in  buffer
+and compressed into blocks that are gathered in  cdata  and written out.
+This class is mixed in to the sambamio classes for such files, which deal
+with interpreting the uncompressed data.  */
+class bgzfio {
 protected:
-  virtual size_t xsgetn(isamstream&, char*, size_t);
+  bgzfio(const char* text, std::streamsize textsize);
+  bgzfio(int compression_level, size_t buffer_size);
+  ~bgzfio();
 
-private:
   size_t read(isamstream&, void*, size_t);
-  int32_t read_int32(isamstream&);
-  void read_refinfo(isamstream& stream, string& name, coord_t& length);
-
   bool underflow(isamstream&);
   void fill_cdata(isamstream&, size_t);
-  size_t inflate_into_buffer(char*, size_t);
 
-  size_t deflate_onto_cdata(osamstream&, char*, size_t);
+  uint64_t tell_voffset() const;
+  void seek_voffset(isamstream&, uint64_t);
+
+  void write(osamstream&, const char*, size_t);
+  void flush_buffer(osamstream&, size_t);
+  void flush_blocks(osamstream&);
 
-  static string zlib_message(const char* function, const z_stream& z);
+  void set_threads(int nthreads);
+  void set_block_cache(block_cache* c) { cache = c; }
+  void set_compression(int level);
 
   char_buffer buffer;
+  size_t buffer_size;  // Used when writing, as deflate jobs swap buffers
   char_buffer cdata;
 
-  int compression_level;      // Used in deflate_onto_cdata()
-  size_t header_text_length;  // Used in xsgetn()
+  // Positions within the uncompressed data of the end of the data that has
+  // been handed off to be compressed, and within the file of the end of the
+  // compressed blocks appended to  cdata.  When  indexing,  the positions of
+  // each block are recorded in  block_offsets,  so that positions within the
+  // uncompressed data can be translated into virtual offsets.
+  uint64_t uncompressed_offset, compressed_offset;
+  bool indexing;
+  bgzf_offset_map block_offsets;
+
+private:
+  class block_job;
+  class inflate_job;
+  class deflate_job;
+
+  size_t peek_block(isamstream&);
+  void next_block(size_t);
+  void queue_blocks(isamstream&);
+  void discard_pending();
+
+  void append_cdata(osamstream&, const char*, size_t, uint64_t);
+  void write_pending(osamstream&, size_t);
+  void write_cdata(osamstream&);
+  void adapt_level();
+
+  int compression_level;  // Used by deflater and deflate jobs
+
+  // When the level is being adapted to throughput, the time at which the
+  // previous block was handed off for compression, and the time since then
+  // spent compressing (divided among the worker threads, if any) and spent
+  // by this thread compressing or waiting for worker threads to do so.
+  adaptive_level* adaptive;
+  double block_time, compress_time, wait_time;
+
+  block_inflater inflater;
+  block_deflater deflater;
+
+  // When worker threads have been requested, BGZF blocks are read ahead and
+  // queued for decompression by the pool, or filled and queued for compression
+  // by the pool.  Jobs are consumed in order from the front of  pending,  and
+  // finished jobs are recycled via  idle.
+  thread_pool* pool;
+  std::deque<block_job*> pending;
+  std::vector<block_job*> idle;
+  size_t max_pending;
+  bool readahead_failed;
+
+  // When reading, blocks are looked up in and added to  cache,  if any.
+  block_cache* cache;
+
+  // The BGZF block located by peek_block(), and the in-memory or memory-mapped
+  // buffer containing it (or NULL if it is instead at the start of  cdata).
+  const char* block;
+  membuf* block_source;
+
+  // File offsets of the BGZF block whose data is in  buffer,  of the block
+  // following it, and of the data at  cdata.begin;  and the start of the
+  // current block's data within  buffer.  Used to compute virtual offsets.
+  uint64_t buffer_offset, buffer_next_offset, cdata_offset;
+  const char* buffer_start;
+};
 
-  z_stream zinflate, zdeflate;
-  bool zinflate_active, zdeflate_active;
+// A BGZF block to be decompressed or compressed by a worker thread.
+class bgzfio::block_job : public thread_pool::task {
+public:
+  virtual ~block_job() { }
+
+  char_buffer buffer;  // Uncompressed data
+  char_buffer cdata;   // A complete BGZF block
+  std::string error;
+
+protected:
+  block_job(size_t buffer_size)
+    : buffer(buffer_size), cdata(BGZF::full_block_size) { }
+
+  void set_error(const std::exception& e, const char* default_message) {
+    error = e.what();
+    if (error.empty())  error = default_message;
+  }
+};
+
+// A BGZF block read ahead and awaiting decompression into  buffer.
+class bgzfio::inflate_job : public block_job {
+public:
+  inflate_job() : block_job(BGZF::uncompressed_max_size) { }
+
+  // Note the complete BGZF block at DATA, ready to be decompressed.  Unless
+  // it lies within an in-memory or memory-mapped buffer, and so will remain
+  // valid while the job is outstanding, it is first copied into  cdata.
+  void assign(const char* data, size_t size, bool mapped) {
+    if (! mapped) {
+      cdata.clear();
+      memcpy(cdata.end, data, size);
+      cdata.end += size;
+      data = cdata.begin;
+    }
+
+    block = data;
+    block_size = size;
+  }
+
+  virtual void run();
+
+  const char* block;  // The BGZF block, either in  cdata  or a membuf
+  uint64_t offset;    // Position of the block within the file
+  size_t block_size;  // Size of the compressed block
+  bool cached;        // Whether  buffer  was filled from the block cache
+
+private:
+  block_inflater inflater;
+};
+
+void bgzfio::inflate_job::run() {
+  buffer.clear();
+  error.clear();
+
+  try {
+    buffer.end += inflater.inflate(buffer.end, buffer.available(),
+				   block, block_size);
+  }
+  catch (const std::exception& e) {
+    set_error(e, "BGZF decompression failed");
+  }
+}
+
+// Uncompressed data in  buffer  awaiting compression into a BGZF block.
+// As this  buffer  is exchanged with bgzfio's own, it has the same capacity.
+class bgzfio::deflate_job : public block_job {
+public:
+  deflate_job(int level, size_t buffer_size)
+    : block_job(buffer_size), deflater(level) { }
 
-  typedef unsigned char uchar;  // For casting to the pointers exposed by zlib
+  virtual void run();
 
-  // Hmmm...
-  void flush_buffer(osamstream&);
+  uint64_t offset;  // Position of the block's data within the uncompressed data
+  double seconds;   // Time taken to compress the block
+  block_deflater deflater;
 };
 
-// Called when blah blah blah
-void bamio::flush_buffer(osamstream& stream) {
-  buffer.begin += deflate_onto_cdata(stream, buffer.begin, min(buffer.size(), BGZF::uncompressed_max_size));
-  buffer.flush();
+void bgzfio::deflate_job::run() {
+  cdata.clear();
+  error.clear();
+
+  try {
+    double start = monotonic_time();
+    cdata.end += deflater.deflate(cdata.end, buffer.begin, buffer.size());
+    seconds = monotonic_time() - start;
+  }
+  catch (const std::exception& e) {
+    set_error(e, "BGZF compression failed");
+  }
 }
 
-// Constructor used when reading a BAM stream.
-bamio::bamio(const char* text, std::streamsize textsize)
-  : buffer(65536), cdata(65536),
-    zinflate_active(false), zdeflate_active(false) {
+// Constructor used when reading a BGZF stream, of which TEXT is the start.
+bgzfio::bgzfio(const char* text, std::streamsize textsize)
+  : buffer(65536), buffer_size(65536), cdata(65536),
+    uncompressed_offset(0), compressed_offset(0), indexing(false),
+    compression_level(Z_DEFAULT_COMPRESSION), adaptive(NULL),
+    deflater(compression_level),
+    pool(NULL), max_pending(0), readahead_failed(false), cache(NULL),
+    block(NULL), block_source(NULL),
+    buffer_offset(0), buffer_next_offset(0), cdata_offset(0),
+    buffer_start(buffer.begin) {
   memcpy(cdata.end, text, textsize);
   cdata.end += textsize;
 }
 
-// Constructor used when writing a BAM stream.
-bamio::bamio(bool compression)
-  : buffer(BGZF::uncompressed_max_size + sizeof(alignment::bamcore)),
-    cdata(BGZF::full_block_size),
-    compression_level(compression? Z_DEFAULT_COMPRESSION : Z_NO_COMPRESSION),
-    zinflate_active(false), zdeflate_active(false) {
+// Constructor used when writing a BGZF stream.  As there is no need to keep
+// the compressed data aligned with the streambuf's blocks, completed BGZF
+// blocks are gathered in  cdata  so that several are written at once.
+// BUFFER_SIZE must be at least BGZF::uncompressed_block_size.
+bgzfio::bgzfio(int level, size_t buffer_size)
+  : buffer(buffer_size), buffer_size(buffer_size),
+    cdata(4 * BGZF::full_block_size),
+    uncompressed_offset(0), compressed_offset(0), indexing(false),
+    compression_level(level), adaptive(NULL), deflater(compression_level),
+    pool(NULL), max_pending(0), readahead_failed(false), cache(NULL),
+    block(NULL), block_source(NULL),
+    buffer_offset(0), buffer_next_offset(0), cdata_offset(0),
+    buffer_start(buffer.begin) {
 }
 
-string bamio::zlib_message(const char* function, const z_stream& z) {
-  make_string s;
-  s << "zlib::" << function << "() failed";
-  if (z.msg)  s << ": " << z.msg;
-  return s;
-}
+bgzfio::~bgzfio() {
+  // Stop the worker threads before deleting the jobs they might be using.
+  delete pool;
 
-bamio::~bamio() {
-  // In general, destructors should not throw exceptions.  Thus Z_DATA_ERROR
-  // is ignored below, as in this case the problem will already have been
-  // reported by an earlier zlib function and caused an exception to be
-  // thrown, so the present code will likely have been reached during the
-  // resulting stack unwinding -- hence must not itself throw.
-  //
-  // However Z_STREAM_ERRORs reported by these functions represent bugs in
-  // the calling program; since this Can't Happen, we'd like to hear about
-  // it, either by exception or via terminate().
+  for (std::deque<block_job*>::iterator it = pending.begin();
+       it != pending.end(); ++it)
+    delete *it;
 
-  if (zinflate_active) {
-    if (inflateEnd(&zinflate) != Z_OK)
-      throw std::logic_error(zlib_message("inflateEnd", zinflate));
-  }
+  for (std::vector<block_job*>::iterator it = idle.begin();
+       it != idle.end(); ++it)
+    delete *it;
 
-  if (zdeflate_active) {
-    int status = deflateEnd(&zdeflate);
-    if (status != Z_OK && status != Z_DATA_ERROR)
-      throw std::logic_error(zlib_message("deflateEnd", zdeflate));
-  }
+  delete adaptive;
 }
 
 // Fill  cdata  by reading from the streambuf.  Reads at least  desired_size
@@ -426,172 +691,265 @@ bamio::~bamio() {
 // the buffer, which is probably several BGZF blocks.  This reduces the number
 // of read(2) system calls for sequential access, and (with modern disk block
 // sizes) shouldn't mean too much data is discarded by any subsequent seek().
-void bamio::fill_cdata(isamstream& stream, size_t desired_size) {
+void bgzfio::fill_cdata(isamstream& stream, size_t desired_size) {
   cdata.flush();
 
   if (! stream.eof())
     do {
-      std::streamsize n = rdbuf_sgetn(stream, cdata.end, cdata.available());
+      std::streamsize n =
+	sambamio::rdbuf_sgetn(stream, cdata.end, cdata.available());
       if (n == 0)  break;
       cdata.end += n;
     } while (cdata.size() < desired_size);
 }
 
-// Compress the specified data into  cdata, appending to whatever is already
-// in  cdata  and writing that to the stream if necessary to make space.
-// Returns the number of input bytes actually compressed into the output block.
-size_t
-bamio::deflate_onto_cdata(osamstream& stream, char* data, size_t length) {
-  while (true) {
-    zdeflate.next_in = reinterpret_cast<uchar*>(data);
-    zdeflate.avail_in = length;
+// Locate the next complete BGZF block, setting  block  to point to it.
+// When reading from memory (a membuf, e.g., a memory-mapped file), the block
+// is used in place if possible; otherwise  cdata  is made to begin with it,
+// reading from the streambuf if necessary.  Returns the total size of the
+// block, or 0 if the stream is cleanly at EOF.  On errors,  cdata.begin  is
+// left unchanged, so the same problem will be reported if this is called
+// again.
+size_t bgzfio::peek_block(isamstream& stream) {
+  block_source = NULL;
+
+  if (cdata.size() == 0) {
+    membuf* mapped = dynamic_cast<membuf*>(stream.rdbuf());
+    if (mapped) {
+      std::streamsize length;
+      const char* data = mapped->unread(length);
+      if (BGZF::is_bgzf_header(data, length)) {
+	size_t size = BGZF::block_size(data);
+	if (size >= size_t(BGZF::hsize + BGZF::tsize) &&
+	    size <= size_t(length)) {
+	  block = data;
+	  block_source = mapped;
+	  return size;
+	}
+      }
 
-    if (zdeflate_active) {
-      if (deflateReset(&zdeflate) != Z_OK)
-	throw std::logic_error(zlib_message("deflateReset", zdeflate));
-    }
-    else {
-      zdeflate.zalloc = Z_NULL;
-      zdeflate.zfree  = Z_NULL;
-      if (deflateInit2(&zdeflate, compression_level, Z_DEFLATED,
-		       -15, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
-	throw std::logic_error(zlib_message("deflateInit2", zdeflate));
-      zdeflate_active = true;
+      // Otherwise EOF or the problem with the data will be dealt with below.
     }
+  }
 
-    // At this point, and in general, the invariant is that  cdata.[begin,end)
-    // contains buffered previously-deflated blocks.  We compress the new block
-    // into the available space after  cdata.end.
+  if (cdata.size() < BGZF::hsize) {
+    fill_cdata(stream, BGZF::hsize);
+    // If there's still no data, we're cleanly at EOF.
+    if (cdata.size() == 0)  return 0;
+  }
 
-    if (cdata.available() < 10 * 1024) {
-      // Ensure that there is space available for the block header
-      // and a reasonable stab at compression.
-      while (cdata.size() > 0)
-	cdata.begin += stream.rdbuf()->sputn(cdata.begin, cdata.size());
-      cdata.flush();
-    }
+  if (! BGZF::is_bgzf_header(cdata.begin, cdata.size()))
+    throw bad_format("Invalid BGZF block header");
 
-    zdeflate.next_out = reinterpret_cast<uchar*>(cdata.end + BGZF::hsize);
-    zdeflate.avail_out = min(cdata.available() - BGZF::hsize - BGZF::tsize,
-			     BGZF::payload_max_size);
+  size_t size = BGZF::block_size(cdata.begin);
+  if (size < BGZF::hsize + BGZF::tsize)
+    throw bad_format("Invalid BGZF block size");
 
-    int status = deflate(&zdeflate, Z_FINISH);
-    if (status == Z_OK) {
-      // There was not enough output space, either because there really isn't
-      // much space available in  cdata  or (conceivably) because the data
-      // cannot be compressed within the block payload size.  We flush previous
-      // blocks from  cdata  and continue deflate()ing -- the capacity of  cdata
-      // exceeds the BGZF block size, so after flushing these two cases can be
-      // distinguished.
+  if (cdata.size() < size) {
+    fill_cdata(stream, size);
+    if (cdata.size() < size)
+      throw bad_format(make_string()
+	  << "Truncated BGZF block (expected " << size - BGZF::hsize
+	  << " bytes after header; got " << cdata.size() - BGZF::hsize << ")");
+  }
 
-      while (cdata.size() > 0)
-	cdata.begin += stream.rdbuf()->sputn(cdata.begin, cdata.size());
+  block = cdata.begin;
+  return size;
+}
 
-      // Temporarily extend  cdata.[begin,end)  to include the partially-
-      // written block, so that it will be maintained across the flush().
-      cdata.end = reinterpret_cast<char*>(zdeflate.next_out);
-      cdata.flush();
+// Move past the block of SIZE bytes previously located by peek_block().
+void bgzfio::next_block(size_t size) {
+  if (block_source)  block_source->skip(size);
+  else  cdata.begin += size;
 
-      zdeflate.next_out = reinterpret_cast<uchar*>(cdata.end);
-      zdeflate.avail_out = BGZF::payload_max_size - zdeflate.total_out;
+  cdata_offset += size;
+}
 
-      // Re-establish the general  cdata.[begin,end)  invariant.
-      cdata.end = cdata.begin;
+// Read ahead, queueing further BGZF blocks for decompression by the thread
+// pool until there are  max_pending  of them outstanding.
+void bgzfio::queue_blocks(isamstream& stream) {
+  if (readahead_failed) {
+    // Report the problem only once the blocks preceding it have been used.
+    if (! pending.empty())  return;
+    readahead_failed = false;
+  }
 
-      if (zdeflate.avail_out > 0)
-	status = deflate(&zdeflate, Z_FINISH);
+  while (pending.size() < max_pending) {
+    size_t size;
+    try { size = peek_block(stream); }
+    catch (...) {
+      if (pending.empty())  throw;
+      readahead_failed = true;
+      break;
     }
 
-    // Normally deflation was successfully completed, and we break out of
-    // this loop the first time through...
-    if (status == Z_STREAM_END)
-      break;
-    else if (status != Z_OK)
-      throw sam::exception(zlib_message("deflate", zdeflate));
-
-    // ...otherwise this is the unusual case of incompressible data that
-    // cannot be made to fit within the block payload size.  Try again, but
-    // only attempt to compress approximately the amount of data known to fit.
-    if (zdeflate.total_in >= 1024)
-      length = zdeflate.total_in - 128;
-    else
-      throw std::logic_error("implausibly incompressible data");
-  }
+    if (size == 0)  break;
+
+    inflate_job* job;
+    if (idle.empty())  job = new inflate_job;
+    else  job = static_cast<inflate_job*>(idle.back()), idle.pop_back();
+
+    job->offset = cdata_offset;
+    job->block_size = size;
+    job->buffer.clear();
+    job->error.clear();
+    job->cached = false;
+    if (cache) {
+      size_t length = cache->find(cdata_offset, job->buffer.end);
+      job->buffer.end += length;
+      job->cached = (length > 0);
+    }
 
-  uint32_t crc =
-      crc32(crc32(0, NULL, 0), reinterpret_cast<uchar*>(data), length);
+    if (! job->cached)  job->assign(block, size, block_source != NULL);
+    next_block(size);
 
-  // Fill in the BGZF header and trailer, and extend  cdata.[begin,end)
-  // to encompass the newly buffered block.
-  cdata.end += BGZF::write_bgzf_header(cdata.end,
-			BGZF::hsize + zdeflate.total_out + BGZF::tsize);
-  cdata.end += zdeflate.total_out;
-  cdata.end += BGZF::write_bgzf_trailer(cdata.end, crc, length);
-  return length;
+    pending.push_back(job);
+    if (! job->cached)  pool->submit(job);
+  }
 }
 
-// Decompress the specified data into  buffer, discarding whatever may have
-// been there previously.
-// FIXME Maybe don't have underflow() skip the header so we can do
-// inflateInit() normal not raw mode and get CRC checking
-size_t bamio::inflate_into_buffer(char* data, size_t length) {
-  zinflate.next_in  = reinterpret_cast<uchar*>(data);
-  zinflate.avail_in = length;
+// Decompress one BGZF block into  buffer,  which is assumed to be previously
+// empty, from  cdata,  which is refilled by reading from the streambuf if
+// necessary.  Returns true if  buffer  is nonempty afterwards.
+bool bgzfio::underflow(isamstream& stream) {
+  if (pool)  queue_blocks(stream);
+
+  if (! pending.empty()) {
+    block_job* job = pending.front();
+    if (pool)  pool->wait(job);
 
-  if (zinflate_active) {
-    if (inflateReset(&zinflate) != Z_OK)
-      throw std::logic_error(zlib_message("inflateReset", zinflate));
+    pending.pop_front();
+    idle.push_back(job);
+
+    if (! job->error.empty())  throw bad_format(job->error);
+
+    inflate_job* ijob = static_cast<inflate_job*>(job);
+    if (cache && ! ijob->cached)
+      cache->insert(ijob->offset, ijob->buffer.begin, ijob->buffer.size());
+
+    buffer.swap(ijob->buffer);
+    buffer_start = buffer.begin;
+    buffer_offset = ijob->offset;
+    buffer_next_offset = ijob->offset + ijob->block_size;
+    return true;
   }
+
+  size_t size = peek_block(stream);
+  if (size == 0)  return false;
+
+  buffer.clear();
+  size_t length = cache? cache->find(cdata_offset, buffer.end) : 0;
+  if (length > 0)
+    buffer.end += length;
   else {
-    zinflate.zalloc = Z_NULL;
-    zinflate.zfree  = Z_NULL;
-    if (inflateInit2(&zinflate, -15) != Z_OK)
-      throw std::logic_error(zlib_message("inflateInit2", zinflate));
-    zinflate_active = true;
+    buffer.end += inflater.inflate(buffer.end, buffer.available(),
+				   block, size);
+    if (cache)  cache->insert(cdata_offset, buffer.begin, buffer.size());
   }
 
-  buffer.clear();
-  zinflate.next_out  = reinterpret_cast<uchar*>(buffer.end);
-  zinflate.avail_out = buffer.available();
-  if (inflate(&zinflate, Z_FINISH) != Z_STREAM_END)
-    throw bad_format(zlib_message("inflate", zinflate));
+  buffer_start = buffer.begin;
+  buffer_offset = cdata_offset;
+  next_block(size);
+  buffer_next_offset = cdata_offset;
+  return true;
+}
 
-  buffer.end += zinflate.total_out;
-  return zinflate.total_in;
+// Returns the BGZF virtual offset of the next data to be read from  buffer.
+// When  buffer  is exhausted, this is the start of the following block.
+uint64_t bgzfio::tell_voffset() const {
+  if (buffer.size() == 0)  return buffer_next_offset << 16;
+  else  return (buffer_offset << 16) | (buffer.begin - buffer_start);
 }
 
-// Decompress one BGZF block into  buffer,  which is assumed to be previously
-// empty, from  cdata,  which is refilled by reading from the streambuf if
-// necessary.  Returns true if  buffer  is nonempty afterwards.
-bool bamio::underflow(isamstream& stream) {
-  if (cdata.size() < BGZF::hsize) {
-    fill_cdata(stream, BGZF::hsize);
-    // If there's still no data, we're cleanly at EOF.
-    if (cdata.size() == 0)  return false;
+// Withdraw any read-ahead blocks, which are no longer wanted.
+void bgzfio::discard_pending() {
+  for (std::deque<block_job*>::iterator it = pending.begin();
+       it != pending.end(); ++it) {
+    if (pool)  pool->cancel(*it);
+    idle.push_back(*it);
   }
 
-  if (BGZF::is_bgzf_header(cdata.begin, cdata.size())) {
-    // "Block only" measures compressed-payload & trailer, excluding the header.
-    size_t blockonly_length = BGZF::block_size(cdata.begin) - BGZF::hsize;
-    cdata.begin += BGZF::hsize;
-    if (cdata.size() < blockonly_length) {
-      fill_cdata(stream, blockonly_length);
-      if (cdata.size() < blockonly_length)
-	throw bad_format(make_string()
-	    << "Truncated BGZF block (expected " << blockonly_length
-	    << " bytes after header; got " << cdata.size() << ")");
-    }
+  pending.clear();
+  readahead_failed = false;
+}
+
+// Reposition the stream to the specified BGZF virtual offset.
+void bgzfio::seek_voffset(isamstream& stream, uint64_t voffset) {
+  discard_pending();
+  buffer.clear();
+  cdata.clear();
 
-    cdata.begin += inflate_into_buffer(cdata.begin, blockonly_length);
-    cdata.begin += 8; // FIXME skip the GZIP member footer... should check it
+  uint64_t offset = voffset >> 16;
+  size_t within = voffset & 0xffff;
 
-    return true;
+  std::streampos pos = stream.rdbuf()->pubseekpos(offset, std::ios::in);
+  if (pos != std::streampos(offset))
+    throw sam::exception("BAM stream is not seekable");
+
+  // Reading ahead may have reached EOF, but there is more to be read now.
+  stream.clear(stream.rdstate() & ~std::ios::eofbit);
+
+  buffer_offset = buffer_next_offset = cdata_offset = offset;
+  buffer_start = buffer.begin;
+
+  if (within > 0) {
+    if (! underflow(stream) || within > buffer.size())
+      throw bad_format("Invalid BGZF virtual offset");
+    buffer.begin += within;
+  }
+}
+
+// Use a pool of NTHREADS worker threads for decompression or compression,
+// or do it on the calling thread if NTHREADS is 0.
+void bgzfio::set_threads(int nthreads) {
+  if (pool) {
+    // Outstanding jobs' results are still needed, so let them finish.
+    for (std::deque<block_job*>::iterator it = pending.begin();
+	 it != pending.end(); ++it)
+      pool->wait(*it);
+
+    delete pool;
+    pool = NULL;
+  }
+
+  if (nthreads > 0) {
+    pool = new thread_pool(nthreads);
+    max_pending = 4 * nthreads;
+  }
+}
+
+// Compress subsequent blocks at LEVEL, or at levels varying with throughput.
+void bgzfio::set_compression(int level) {
+  if (level == adaptive_compression) {
+    if (! adaptive) {
+      adaptive = new adaptive_level;
+      compression_level = adaptive->level();
+      block_time = monotonic_time();
+      compress_time = wait_time = 0.0;
+    }
+  }
+  else if (level >= Z_DEFAULT_COMPRESSION && level <= Z_BEST_COMPRESSION) {
+    delete adaptive;
+    adaptive = NULL;
+    compression_level = level;
   }
   else
-    throw bad_format("Invalid BGZF block header");
+    throw sam::exception(make_string()
+	<< "Invalid compression level (" << level << ")");
 }
 
-size_t bamio::read(isamstream& stream, void* destv, size_t desired_length) {
+// Account for the block just handed off for compression, and choose the
+// level at which to compress the next one.
+void bgzfio::adapt_level() {
+  double now = monotonic_time();
+  double other_time = std::max(now - block_time - wait_time, 0.0);
+  compression_level = adaptive->update(compress_time, other_time);
+
+  block_time = now;
+  compress_time = wait_time = 0.0;
+}
+
+size_t bgzfio::read(isamstream& stream, void* destv, size_t desired_length) {
   char* dest = static_cast<char*>(destv);
 
   // TODO  Ideally this would unpack just enough of the stream to fill DEST
@@ -618,31 +976,251 @@ size_t bamio::read(isamstream& stream, void* destv, size_t desired_length) {
   return length;
 }
 
-int32_t bamio::read_int32(isamstream& stream) {
-  int32_t x;
-  if (read(stream, &x, sizeof x) < sizeof x)
-    throw bad_format("Truncated BAM header");
+// Compress the first LENGTH bytes of  buffer  into a BGZF block, either
+// directly onto  cdata  or by handing them to the thread pool, and remove
+// them from  buffer.
+void bgzfio::flush_buffer(osamstream& stream, size_t length) {
+  if (pool) {
+    write_pending(stream, max_pending - 1);
+
+    deflate_job* job;
+    if (idle.empty())  job = new deflate_job(compression_level, buffer_size);
+    else  job = static_cast<deflate_job*>(idle.back()), idle.pop_back();
+
+    // Hand over the whole of  buffer,  and take back any data beyond LENGTH.
+    buffer.swap(job->buffer);
+    size_t excess = job->buffer.size() - length;
+    buffer.clear();
+    buffer.make_available(excess);
+    memcpy(buffer.end, job->buffer.begin + length, excess);
+    buffer.end += excess;
+    job->buffer.end -= excess;
+
+    job->offset = uncompressed_offset;
+    job->deflater.set_level(compression_level);
+    pending.push_back(job);
+    pool->submit(job);
+  }
+  else {
+    // Blocks compressed before threads were turned off must go out first.
+    if (! pending.empty())  write_pending(stream, 0);
+
+    if (cdata.available() < BGZF::full_block_size)  write_cdata(stream);
+    deflater.set_level(compression_level);
+    double start = adaptive? monotonic_time() : 0.0;
+    size_t size = deflater.deflate(cdata.end, buffer.begin, length);
+    if (adaptive) {
+      double seconds = monotonic_time() - start;
+      compress_time += seconds;
+      wait_time += seconds;
+    }
 
-  convert::set_int32(x);
-  return x;
-}
+    append_cdata(stream, NULL, size, uncompressed_offset);
+    buffer.begin += length;
+    buffer.flush();
+  }
 
-void bamio::read_refinfo(isamstream& stream, string& name, coord_t& length) {
-  size_t name_length = read_int32(stream);
+  uncompressed_offset += length;
+  if (adaptive)  adapt_level();
+}
 
-  // FIXME We can do better than this...
-  // ...but might have to invent better abstraction than read()
+// Append the SIZE-byte compressed block at DATA, holding the uncompressed
+// data starting at UOFFSET, to  cdata  (or account for it already having been
+// written there, if DATA is NULL).
+void bgzfio::append_cdata(osamstream& stream, const char* data, size_t size,
+			 uint64_t uoffset) {
+  if (data) {
+    if (cdata.available() < size)  write_cdata(stream);
+    memcpy(cdata.end, data, size);
+  }
 
-  char namebuf[300];
-  if (read(stream, namebuf, name_length) < name_length)
-    throw bad_format("Truncated BAM header (in reference list)");
+  cdata.end += size;
 
-  name.assign(namebuf, name_length - 1);
-  length = read_int32(stream);
+  if (indexing)  block_offsets.add(uoffset, compressed_offset);
+  compressed_offset += size;
 }
 
-size_t bamio::xsgetn(isamstream& stream, char* buffer, size_t length) {
-  if (header_text_length > 0) {
+// Append the compressed blocks from jobs at the front of  pending  to  cdata,
+// waiting for them to finish if necessary, until at most LIMIT remain.
+void bgzfio::write_pending(osamstream& stream, size_t limit) {
+  while (pending.size() > limit) {
+    deflate_job* job = static_cast<deflate_job*>(pending.front());
+    double start = adaptive? monotonic_time() : 0.0;
+    if (pool)  pool->wait(job);
+
+    pending.pop_front();
+    idle.push_back(job);
+
+    if (! job->error.empty())  throw sam::exception(job->error);
+
+    if (adaptive) {
+      wait_time += monotonic_time() - start;
+      compress_time += job->seconds / (pool? pool->size() : 1);
+    }
+
+    append_cdata(stream, job->cdata.begin, job->cdata.size(), job->offset);
+  }
+}
+
+// Write all buffered compressed blocks in  cdata  to the streambuf.
+void bgzfio::write_cdata(osamstream& stream) {
+  while (cdata.size() > 0)
+    cdata.begin += stream.rdbuf()->sputn(cdata.begin, cdata.size());
+  cdata.clear();
+}
+
+// Append LENGTH bytes at DATA to the data to be compressed, compressing
+// each block as it is filled.
+void bgzfio::write(osamstream& stream, const char* data, size_t length) {
+  while (length > 0) {
+    size_t n = min(length, BGZF::uncompressed_block_size - buffer.size());
+    buffer.make_available(n);
+    memcpy(buffer.end, data, n);
+    buffer.end += n;
+    data += n;
+    length -= n;
+
+    if (buffer.size() >= BGZF::uncompressed_block_size)
+      flush_buffer(stream, BGZF::uncompressed_block_size);
+  }
+}
+
+// Compress all buffered data, and write out all compressed blocks.
+void bgzfio::flush_blocks(osamstream& stream) {
+  while (buffer.size() > 0)
+    flush_buffer(stream, min(buffer.size(), BGZF::uncompressed_block_size));
+  buffer.clear();
+
+  write_pending(stream, 0);
+  write_cdata(stream);
+}
+
+
+// Binary BAM files
+// ================
+
+class bamio : public sambamio, private bgzfio {
+public:
+  bamio(const char* text, std::streamsize textsize);
+  bamio(bool compression);
+  virtual ~bamio();
+
+  virtual bool get(isamstream&, collection&);
+  virtual bool get(isamstream&, alignment&);
+  virtual bool get(isamstream&, alignment_view&);
+  virtual void put(osamstream&, const collection&);
+  virtual void put(osamstream&, const alignment&);
+  virtual void flush(osamstream&);
+  virtual void close(osamstream&);
+
+  virtual void set_threads(int nthreads);
+  virtual void set_block_cache(block_cache* cache);
+  virtual void set_compression(int level);
+  virtual void scan(isamstream&, alignment_handler&, int nparts);
+  virtual void seek(isamstream&, const seqinterval&);
+  virtual uint64_t tell(isamstream&);
+  virtual void seek(isamstream&, uint64_t);
+  virtual void build_index(osamstream&, const string&);
+
+protected:
+  virtual size_t xsgetn(isamstream&, char*, size_t);
+
+private:
+  int32_t read_int32(isamstream&);
+  void read_refinfo(isamstream& stream, string& name, coord_t& length);
+  bool get_record(isamstream&, alignment&);
+  bool get_record(isamstream&, alignment_view&);
+  static void convert_core(alignment&, uint32_t rest_length, int cindex);
+  template <typename AlignmentType>
+  bool get_overlapping(isamstream&, AlignmentType&);
+  void load_index(isamstream&);
+
+  size_t header_text_length;  // Used in xsgetn()
+  int reference_count;  // Number of reference sequences, used by scan()
+
+  class scan_task;  // A part of the file being processed by scan()
+
+  // When a region has been requested via seek(), get() visits the chunks
+  // listed by the index in turn, skipping records that don't overlap it.
+  // When writing, the index is instead built as records are written, and
+  // saved to  index_filename  when the stream is closed.
+  bam_index index;
+  std::vector<bam_index::chunk> chunks;
+  size_t next_chunk;
+  uint64_t chunk_end;
+  bool region_active;
+  int region_rindex;
+  coord_t region_zstart, region_zlimit;
+  string index_filename;
+};
+
+// Constructor used when reading a BAM stream.
+bamio::bamio(const char* text, std::streamsize textsize)
+  : bgzfio(text, textsize), reference_count(0), region_active(false) {
+}
+
+// Constructor used when writing a BAM stream.  The buffer's capacity exceeds
+// the BGZF uncompressed block size by at least sizeof(bamcore), as put()
+// relies upon.
+bamio::bamio(bool compression)
+  : bgzfio(compression? Z_DEFAULT_COMPRESSION : Z_NO_COMPRESSION,
+	   BGZF::uncompressed_max_size + sizeof(alignment::bamcore)),
+    region_active(false) {
+}
+
+bamio::~bamio() {
+}
+
+void bamio::set_threads(int nthreads) {
+  bgzfio::set_threads(nthreads);
+}
+
+void bamio::set_block_cache(block_cache* cache) {
+  bgzfio::set_block_cache(cache);
+}
+
+void bamio::set_compression(int level) {
+  bgzfio::set_compression(level);
+}
+
+void bamio::flush(osamstream& stream) {
+  flush_blocks(stream);
+}
+
+uint64_t bamio::tell(isamstream&) {
+  return tell_voffset();
+}
+
+void bamio::seek(isamstream& stream, uint64_t voffset) {
+  region_active = false;
+  seek_voffset(stream, voffset);
+}
+
+int32_t bamio::read_int32(isamstream& stream) {
+  int32_t x;
+  if (read(stream, &x, sizeof x) < sizeof x)
+    throw bad_format("Truncated BAM header");
+
+  convert::set_int32(x);
+  return x;
+}
+
+void bamio::read_refinfo(isamstream& stream, string& name, coord_t& length) {
+  size_t name_length = read_int32(stream);
+
+  // FIXME We can do better than this...
+  // ...but might have to invent better abstraction than read()
+
+  char namebuf[300];
+  if (read(stream, namebuf, name_length) < name_length)
+    throw bad_format("Truncated BAM header (in reference list)");
+
+  name.assign(namebuf, name_length - 1);
+  length = read_int32(stream);
+}
+
+size_t bamio::xsgetn(isamstream& stream, char* buffer, size_t length) {
+  if (header_text_length > 0) {
     size_t n = read(stream, buffer, min(length, header_text_length));
     header_text_length -= n;
     return n;
@@ -688,6 +1266,7 @@ bool bamio::get(isamstream& stream, collection& headers) {
     string name;
     coord_t length;
     int ref_count = read_int32(stream);
+    reference_count = ref_count;
 //std::clog << "# " << ref_count << " binary entries\n";
     for (int index = 0; index < ref_count; index++) {
       read_refinfo(stream, name, length);
@@ -702,6 +1281,7 @@ bool bamio::get(isamstream& stream, collection& headers) {
     string name;
     coord_t length;
     int ref_count = read_int32(stream);
+    reference_count = ref_count;
     for (int index = 0; index < ref_count; index++) {
       read_refinfo(stream, name, length);
       refsequence* refp = new refsequence(name, length, index);
@@ -718,7 +1298,88 @@ bool bamio::get(isamstream& stream, collection& headers) {
   return true;
 }
 
+// Load the index accompanying the stream's file, which is named either
+// FILE.bam.bai or FILE.bai.
+void bamio::load_index(isamstream& stream) {
+  string filename = stream.filename();
+  if (filename.empty())
+    throw sam::exception("Region queries require a BAM file with an index");
+
+  // Look for FILE.bam.bai, FILE.bai, or FILE.bam.csi, in that order.
+  string indexname = filename + ".bai";
+  if (access(indexname.c_str(), F_OK) != 0) {
+    string alternative = filename + ".csi";
+    if (filename.length() > 4 &&
+	filename.compare(filename.length() - 4, 4, ".bam") == 0) {
+      string bai = filename.substr(0, filename.length() - 4) + ".bai";
+      if (access(bai.c_str(), F_OK) == 0)  alternative = bai;
+    }
+
+    if (access(alternative.c_str(), F_OK) == 0)  indexname = alternative;
+  }
+
+  index.load(indexname);
+}
+
+void bamio::seek(isamstream& stream, const seqinterval& region) {
+  if (header_cindex == 0)
+    throw std::logic_error("headers must be read before seeking to a region");
+
+  if (index.empty())  load_index(stream);
+
+  const collection& headers = collection::find(header_cindex);
+  region_rindex = headers.findseq(region.name()).index();
+  region_zstart = region.zstart();
+  region_zlimit = region.zlimit();
+
+  index.find_chunks(chunks, region_rindex, region_zstart, region_zlimit);
+  next_chunk = 0;
+  chunk_end = 0;
+  region_active = true;
+}
+
 bool bamio::get(isamstream& stream, alignment& aln) {
+  return region_active? get_overlapping(stream, aln) : get_record(stream, aln);
+}
+
+bool bamio::get(isamstream& stream, alignment_view& view) {
+  return region_active? get_overlapping(stream, view)
+		      : get_record(stream, view);
+}
+
+// Read records from the chunks listed by the index, skipping those that
+// don't overlap the region requested.
+template <typename AlignmentType>
+bool bamio::get_overlapping(isamstream& stream, AlignmentType& aln) {
+  while (true) {
+    if (tell_voffset() >= chunk_end) {
+      if (next_chunk >= chunks.size())  return false;
+
+      const bam_index::chunk& chunk = chunks[next_chunk++];
+      if (tell_voffset() != chunk.begin)  seek_voffset(stream, chunk.begin);
+      chunk_end = chunk.end;
+    }
+
+    if (! get_record(stream, aln))  return false;
+
+    if (aln.rindex() != region_rindex || aln.zpos() >= region_zlimit) {
+      // As the file is sorted, there will be no further overlapping records.
+      if (aln.rindex() > region_rindex || aln.zpos() >= region_zlimit) {
+	next_chunk = chunks.size();
+	chunk_end = 0;
+	return false;
+      }
+    }
+    else {
+      // Unmapped reads placed here are considered to occupy one base.
+      coord_t span = (aln.flags() & UNMAPPED)? 0 : aln.cigar_span();
+      if (aln.zpos() + std::max(span, coord_t(1)) > region_zstart)
+	return true;
+    }
+  }
+}
+
+bool bamio::get_record(isamstream& stream, alignment& aln) {
   uint32_t rest_length;
 
   size_t n = read(stream, &rest_length, sizeof rest_length);
@@ -739,7 +1400,14 @@ bool bamio::get(isamstream& stream, alignment& aln) {
 	<< "Truncated BAM alignment record (got " << n
 	<< " bytes of an expected remainder of " << rest_length << ")");
 
-  aln.p->h.cindex = header_cindex;
+  convert_core(aln, rest_length, header_cindex);
+  return true;
+}
+
+// Complete an alignment whose BAM data has just been copied into it.
+void bamio::convert_core(alignment& aln, uint32_t rest_length, int cindex) {
+  aln.p->h.cindex = cindex;
+  aln.p->h.span = alignment::unknown_span;
   aln.p->c.rest_length = rest_length;
   convert::set_int32(aln.p->c.rindex);
   convert::set_int32(aln.p->c.zpos);
@@ -750,26 +1418,84 @@ bool bamio::get(isamstream& stream, alignment& aln) {
   convert::set_int32(aln.p->c.mate_rindex);
   convert::set_int32(aln.p->c.mate_zpos);
   convert::set_int32(aln.p->c.isize);
-  return true;
 }
 
-void bamio::flush(osamstream& stream) {
-#if ONE_OF_THESE
-  while (buffer.size() > 0)
-    flush_buffer(stream);
-#else
-  while (buffer.size() > 0)
-    buffer.begin += deflate_onto_cdata(stream, buffer.begin,
-			  min(buffer.size(), BGZF::uncompressed_max_size));
-  buffer.clear();
+/* When the next record lies wholly within  buffer,  VIEW is pointed at it in
+place.  The alignment::block_header that precedes an alignment's BAM data is
+written over the last few bytes of data already consumed, so this is possible
+unless the record is at the very start of  buffer.  Records are not
+necessarily suitably aligned within  buffer,  so a misaligned record is first
+moved down by the few bytes needed (which, unlike copying into an alignment,
+involves no allocation and stays within the same cache lines).  The record
+is used as-is, so this is done only when no byte swapping is needed;
+otherwise it is copied as usual.  */
+bool bamio::get_record(isamstream& stream, alignment_view& view) {
+  view.release();
+
+#ifdef WIRE_NOOP
+  const size_t header_size = sizeof(alignment::block_header);
+  size_t misalignment =
+    reinterpret_cast<uintptr_t>(buffer.begin) % sizeof(int32_t);
+  if (buffer.size() >= sizeof(int32_t) &&
+      buffer.consumed() >= header_size + misalignment) {
+    size_t size = sizeof(int32_t) + convert::uint32(buffer.begin);
+    if (buffer.size() >= size) {
+      alignment::block* block = reinterpret_cast<alignment::block*>(
+			buffer.begin - misalignment - header_size);
+      if (misalignment > 0)  memmove(&block->c, buffer.begin, size);
+      block->h.capacity = 0;
+      block->h.cindex = header_cindex;
+      block->h.span = alignment::unknown_span;
+      buffer.begin += size;
+
+      view.borrowed.p = block;
+      view.aln = &view.borrowed;
+      return true;
+    }
+  }
 #endif
 
-  while (cdata.size() > 0)
-    cdata.begin += stream.rdbuf()->sputn(cdata.begin, cdata.size());
-  cdata.clear();
+  view.aln = &view.copy;
+  return get_record(stream, view.copy);
+}
+
+void bamio::close(osamstream& stream) {
+  flush(stream);
+
+  if (indexing) {
+    indexing = false;
+    block_offsets.add(uncompressed_offset, compressed_offset);
+    index.finish(block_offsets);
+    block_offsets.clear();
+    index.save(index_filename);
+  }
+}
+
+void bamio::build_index(osamstream& stream, const string& filename) {
+  if (uncompressed_offset > 0 || buffer.size() > 0)
+    throw std::logic_error("build_index() used after writing has begun");
+
+  if (filename.empty() && stream.filename().empty())
+    throw sam::exception("No filename given for the index");
+
+  indexing = true;
+  index_filename = filename;
 }
 
 void bamio::put(osamstream& stream, const collection& coln) {
+  // Start the index when the first set of headers is written.  Subsequent
+  // sets of headers are ignored, as they are assumed to be equivalent.
+  if (indexing && index.empty()) {
+    std::vector<coord_t> lengths;
+    for (collection::const_ref_iterator it = coln.ref_begin();
+	 it != coln.ref_end(); ++it)
+      lengths.push_back(it->length());
+
+    index.start(lengths);
+    if (index_filename.empty())
+      index_filename = stream.filename() + (index.is_csi()? ".csi" : ".bai");
+  }
+
   int header_length = 0;
   for (collection::const_iterator it = coln.begin(); it != coln.end(); ++it)
     header_length += it->sam_length() + 1;
@@ -785,8 +1511,8 @@ void bamio::put(osamstream& stream, const collection& coln) {
     buffer.end = format_sam(buffer.end, *it);
     *buffer.end++ = '\n';
 
-    while (buffer.size() >= BGZF::uncompressed_max_size)
-      flush_buffer(stream);
+    while (buffer.size() >= BGZF::uncompressed_block_size)
+      flush_buffer(stream, BGZF::uncompressed_block_size);
   }
 
   // Because  buffer  has a capacity that exceeds the BGZF uncompressed block
@@ -810,14 +1536,22 @@ void bamio::put(osamstream& stream, const collection& coln) {
     convert::set_bam_int32(buffer.end, it->length());
     buffer.end += sizeof(int32_t);
 
-    while (buffer.size() >= BGZF::uncompressed_max_size)
-      flush_buffer(stream);
+    while (buffer.size() >= BGZF::uncompressed_block_size)
+      flush_buffer(stream, BGZF::uncompressed_block_size);
   }
 }
 
 void bamio::put(osamstream& stream, const alignment& aln) {
   aln.sync();
 
+  if (indexing) {
+    uint64_t begin = uncompressed_offset + buffer.size();
+    bool mapped = ! (aln.flags() & UNMAPPED);
+    coord_t zlimit = aln.zpos() + (mapped? aln.cigar_span() : 0);
+    index.add(aln.rindex(), aln.zpos(), zlimit, mapped,
+	      begin, begin + aln.p->size());
+  }
+
   int length = min(aln.p->size(), buffer.available());
   memcpy(buffer.end, aln.p->data(), length);
 
@@ -839,14 +1573,8 @@ void bamio::put(osamstream& stream, const alignment& aln) {
   // Ensure that the whole alignment record has been copied -- if it has
   // not, it must be because the buffer has been filled.
   int copied = length;
-  while (buffer.size() >= BGZF::uncompressed_max_size) {
-#if ONE_OF_THESE
-    flush_buffer(stream);
-#else
-    buffer.begin += deflate_onto_cdata(stream, buffer.begin,
-				       BGZF::uncompressed_max_size);
-    buffer.flush();
-#endif
+  while (buffer.size() >= BGZF::uncompressed_block_size) {
+    flush_buffer(stream, BGZF::uncompressed_block_size);
 
     if (copied < aln.p->size()) {
       length = min(aln.p->size() - copied, buffer.available());
@@ -858,6 +1586,271 @@ void bamio::put(osamstream& stream, const alignment& aln) {
 }
 
 
+/* Parallel scanning of BAM files in memory.  The compressed data is divided
+at BGZF block boundaries, located by looking for plausible block headers,
+into parts that are processed by separate scan_task objects.  Each task
+decompresses its blocks (and as many following blocks as are needed to
+complete its last record) and processes the records that start within them.
+
+Except in the first part, where the records continue from the current
+position, the start of the first such record is unknown.  It is found by
+looking for a position at which several consecutive plausible records begin.
+Each task notes where the records following its own part begin, relative to
+the start of the next part's blocks, so scan() can verify that the parts'
+records adjoin exactly.  */
+
+namespace {
+
+// Returns whether a BGZF block appears to begin at DATA[POS], judging by its
+// header and that of the following block (or its ending exactly at EOF).
+bool block_starts_at(const char* data, size_t size, size_t pos) {
+  if (! BGZF::is_bgzf_header(&data[pos], min(size - pos, BGZF::hsize)))
+    return false;
+
+  size_t next = pos + BGZF::block_size(&data[pos]);
+  if (next < pos + BGZF::hsize + BGZF::tsize || next > size)  return false;
+  return next == size ||
+	 BGZF::is_bgzf_header(&data[next], min(size - next, BGZF::hsize));
+}
+
+} // anonymous namespace
+
+class bamio::scan_task : public thread_pool::task {
+public:
+  scan_task(const char* data, size_t data_size, size_t begin, size_t end)
+    : start(0), finish(0), format_error(false), data(data),
+      data_size(data_size), next_block(begin), end_block(end),
+      text(2 * BGZF::uncompressed_max_size), text_offset(0),
+      own_size(end_unknown) { }
+
+  virtual void run();
+
+  // Where to start: the first record's offset within the part's first block,
+  // or resynchronise if negative.
+  long skip;
+
+  alignment_handler* handler;
+  int part;
+  int cindex;
+  int reference_count;
+
+  // The offset of the part's first record from the start of its blocks'
+  // uncompressed data, and of the first record following the part from the
+  // start of the next part's data.
+  size_t start, finish;
+
+  string error;
+  bool format_error;
+
+private:
+  enum { end_unknown = ~size_t(0) };
+
+  bool ensure(size_t length);
+  bool resynchronise();
+  bool plausible_record(size_t offset, size_t& size);
+
+  const char* data;  // The whole of the BAM file's compressed data
+  size_t data_size;
+  size_t next_block, end_block;
+  block_inflater inflater;
+
+  // Decompressed data, beginning at  text_offset  within this part's data,
+  // which totals  own_size  once all of the part's blocks have been read.
+  char_buffer text;
+  size_t text_offset;
+  size_t own_size;
+};
+
+// Decompress further blocks until at least LENGTH bytes are available at
+// text.begin.  Returns false if EOF is reached first.
+bool bamio::scan_task::ensure(size_t length) {
+  while (text.size() < length) {
+    if (next_block >= data_size)  return false;
+
+    if (! block_starts_at(data, data_size, next_block))
+      throw bad_format("Invalid BGZF block header");
+
+    size_t size = BGZF::block_size(&data[next_block]);
+    text.make_available(BGZF::uncompressed_max_size);
+    text.end += inflater.inflate(text.end, text.available(),
+				 &data[next_block], size);
+    next_block += size;
+
+    if (next_block == end_block)
+      own_size = text_offset + text.size();
+  }
+
+  return true;
+}
+
+// Returns whether a plausible BAM record begins at OFFSET bytes beyond
+// text.begin, and if so, sets SIZE to its total size.
+bool bamio::scan_task::plausible_record(size_t offset, size_t& size) {
+  const size_t core_size = 4 + 32;
+  if (! ensure(offset + core_size))  return false;
+
+  const char* s = &text.begin[offset];
+  uint32_t rest_length = convert::uint32(s);
+  int32_t rindex = convert::int32(&s[4]);
+  int32_t zpos = convert::int32(&s[8]);
+  int name_length = static_cast<unsigned char>(s[12]);
+  int cigar_length = convert::uint16(&s[16]);
+  int32_t read_length = convert::int32(&s[20]);
+  int32_t mate_rindex = convert::int32(&s[24]);
+  int32_t mate_zpos = convert::int32(&s[28]);
+
+  if (rest_length < 32 || rest_length > (1 << 28))  return false;
+  if (rindex < -1 || rindex >= reference_count)  return false;
+  if (mate_rindex < -1 || mate_rindex >= reference_count)  return false;
+  if (zpos < -1 || mate_zpos < -1)  return false;
+  if (name_length < 1 || read_length < 0 || read_length > (1 << 28))
+    return false;
+
+  size_t fixed_size = 32 + name_length + 4 * cigar_length +
+		      (read_length + 1) / 2 + read_length;
+  if (fixed_size > rest_length)  return false;
+
+  size = 4 + rest_length;
+  if (! ensure(offset + size))  return false;
+
+  // The read name must be printable and NUL-terminated, and the CIGAR
+  // operations must be valid.
+  s = &text.begin[offset];
+  const char* name = &s[core_size];
+  for (int i = 0; i < name_length - 1; i++)
+    if (name[i] < '!' || name[i] > '~')  return false;
+  if (name[name_length - 1] != '\0')  return false;
+
+  const char* cigar = &name[name_length];
+  for (int i = 0; i < cigar_length; i++)
+    if ((convert::uint32(&cigar[4 * i]) & 0xf) > 8)  return false;
+
+  return true;
+}
+
+// Advance text.begin to the first position from which several consecutive
+// plausible records follow (or run exactly to EOF).  Returns false if there
+// is no such position.
+bool bamio::scan_task::resynchronise() {
+  const int nrecords = 4;
+
+  while (ensure(1)) {
+    size_t offset = 0, size;
+    int n;
+    for (n = 0; n < nrecords && plausible_record(offset, size); n++)
+      offset += size;
+
+    if (n == nrecords || (n > 0 && ! ensure(offset + 1)))
+      return true;
+
+    text.begin++;
+    text_offset++;
+  }
+
+  return false;
+}
+
+void bamio::scan_task::run() {
+  try {
+    if (skip >= 0) {
+      if (! ensure(skip))  throw bad_format("Invalid BGZF virtual offset");
+      text.begin += skip;
+      text_offset += skip;
+    }
+    else
+      resynchronise();
+
+    start = text_offset;
+
+    alignment aln;
+    while (ensure(4) && text_offset < own_size) {
+      uint32_t rest_length = convert::uint32(text.begin);
+      size_t size = 4 + rest_length;
+      if (! ensure(size))  throw bad_format("Truncated BAM alignment record");
+
+      if (aln.p->capacity() < int(size))  aln.resize_unshare_discard(size);
+      memcpy(&aln.p->c.rindex, &text.begin[4], rest_length);
+      convert_core(aln, rest_length, cindex);
+      text.begin += size;
+      text_offset += size;
+
+      handler->process(aln, part);
+    }
+
+    if (text.size() > 0 && text_offset < own_size)
+      throw bad_format("Truncated BAM alignment record");
+
+    // At EOF,  own_size  is known as all blocks have been read.
+    finish = text_offset - own_size;
+  }
+  catch (const bad_format& e) { error = e.what(); format_error = true; }
+  catch (const std::exception& e) { error = e.what(); }
+  catch (...) { error = "Unknown exception while scanning"; }
+}
+
+void bamio::scan(isamstream& stream, alignment_handler& handler, int nparts) {
+  membuf* mem = dynamic_cast<membuf*>(stream.rdbuf());
+  if (nparts <= 1 || region_active || ! mem) {
+    sambamio::scan(stream, handler, nparts);
+    return;
+  }
+
+  uint64_t voffset = tell_voffset();
+  const char* data = mem->data();
+  size_t size = mem->size();
+
+  // Divide the remaining data into parts at block boundaries.
+  std::vector<size_t> bounds;
+  bounds.push_back(voffset >> 16);
+  for (int i = 1; i < nparts; i++) {
+    size_t pos = bounds[0] + (uint64_t(size) - bounds[0]) * i / nparts;
+    if (pos <= bounds.back())  continue;
+
+    while (pos < size && ! block_starts_at(data, size, pos))  pos++;
+    if (pos < size)  bounds.push_back(pos);
+  }
+  bounds.push_back(size);
+
+  int ntasks = bounds.size() - 1;
+  std::vector<scan_task*> tasks;
+  string error;
+  bool format_error = false;
+
+  {
+    thread_pool pool(ntasks);
+    for (int i = 0; i < ntasks; i++) {
+      scan_task* task = new scan_task(data, size, bounds[i], bounds[i+1]);
+      task->skip = (i == 0)? long(voffset & 0xffff) : -1;
+      task->handler = &handler;
+      task->part = i;
+      task->cindex = header_cindex;
+      task->reference_count = reference_count;
+      tasks.push_back(task);
+      pool.submit(task);
+    }
+
+    for (int i = 0; i < ntasks; i++) {
+      pool.wait(tasks[i]);
+      if (error.empty() && ! tasks[i]->error.empty())
+	error = tasks[i]->error, format_error = tasks[i]->format_error;
+      else if (error.empty() && i > 0 &&
+	       tasks[i]->start != tasks[i-1]->finish)
+	error = "Unable to locate BAM records at BGZF block boundary",
+	format_error = true;
+    }
+  }
+
+  for (int i = 0; i < ntasks; i++)  delete tasks[i];
+
+  if (format_error)  throw bad_format(error);
+  else if (! error.empty())  throw sam::exception(error);
+
+  // All the records have been read, so leave the stream at EOF.
+  seek_voffset(stream, uint64_t(size) << 16);
+  try { stream.setstate(std::ios::eofbit); }
+  catch (...) { throw eof_exception(); }
+}
+
 // Text SAM files
 // ==============
 
@@ -873,28 +1866,184 @@ public:
   virtual void put(osamstream&, const alignment&);
   virtual void flush(osamstream&);
 
+  virtual void set_threads(int nthreads);
+
+  using sambamio::seek;
+  virtual uint64_t tell(isamstream&);
+  virtual void seek(isamstream&, uint64_t);
+
 protected:
   virtual size_t xsgetn(isamstream&, char*, size_t);
 
+  // Write LENGTH bytes at DATA to the stream; used by write_buffer().
+  virtual void xsputn(osamstream&, const char*, size_t);
+
 private:
+  class parse_job;
+
+  void write_buffer(osamstream&);
+
+  bool get_parsed(isamstream&, alignment&);
+  void queue_chunks(isamstream&);
+  parse_job* front_job();
+  void discard_pending();
+
   char_buffer buffer;
+  uint64_t buffer_end_offset;  // Position within the file of  buffer.end
   std::vector<char*> fields;
   bool reflist_open;
+
+  // When worker threads have been requested, the text is read ahead in
+  // chunks of complete lines, which are queued for parsing by the pool.
+  // Jobs are consumed in order from the front of  pending,  and finished
+  // jobs are recycled via  idle.  Any partial line following the last chunk
+  // remains in  buffer.  The pool is started by the first get(alignment&).
+  int nthreads;
+  thread_pool* pool;
+  std::deque<parse_job*> pending;
+  std::vector<parse_job*> idle;
+  size_t max_pending;
+  bool readahead_failed;
+};
+
+// A chunk of complete lines read ahead and awaiting parsing into alignments.
+// Chunks are kept small enough that the text and the alignments parsed from
+// it are likely to still be in cache when they are delivered.
+class samio::parse_job : public thread_pool::task {
+public:
+  enum { chunk_size = 128 * 1024 };
+
+  parse_job() : text(chunk_size + 1) { }
+
+  virtual void run();
+
+  // The lines, each terminated by a newline, and their position in the file.
+  char_buffer text;
+  uint64_t offset;
+
+  // The headers to be used (looked up by the reading thread, so that workers
+  // do not consult the collection registry), and their cindex.
+  const collection* headers;
+  int cindex;
+
+  // Each line's alignment and starting position within  text,  and the
+  // failures encountered for any lines that could not be parsed.
+  struct failure {
+    failure(size_t line, const string& message, bool format_error)
+      : line(line), message(message), format_error(format_error) { }
+    size_t line;
+    string message;
+    bool format_error;
+  };
+
+  std::deque<alignment> alignments;
+  std::vector<size_t> line_starts;
+  std::vector<failure> failures;
+  size_t nlines;
+
+  // Used by the reading thread: whether the job has been waited for, and the
+  // next line and failure to be delivered.
+  bool ready;
+  size_t next_line, next_failure;
+
+private:
+  std::vector<char*> fields;
 };
 
-samio::samio() : buffer(32768), reflist_open(false) {
+void samio::parse_job::run() {
+  nlines = 0;
+  failures.clear();
+
+  char* s = text.begin;
+  while (s < text.end) {
+    char* line = s;
+    fields.clear();
+    fields.push_back(s);
+
+    // As in getline(), but every line is known to be newline-terminated.
+    while (true) {
+      s = split_tabs(s, text.end, fields);
+
+      if (*s == '\t') {
+	*s++ = '\0';
+	fields.push_back(s);
+      }
+      else if (*s == '\n') {
+	if (s > line && s[-1] == '\r')  s[-1] = '\0', fields.push_back(s++);
+	else  *s++ = '\0', fields.push_back(s);
+	break;
+      }
+      else
+	s++;
+    }
+
+    if (nlines == alignments.size())  alignments.push_back(alignment());
+    if (nlines == line_starts.size())  line_starts.push_back(0);
+    line_starts[nlines] = line - text.begin;
+
+    try {
+      alignments[nlines].assign(fields.size() - 1, fields, cindex, *headers);
+    }
+    catch (const bad_format& e) {
+      failures.push_back(failure(nlines, e.what(), true));
+    }
+    catch (const std::exception& e) {
+      failures.push_back(failure(nlines, e.what(), false));
+    }
+    catch (...) {
+      failures.push_back(failure(nlines, "Unknown exception while parsing",
+				 false));
+    }
+
+    nlines++;
+  }
+}
+
+samio::samio()
+  : buffer(32768), buffer_end_offset(0), reflist_open(false),
+    nthreads(0), pool(NULL), max_pending(0), readahead_failed(false) {
 }
 
 samio::samio(const char* text, std::streamsize textsize)
-  : buffer(32768), reflist_open(false) {
+  : buffer(32768), buffer_end_offset(textsize), reflist_open(false),
+    nthreads(0), pool(NULL), max_pending(0), readahead_failed(false) {
   prepare_line_buffer(buffer, text, textsize);
 }
 
 samio::~samio() {
+  discard_pending();
+  delete pool;
+
+  for (std::vector<parse_job*>::iterator it = idle.begin();
+       it != idle.end(); ++it)
+    delete *it;
 }
 
 size_t samio::xsgetn(isamstream& stream, char* buffer, size_t length) {
-  return rdbuf_sgetn(stream, buffer, length);
+  size_t n = rdbuf_sgetn(stream, buffer, length);
+  buffer_end_offset += n;
+  return n;
+}
+
+uint64_t samio::tell(isamstream&) {
+  parse_job* job = front_job();
+  if (job)  return job->offset + job->line_starts[job->next_line];
+
+  return buffer_end_offset - buffer.size();
+}
+
+void samio::seek(isamstream& stream, uint64_t offset) {
+  discard_pending();
+
+  std::streampos pos = stream.rdbuf()->pubseekpos(offset, std::ios::in);
+  if (pos != std::streampos(offset))
+    throw sam::exception("SAM stream is not seekable");
+
+  stream.clear(stream.rdstate() & ~std::ios::eofbit);
+
+  buffer.clear();
+  prepare_line_buffer(buffer);
+  buffer_end_offset = offset;
 }
 
 bool samio::get(isamstream& stream, collection& headers) {
@@ -916,6 +2065,11 @@ bool samio::get(isamstream& stream, collection& headers) {
 }
 
 bool samio::get(isamstream& stream, alignment& aln) {
+  if (nthreads > 0 || ! pending.empty()) {
+    if (get_parsed(stream, aln))  return true;
+    else if (nthreads > 0)  return false;
+  }
+
   int nfields = getline(buffer, stream, fields);
   if (nfields <= 0)
     return false;
@@ -926,20 +2080,194 @@ bool samio::get(isamstream& stream, alignment& aln) {
   return true;
 }
 
-void samio::flush(osamstream& stream) {
-  while (buffer.size() > 0)
-    buffer.begin += stream.rdbuf()->sputn(buffer.begin, buffer.size());
+/* Delivers the next alignment parsed by the worker threads, in the order in
+which the lines appeared, by exchanging it with ALN.  A line that could not be
+parsed produces its exception in its turn, just as reading serially would.
+Returns false when no further lines are forthcoming (or, if worker threads are
+no longer in use, when those already read ahead have all been delivered).  */
+bool samio::get_parsed(isamstream& stream, alignment& aln) {
+  if (nthreads > 0) {
+    if (! pool)  pool = new thread_pool(nthreads);
+    queue_chunks(stream);
+  }
+
+  parse_job* job = front_job();
+  if (! job)  return false;
 
+  size_t line = job->next_line++;
+  if (job->next_failure < job->failures.size() &&
+      job->failures[job->next_failure].line == line) {
+    const parse_job::failure& f = job->failures[job->next_failure++];
+    if (f.format_error)  throw bad_format(f.message);
+    else  throw sam::exception(f.message);
+  }
+
+  aln.swap(job->alignments[line]);
+  return true;
+}
+
+// Returns the first pending job with lines yet to be delivered, having waited
+// for it to be parsed, or NULL if there is none.  Exhausted jobs are recycled,
+// and further chunks are read ahead to replace them.
+samio::parse_job* samio::front_job() {
+  while (! pending.empty()) {
+    parse_job* job = pending.front();
+    if (! job->ready) {
+      if (pool)  pool->wait(job);
+      job->ready = true;
+    }
+
+    if (job->next_line < job->nlines)  return job;
+
+    pending.pop_front();
+    idle.push_back(job);
+  }
+
+  return NULL;
+}
+
+namespace {
+
+// Returns a pointer to the last newline among the N characters at S, or NULL.
+char* last_newline(char* s, size_t n) {
+  for (char* p = s + n; p > s; )
+    if (*--p == '\n')  return p;
+
+  return NULL;
+}
+
+} // unnamed namespace
+
+/* Read ahead, queueing chunks of complete lines for parsing by the thread pool
+until there are  max_pending  of them outstanding.  Each chunk begins with the
+partial line left in  buffer  by its predecessor, and is read until it is full
+and contains at least one complete line; a final unterminated line is given a
+newline.  If reading fails, the data read so far is returned to  buffer,  and
+the failure is reported (by reading again) once the chunks preceding it have
+been used.  */
+void samio::queue_chunks(isamstream& stream) {
+  if (readahead_failed) {
+    if (! pending.empty())  return;
+    readahead_failed = false;
+  }
+
+  while (pending.size() < max_pending) {
+    parse_job* job;
+    if (idle.empty())  job = new parse_job;
+    else  job = idle.back(), idle.pop_back();
+
+    char_buffer& text = job->text;
+    text.clear();
+    text.append(buffer.begin, buffer.size());
+    job->offset = buffer_end_offset - buffer.size();
+    buffer.clear();
+
+    char* eol = last_newline(text.begin, text.size());
+    size_t complete = eol? eol + 1 - text.begin : 0;
+    bool eof = false;
+    try {
+      while (true) {
+	if (text.available() <= 1) {
+	  if (complete > 0)  break;
+	  text.make_available(parse_job::chunk_size);  // Only a partial line
+	}
+
+	size_t n = xsgetn(stream, text.end, text.available() - 1);
+	if (n == 0) { eof = true; break; }
+
+	eol = last_newline(text.end, n);
+	text.end += n;
+	if (eol)  complete = eol + 1 - text.begin;
+      }
+    }
+    catch (...) {
+      buffer.make_available(text.size() + 1);
+      prepare_line_buffer(buffer, text.begin, text.size());
+      idle.push_back(job);
+      if (pending.empty())  throw;
+      readahead_failed = true;
+      return;
+    }
+
+    if (eof) {
+      if (text.size() > 0 && text.end[-1] != '\n')  *text.end++ = '\n';
+      complete = text.size();
+    }
+
+    // Any partial line following the complete lines is left in  buffer.
+    size_t partial = text.size() - complete;
+    buffer.make_available(partial + 1);
+    prepare_line_buffer(buffer, &text.begin[complete], partial);
+    text.end = &text.begin[complete];
+
+    if (text.size() == 0) {
+      idle.push_back(job);
+      break;
+    }
+
+    job->headers = &collection::find(header_cindex);
+    job->cindex = header_cindex;
+    job->nlines = 0;
+    job->ready = false;
+    job->next_line = job->next_failure = 0;
+    pending.push_back(job);
+    pool->submit(job);
+  }
+}
+
+// Withdraw any read-ahead chunks, which are no longer wanted.
+void samio::discard_pending() {
+  for (std::deque<parse_job*>::iterator it = pending.begin();
+       it != pending.end(); ++it) {
+    if (pool)  pool->cancel(*it);
+    idle.push_back(*it);
+  }
+
+  pending.clear();
+  readahead_failed = false;
+}
+
+// Parse alignment records using a pool of NTHREADS worker threads, or on the
+// calling thread if NTHREADS is 0.
+void samio::set_threads(int n) {
+  if (pool) {
+    // Outstanding jobs' results are still needed, so let them finish.
+    for (std::deque<parse_job*>::iterator it = pending.begin();
+	 it != pending.end(); ++it)
+      if (! (*it)->ready)  pool->wait(*it), (*it)->ready = true;
+
+    delete pool;
+    pool = NULL;
+  }
+
+  nthreads = n;
+  max_pending = 4 * n;
+}
+
+void samio::xsputn(osamstream& stream, const char* data, size_t length) {
+  while (length > 0) {
+    std::streamsize n = stream.rdbuf()->sputn(data, length);
+    data += n;
+    length -= n;
+  }
+}
+
+void samio::write_buffer(osamstream& stream) {
+  if (buffer.size() > 0)  xsputn(stream, buffer.begin, buffer.size());
   buffer.clear();
 }
 
+void samio::flush(osamstream& stream) {
+  write_buffer(stream);
+}
+
 void samio::put(osamstream& stream, const collection& headers) {
   for (collection::const_iterator it = headers.begin();
        it != headers.end(); ++it) {
     // FIXME Don't cons up a string
     string text = it->str();
     if (text.length() + 1 > buffer.available()) {
-      flush(stream);
+      write_buffer(stream);
       buffer.reserve(text.length() + 1);
     }
 
@@ -955,7 +2283,7 @@ void samio::put(osamstream& stream, const alignment& aln) {
 
   size_t approx_length = aln.sam_length() + 1;
   if (approx_length > buffer.available()) {
-    flush(stream);
+    write_buffer(stream);
     buffer.reserve(approx_length);
   }
 
@@ -967,40 +2295,182 @@ void samio::put(osamstream& stream, const alignment& aln) {
 // Gzipped SAM files
 // =================
 
-class gzsamio : public samio {
+/* SAM files compressed either as BGZF, whose blocks are read and written via
+bgzfio (and so can be decompressed and compressed in parallel), or as ordinary
+gzip files, which may consist of several concatenated gzip members and are
+decompressed as a single zlib stream.  Output is always BGZF-compressed, so
+that the resulting files can be indexed.  */
+class gzsamio : public samio, private bgzfio {
 public:
   gzsamio(const char* text, std::streamsize textsize);
+  gzsamio();
   virtual ~gzsamio();
 
+  virtual void flush(osamstream&);
+  virtual void set_threads(int nthreads);
+  virtual void set_block_cache(block_cache* cache);
+  virtual void set_compression(int level);
+
+  using samio::seek;
+  virtual uint64_t tell(isamstream&);
+  virtual void seek(isamstream&, uint64_t);
+
 protected:
   virtual size_t xsgetn(isamstream&, char*, size_t);
+  virtual void xsputn(osamstream&, const char*, size_t);
+
+private:
+  size_t inflate_gzip(isamstream&, char*, size_t);
+
+  bool bgzf;  // Whether the stream is BGZF rather than ordinary gzip
+  z_stream z;
+  bool in_member;
 };
 
-gzsamio::gzsamio(const char*, std::streamsize) {
-  throw std::logic_error("gzsamio not implemented");
+// Constructor used when reading a compressed SAM stream.
+gzsamio::gzsamio(const char* text, std::streamsize textsize)
+  : samio(NULL, 0), bgzfio(text, textsize),
+    bgzf(BGZF::is_bgzf_header(text, textsize)), in_member(false) {
+  if (! bgzf) {
+    z.zalloc = Z_NULL;
+    z.zfree  = Z_NULL;
+    z.next_in = Z_NULL;
+    z.avail_in = 0;
+    if (inflateInit2(&z, 15 + 16) != Z_OK)  // Expect gzip headers
+      throw std::logic_error(zlib_message("inflateInit2", z));
+  }
+}
+
+// Constructor used when writing a compressed SAM stream.
+gzsamio::gzsamio()
+  : samio(), bgzfio(Z_DEFAULT_COMPRESSION, BGZF::uncompressed_max_size),
+    bgzf(true), in_member(false) {
 }
 
 gzsamio::~gzsamio() {
+  if (! bgzf)  inflateEnd(&z);
+}
+
+void gzsamio::flush(osamstream& stream) {
+  samio::flush(stream);
+  flush_blocks(stream);
+}
+
+void gzsamio::set_threads(int nthreads) {
+  if (bgzf)  bgzfio::set_threads(nthreads);
+  samio::set_threads(nthreads);
 }
 
-size_t gzsamio::xsgetn(isamstream&, char*, size_t) {
-  // TODO Read from rdbuf() and decompress
-  throw std::logic_error("gzsamio::xsgetn() not implemented");
+void gzsamio::set_block_cache(block_cache* cache) {
+  if (bgzf)  bgzfio::set_block_cache(cache);
+}
+
+void gzsamio::set_compression(int level) {
+  if (bgzf)  bgzfio::set_compression(level);
+}
+
+uint64_t gzsamio::tell(isamstream& stream) {
+  return sambamio::tell(stream);
+}
+
+void gzsamio::seek(isamstream& stream, uint64_t offset) {
+  sambamio::seek(stream, offset);
+}
+
+size_t gzsamio::xsgetn(isamstream& stream, char* dest, size_t length) {
+  return bgzf? read(stream, dest, length) : inflate_gzip(stream, dest, length);
+}
+
+void gzsamio::xsputn(osamstream& stream, const char* data, size_t length) {
+  write(stream, data, length);
+}
+
+// Decompress up to LENGTH bytes into DEST, continuing into subsequent gzip
+// members as each one ends.  Returns 0 only when cleanly at EOF.
+size_t gzsamio::inflate_gzip(isamstream& stream, char* dest, size_t length) {
+  z.next_out  = reinterpret_cast<unsigned char*>(dest);
+  z.avail_out = length;
+
+  // When reading from memory, compressed data is used in place.
+  membuf* mapped = dynamic_cast<membuf*>(stream.rdbuf());
+
+  while (z.avail_out > 0) {
+    const char* data = cdata.begin;
+    std::streamsize data_length = cdata.size();
+
+    if (data_length == 0 && mapped)  data = mapped->unread(data_length);
+
+    if (data_length == 0) {
+      fill_cdata(stream, 1);
+      if (cdata.size() == 0) {
+	if (in_member)  throw bad_format("Truncated gzip member");
+	break;
+      }
+
+      data = cdata.begin;
+      data_length = cdata.size();
+    }
+
+    if (! in_member) {
+      if (inflateReset(&z) != Z_OK)
+	throw std::logic_error(zlib_message("inflateReset", z));
+      in_member = true;
+    }
+
+    z.next_in  = reinterpret_cast<unsigned char*>(const_cast<char*>(data));
+    z.avail_in = std::min(data_length, std::streamsize(1 << 30));
+
+    int status = ::inflate(&z, Z_NO_FLUSH);
+    size_t used = reinterpret_cast<char*>(z.next_in) - data;
+    if (data == cdata.begin)  cdata.begin += used;
+    else  mapped->skip(used);
+
+    if (status == Z_STREAM_END)  in_member = false;
+    else if (status != Z_OK)  throw bad_format(zlib_message("inflate", z));
+  }
+
+  return length - z.avail_out;
 }
 
 // *** virtual new
 
+// Returns whether the BGZF block at TEXT, of which LENGTH bytes are available,
+// contains the start of a BAM file.  Blocks that are truncated or otherwise
+// invalid are assumed to be BAM, so that bamio reports the problem.
+static bool is_bam_block(const char* text, size_t length) {
+  size_t size = BGZF::block_size(text);
+  if (length < size || size < BGZF::hsize + BGZF::tsize)  return true;
+
+  char data[BGZF::uncompressed_max_size];
+  size_t data_length;
+  try {
+    block_inflater inflater;
+    data_length = inflater.inflate(data, sizeof data, text, size);
+  }
+  catch (const std::exception&) { return true; }
+
+  return data_length >= 4 && memcmp(data, "BAM\1", 4) == 0;
+}
+
 // Construct a new concrete sambamio by reading the first few bytes
 // from the stream to determine what type of file it is.
 sambamio* sambamio::new_in(isamstream& stream) {
-  char buffer[BGZF::hsize];
+  char buffer[BGZF::full_block_size];
 
   std::streamsize n = 0;
   while (n < BGZF::hsize && ! stream.eof())
-    n += rdbuf_sgetn(stream, buffer + n, sizeof buffer - n);
+    n += rdbuf_sgetn(stream, buffer + n, BGZF::hsize - n);
 
-  if (BGZF::is_bgzf_header(buffer, n))
-    return new bamio(buffer, n);
+  if (BGZF::is_bgzf_header(buffer, n)) {
+    // Both BAM and BGZF-compressed SAM files start with a BGZF block,
+    // so read the whole of the first block and look inside it.
+    std::streamsize size = BGZF::block_size(buffer);
+    while (n < size && ! stream.eof())
+      n += rdbuf_sgetn(stream, buffer + n, size - n);
+
+    if (is_bam_block(buffer, n))  return new bamio(buffer, n);
+    else  return new gzsamio(buffer, n);
+  }
   else if (BGZF::is_gzip_header(buffer, n))
     return new gzsamio(buffer, n);
   else if (CRAM::is_cram_file_definition(buffer, n))
@@ -1014,7 +2484,7 @@ sambamio* sambamio::new_out(std::ios::openmode mode) {
   if (mode & std::ios::binary)
     return new bamio(mode & compressed);
   else if (mode & compressed)
-    return new gzsamio(NULL, 0);
+    return new gzsamio();
   else
     return new samio();
 }
@@ -1,6 +1,6 @@
 /*  sambamio.h -- SAM/BAM input/output formatting.
 
-    Copyright (C) 2010, 2012, 2014, 2018 Genome Research Ltd.
+    Copyright (C) 2010, 2012, 2014, 2018, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -31,15 +31,23 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 #define SAMBAMIO_H
 
 #include <streambuf>
+#include <string>
 #include <vector>
 
+#include <stdint.h>
+
 #include "cansam/sam/stream.h"
 
 namespace sam {
 
 class alignment;
+class alignment_handler;
+class alignment_view;
+class bgzfio;
+class block_cache;
 class char_buffer;
 class collection;
+class seqinterval;
 
 class sambamio {
 public:
@@ -56,10 +64,43 @@ public:
   // false at EOF, or throws an exception on formatting or I/O errors.
   virtual bool get(isamstream&, alignment&) = 0;
 
+  // As above, but leaving the view referring to the record in place within
+  // this object's buffers if possible.  By default, the record is copied.
+  virtual bool get(isamstream&, alignment_view&);
+
   virtual void put(osamstream&, const collection&) = 0;
   virtual void put(osamstream&, const alignment&) = 0;
   virtual void flush(osamstream&) = 0;
 
+  // Flush any uncommitted output, and complete any associated files.
+  virtual void close(osamstream& stream) { flush(stream); }
+
+  // Use NTHREADS worker threads (or none) for compression or decompression.
+  virtual void set_threads(int /*nthreads*/) { }
+
+  // Consult and populate CACHE (or none) when decompressing blocks.
+  virtual void set_block_cache(block_cache* /*cache*/) { }
+
+  // Compress at LEVEL, or adaptively (see osamstream::set_compression()).
+  virtual void set_compression(int /*level*/) { }
+
+  // Pass all remaining alignment records to HANDLER, dividing them into up
+  // to NPARTS parts to be processed in parallel if possible.  By default,
+  // they are read in turn via get() and all belong to part 0.
+  virtual void scan(isamstream&, alignment_handler& handler, int nparts);
+
+  // Restrict subsequent get(alignment&) calls to records overlapping REGION.
+  virtual void seek(isamstream&, const seqinterval& region);
+
+  // Return the position of the next record, in a form usable by seek().
+  virtual uint64_t tell(isamstream&);
+
+  // Reposition the stream to OFFSET, as previously returned by tell().
+  virtual void seek(isamstream&, uint64_t offset);
+
+  // Build an index while writing, to be saved as FILENAME by close().
+  virtual void build_index(osamstream&, const std::string& filename);
+
 protected:
   sambamio() : header_cindex(0) { }
 
@@ -85,6 +126,7 @@ protected:
 
   int peek(char_buffer&, isamstream&);
   int getline(char_buffer&, isamstream&, std::vector<char*>&);
+  int getline_spanning(char_buffer&, isamstream&, std::vector<char*>&);
 
   // For use by peek() & getline().
   virtual size_t xsgetn(isamstream&, char*, size_t) = 0;
@@ -94,6 +136,9 @@ protected:
 
   // Cached copy of the header's cindex, for use by get(alignment&).
   int header_cindex;
+
+private:
+  friend class bgzfio;  // For rdbuf_sgetn()
 };
 
 // Bitmask flags for use with the private collection::push_back().
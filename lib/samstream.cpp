@@ -1,6 +1,6 @@
 /*  samstream.cpp -- Classes for SAM/BAM input/output streams.
 
-    Copyright (C) 2010-2012, 2018 Genome Research Ltd.
+    Copyright (C) 2010-2012, 2018, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -67,9 +67,19 @@ public:
 
   virtual bool get(isamstream&, collection&) { throw error; }
   virtual bool get(isamstream&, alignment&)  { throw error; }
+  virtual bool get(isamstream&, alignment_view&) { throw error; }
+  virtual void scan(isamstream&, alignment_handler&, int) { throw error; }
   virtual void put(osamstream&, const collection&) { throw error; }
   virtual void put(osamstream&, const alignment&)  { throw error; }
   virtual void flush(osamstream&) { throw error; }
+  virtual void set_threads(int) { throw error; }
+  virtual void set_block_cache(block_cache*) { throw error; }
+  virtual void set_compression(int) { throw error; }
+  virtual void seek(isamstream&, const seqinterval&) { throw error; }
+  virtual uint64_t tell(isamstream&) { throw error; }
+  virtual void seek(isamstream&, uint64_t) { throw error; }
+  virtual void close(osamstream&) { throw error; }
+  virtual void build_index(osamstream&, const string&) { throw error; }
 
 protected:
   virtual size_t xsgetn(isamstream&, char*, size_t) { throw error; }
@@ -185,6 +195,13 @@ catch (sam::bad_format& e) { setstate_maybe_rethrow(failbit, e); }
 catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
 catch (...) { setstate_maybe_rethrow(badbit); }
 
+void samstream_base::set_threads(int nthreads)
+try {
+  io->set_threads(nthreads);
+}
+catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+catch (...) { setstate_maybe_rethrow(badbit); }
+
 samstream_base::~samstream_base() {
   // Derived classes' destructors will already have invoked their
   // class-specific close_() actions as required.
@@ -217,6 +234,18 @@ open_into_rdbuf(const std::string& filename, openmode mode) {
   else {
     filename_ = filename;
 
+    if ((mode & in) && ! (mode & (out|app))) {
+      // Regular files opened only for reading are memory-mapped if possible.
+      mmapfilebuf* mbuf = new mmapfilebuf;
+      if (mbuf->open(filename.c_str())) {
+	rdbuf(mbuf);
+	owned_rdbuf_ = true;
+	return;
+      }
+
+      delete mbuf;
+    }
+
     rawfilebuf* sbuf = new rawfilebuf;
     rdbuf(sbuf);
     owned_rdbuf_ = true;
@@ -273,6 +302,61 @@ void isamstream::close_() {
 isamstream::~isamstream() {
 }
 
+isamstream& isamstream::seek(const seqinterval& region) {
+  try {
+    // Clear the end-of-stream state left behind by reading previous records.
+    clear();
+    io->seek(*this, region);
+  }
+  catch (sam::bad_format& e) { setstate_maybe_rethrow(failbit, e); }
+  catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+  catch (...) { setstate_maybe_rethrow(badbit); }
+
+  return *this;
+}
+
+uint64_t isamstream::tell() {
+  try {
+    return io->tell(*this);
+  }
+  catch (sam::bad_format& e) { setstate_maybe_rethrow(failbit, e); }
+  catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+  catch (...) { setstate_maybe_rethrow(badbit); }
+
+  return 0;
+}
+
+void isamstream::set_block_cache(block_cache* cache)
+try {
+  io->set_block_cache(cache);
+}
+catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+catch (...) { setstate_maybe_rethrow(badbit); }
+
+isamstream& isamstream::seek(uint64_t offset) {
+  try {
+    clear();
+    io->seek(*this, offset);
+  }
+  catch (sam::bad_format& e) { setstate_maybe_rethrow(failbit, e); }
+  catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+  catch (...) { setstate_maybe_rethrow(badbit); }
+
+  return *this;
+}
+
+isamstream& isamstream::scan(alignment_handler& handler, int nparts) {
+  try {
+    io->scan(*this, handler, nparts);
+  }
+  catch (sambamio::eof_exception&) { throw failure("eof"); }
+  catch (sam::bad_format& e) { setstate_maybe_rethrow(failbit, e); }
+  catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+  catch (...) { setstate_maybe_rethrow(badbit); }
+
+  return *this;
+}
+
 #if 0
 isamstream& isamstream::rewind() {
   // FIXME
@@ -328,6 +412,22 @@ isamstream& isamstream::operator>> (alignment& aln) {
   return *this;
 }
 
+isamstream& isamstream::operator>> (alignment_view& view) {
+  try {
+    if (! io->get(*this, view)) {
+      // As for operator>>(alignment&), this is not a failure as such.
+      try { setstate(failbit); }
+      catch (...) { }
+    }
+  }
+  catch (sambamio::eof_exception&) { throw failure("eof"); }
+  catch (sam::bad_format& e) { setstate_maybe_rethrow(failbit, e); }
+  catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+  catch (...) { setstate_maybe_rethrow(badbit); }
+
+  return *this;
+}
+
 
 // Output streams
 // ==============
@@ -368,7 +468,7 @@ catch (sam::exception& e)  { setstate_maybe_rethrow(failbit, e); }
 catch (...) { setstate_maybe_rethrow(failbit); }
 
 void osamstream::close_() {
-  io->flush(*this);
+  io->close(*this);
 }
 
 osamstream::~osamstream() {
@@ -406,9 +506,42 @@ osamstream& osamstream::operator<< (const alignment& aln) {
   return *this;
 }
 
+void osamstream::build_index(const std::string& index_filename)
+try {
+  io->build_index(*this, index_filename);
+}
+catch (sam::bad_format& e) { setstate_maybe_rethrow(failbit, e); }
+catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+catch (...) { setstate_maybe_rethrow(badbit); }
+
+void osamstream::set_compression(int level)
+try {
+  io->set_compression(level);
+}
+catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+catch (...) { setstate_maybe_rethrow(badbit); }
+
+void osamstream::set_writebehind(size_t limit)
+try {
+  if (rawfilebuf* fbuf = dynamic_cast<rawfilebuf*>(rdbuf()))
+    fbuf->set_writebehind(limit);
+}
+catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+catch (...) { setstate_maybe_rethrow(badbit); }
+
+void osamstream::set_dropbehind(bool dropbehind)
+try {
+  if (rawfilebuf* fbuf = dynamic_cast<rawfilebuf*>(rdbuf()))
+    fbuf->set_dropbehind(dropbehind);
+}
+catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
+catch (...) { setstate_maybe_rethrow(badbit); }
+
 osamstream& osamstream::flush() {
   try {
     io->flush(*this);
+    if (rdbuf()->pubsync() < 0)
+      throw sam::exception("Failed to flush stream buffer");
   }
   catch (sam::bad_format& e) { setstate_maybe_rethrow(failbit, e); }
   catch (sam::exception& e)  { setstate_maybe_rethrow(badbit, e); }
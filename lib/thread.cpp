@@ -0,0 +1,144 @@
+/*  thread.cpp -- Thread pool and synchronisation primitives.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#include "lib/thread.h"
+
+#include <algorithm>
+
+#include "cansam/exception.h"
+
+namespace sam {
+
+thread_pool::thread_pool(int nthreads) : stopping(false) {
+  threads.reserve(nthreads);
+
+  for (int i = 0; i < nthreads; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, thread_main, this);
+    if (err != 0) {
+      // Stop any threads already started, as our destructor won't be run.
+      { scoped_lock guard(lock); stopping = true; }
+      queue_nonempty.broadcast();
+      for (size_t j = 0; j < threads.size(); j++)
+	pthread_join(threads[j], NULL);
+
+      throw sam::system_error("pthread_create() failed", err);
+    }
+
+    threads.push_back(thread);
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    scoped_lock guard(lock);
+    stopping = true;
+  }
+
+  queue_nonempty.broadcast();
+  for (size_t i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+}
+
+void* thread_pool::thread_main(void* pool) {
+  static_cast<thread_pool*>(pool)->work();
+  return NULL;
+}
+
+void thread_pool::work() {
+  scoped_lock guard(lock);
+
+  while (true) {
+    while (queue.empty() && ! stopping)
+      queue_nonempty.wait(lock);
+
+    if (stopping)  break;
+
+    task* t = queue.front();
+    queue.pop_front();
+    t->state = task::running;
+
+    lock.unlock();
+    try { t->run(); }
+    catch (...) { }
+    lock.lock();
+
+    t->state = task::finished;
+    task_finished.broadcast();
+  }
+}
+
+void thread_pool::submit(task* t) {
+  {
+    scoped_lock guard(lock);
+    t->state = task::queued;
+    queue.push_back(t);
+  }
+
+  queue_nonempty.signal();
+}
+
+void thread_pool::wait(task* t) {
+  {
+    scoped_lock guard(lock);
+
+    if (t->state == task::queued) {
+      // Rather than sitting idle, run the task on this thread.
+      queue.erase(std::find(queue.begin(), queue.end(), t));
+      t->state = task::running;
+    }
+    else {
+      while (t->state == task::running)
+	task_finished.wait(lock);
+
+      t->state = task::idle;
+      return;
+    }
+  }
+
+  try { t->run(); }
+  catch (...) { }
+
+  scoped_lock guard(lock);
+  t->state = task::idle;
+}
+
+void thread_pool::cancel(task* t) {
+  scoped_lock guard(lock);
+
+  if (t->state == task::queued)
+    queue.erase(std::find(queue.begin(), queue.end(), t));
+  else
+    while (t->state == task::running)
+      task_finished.wait(lock);
+
+  t->state = task::idle;
+}
+
+} // namespace sam
@@ -0,0 +1,144 @@
+/*  thread.h -- Thread pool and synchronisation primitives.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+namespace sam {
+
+// Thin wrappers around the corresponding POSIX threads facilities.
+
+class mutex {
+public:
+  mutex() { pthread_mutex_init(&m, NULL); }
+  ~mutex() { pthread_mutex_destroy(&m); }
+
+  void lock()   { pthread_mutex_lock(&m); }
+  void unlock() { pthread_mutex_unlock(&m); }
+
+private:
+  friend class condition;
+  pthread_mutex_t m;
+
+  mutex(const mutex&) /* = delete */;
+  mutex& operator= (const mutex&) /* = delete */;
+};
+
+// Holds a mutex locked for the duration of the current scope.
+class scoped_lock {
+public:
+  explicit scoped_lock(mutex& m) : m_(m) { m_.lock(); }
+  ~scoped_lock() { m_.unlock(); }
+
+private:
+  mutex& m_;
+
+  scoped_lock(const scoped_lock&) /* = delete */;
+  scoped_lock& operator= (const scoped_lock&) /* = delete */;
+};
+
+class condition {
+public:
+  condition() { pthread_cond_init(&c, NULL); }
+  ~condition() { pthread_cond_destroy(&c); }
+
+  void wait(mutex& m) { pthread_cond_wait(&c, &m.m); }
+  void signal()    { pthread_cond_signal(&c); }
+  void broadcast() { pthread_cond_broadcast(&c); }
+
+private:
+  pthread_cond_t c;
+
+  condition(const condition&) /* = delete */;
+  condition& operator= (const condition&) /* = delete */;
+};
+
+/* A fixed-size pool of worker threads that execute submitted tasks in
+submission order.  Tasks are owned by the caller, who must wait() for or
+cancel() each submitted task before reusing or destroying it.  Their run()
+methods should not throw exceptions; any problems should instead be recorded
+within the task for the caller to inspect after waiting.  */
+class thread_pool {
+public:
+  class task {
+  public:
+    task() : state(idle) { }
+    virtual ~task() { }
+
+    virtual void run() = 0;
+
+  private:
+    friend class thread_pool;
+    enum { idle, queued, running, finished } state;
+  };
+
+  // Start a pool of NTHREADS worker threads.
+  explicit thread_pool(int nthreads);
+
+  // Stop the worker threads.  Tasks that have been submitted but not yet
+  // started are abandoned without being run.
+  ~thread_pool();
+
+  int size() const { return threads.size(); }
+
+  // Queue the task for execution by one of the worker threads.
+  void submit(task* t);
+
+  // Wait for the task to finish.  If it has not yet been started by a worker
+  // thread, it is instead removed from the queue and run by the caller.
+  void wait(task* t);
+
+  // Withdraw the task, as its result is no longer wanted.  If it has not yet
+  // been started, it is removed from the queue; otherwise this waits for it.
+  void cancel(task* t);
+
+private:
+  static void* thread_main(void* pool);
+  void work();
+
+  std::vector<pthread_t> threads;
+  std::deque<task*> queue;
+  bool stopping;
+
+  mutex lock;
+  condition queue_nonempty;
+  condition task_finished;
+
+  thread_pool(const thread_pool&) /* = delete */;
+  thread_pool& operator= (const thread_pool&) /* = delete */;
+};
+
+} // namespace sam
+
+#endif
@@ -1,6 +1,6 @@
 /*  utilities.cpp -- Various library support functions.
 
-    Copyright (C) 2010 Genome Research Ltd.
+    Copyright (C) 2010, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -32,12 +32,20 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 #include <string>
 #include <iomanip>
 
+#include <time.h>
+
 using std::string;
 
 namespace sam {
 
 extern const char format::hexadecimal_digits[] = "0123456789ABCDEF";
 
+extern const char format::decimal_digit_pairs[] =
+  "00010203040506070809" "10111213141516171819" "20212223242526272829"
+  "30313233343536373839" "40414243444546474849" "50515253545556575859"
+  "60616263646566676869" "70717273747576777879" "80818283848586878889"
+  "90919293949596979899";
+
 // Removes a trailing line terminator, whether it be LF, CR, or CR-LF.
 // (Usually CR would be because there was a CR-LF terminator and the LF has
 // already been elided.)
@@ -72,4 +80,10 @@ make_string& make_string::operator<< (unsigned char c) {
   return *this;
 }
 
+double monotonic_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
 } // namespace sam
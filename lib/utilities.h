@@ -1,6 +1,6 @@
 /*  utilities.h -- Various library support functions.
 
-    Copyright (C) 2010-2013 Genome Research Ltd.
+    Copyright (C) 2010-2013, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -34,8 +34,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 #include <sstream>
 #include <limits>
 
+#include <stdint.h>
+
 #include "cansam/types.h"
 #include "lib/bits/sign_traits.h"
+#include "lib/wire.h"
 
 namespace sam {
 
@@ -59,13 +62,32 @@ struct buffer {
 template <typename IntType>
 char* decimal(char* dest, IntType value);
 
+// "00" to "99", so that two digits can be produced per division.
+extern const char decimal_digit_pairs[];
+
 template <typename UnsignedType>
 char* decimal_(char* dest, UnsignedType value, const traits::false_type&) {
-  UnsignedType n = value;
-  do { dest++; n /= 10; } while (n != 0);
-
-  char* destlim = dest;
-  do { *--dest = (value % 10) + '0'; value /= 10; } while (value != 0);
+  int length = 1;
+  for (UnsignedType n = value; n >= 10; n /= 100)
+    length += (n >= 100)? 2 : 1;
+
+  char* destlim = dest + length;
+  dest = destlim;
+
+  while (value >= 100) {
+    const char* pair = &decimal_digit_pairs[2 * (value % 100)];
+    value /= 100;
+    *--dest = pair[1];
+    *--dest = pair[0];
+  }
+
+  if (value >= 10) {
+    const char* pair = &decimal_digit_pairs[2 * value];
+    *--dest = pair[1];
+    *--dest = pair[0];
+  }
+  else
+    *--dest = value + '0';
 
   return destlim;
 }
@@ -119,32 +141,114 @@ char* hexadecimal(char* dest, IntType ivalue) {
 
 } // namespace format
 
+/* These functions parse the number at S into VALUE and return a pointer to
+the first character not consumed.  Digits that would make VALUE overflow are
+not consumed, so callers that check for trailing characters also reject
+out-of-range numbers.  Characters before END (e.g., the start of the next
+field) may be read eight at a time, regardless of where the number ends.  */
 namespace parse {
 
 template <typename IntType>
-const char* decimal(const char* s, IntType& value);
+const char* decimal(const char* s, const char* end, IntType& value);
+
+template <typename IntType>
+const char* decimal(const char* s, IntType& value)
+  { return decimal(s, s, value); }
+
+// Returns the number of leading decimal digits among the eight characters
+// in CHUNK, which are in memory order from its least significant byte.
+// (Adding 6 to a byte of 0xfa or more carries into the next byte, but only
+// after the first non-digit, so the count is unaffected.)
+inline int leading_digits(uint64_t chunk) {
+  const uint64_t high = 0xf0f0f0f0f0f0f0f0ULL;
+  uint64_t nondigits = ((chunk & high) |
+			(((chunk + 0x0606060606060606ULL) & high) >> 4)) ^
+		       0x3333333333333333ULL;
+  if (nondigits == 0)  return 8;
+#ifdef __GNUC__
+  return __builtin_ctzll(nondigits) / 8;
+#else
+  int n = 0;
+  while ((nondigits & 0xff) == 0)  nondigits >>= 8, n++;
+  return n;
+#endif
+}
+
+// Returns the value of the eight decimal digits in CHUNK, combining adjacent
+// digits into pairs, the pairs into fours, and the fours into the result.
+inline uint32_t eight_digits(uint64_t chunk) {
+  chunk -= 0x3030303030303030ULL;
+  chunk = (chunk * 10) + (chunk >> 8);
+  chunk = (((chunk & 0x000000ff000000ffULL) * (100 + (1000000ULL << 32))) +
+	   (((chunk >> 16) & 0x000000ff000000ffULL) * (1 + (10000ULL << 32))))
+	  >> 32;
+  return chunk;
+}
 
 template <typename UnsignedType>
-const char*
-decimal_(const char* s, UnsignedType& value, const traits::false_type&) {
-  value = 0;
-  if (*s == '+')  s++;
-  while (*s >= '0' && *s <= '9')  value = 10 * value + *s++ - '0';
+inline const char* digits_(const char* s, const char* end,
+			   UnsignedType& value, UnsignedType limit) {
+  UnsignedType v = 0;
+
+  // Eight digits fit in 32 bits, so narrower types are parsed singly.
+  if (std::numeric_limits<UnsignedType>::digits >= 32 && end - s >= 8) {
+    uint64_t chunk = convert::uint64(s);
+    int n = leading_digits(chunk);
+    if (n < 8) {
+      // Short numbers are quicker to accumulate singly, and cannot overflow.
+      for (const char* last = s + n; s < last; s++)  v = 10 * v + (*s - '0');
+      value = v;
+      return s;
+    }
+
+    v = eight_digits(chunk);
+    s += 8;
+  }
+
+  // Digits are accepted while V is below CUTOFF, thereafter only if
+  // the result does not exceed LIMIT.
+  const UnsignedType cutoff = limit / 10, lastdigit = limit % 10;
+  while (*s >= '0' && *s <= '9') {
+    UnsignedType digit = *s - '0';
+    if (v >= cutoff && (v > cutoff || digit > lastdigit))  break;
+    v = 10 * v + digit;
+    s++;
+  }
+
+  value = v;
   return s;
 }
 
+template <typename UnsignedType>
+const char* decimal_(const char* s, const char* end, UnsignedType& value,
+		     const traits::false_type&) {
+  if (*s == '+')  s++;
+  return digits_(s, end, value, std::numeric_limits<UnsignedType>::max());
+}
+
 template <typename SignedType>
-const char*
-decimal_(const char* s, SignedType& value, const traits::true_type&) {
-  typename traits::make_unsigned<SignedType>::type uvalue;
-  if (*s == '-')  s = decimal(s+1, uvalue), value = -uvalue;
-  else  s = decimal(s, uvalue), value = uvalue;
+const char* decimal_(const char* s, const char* end, SignedType& value,
+		     const traits::true_type&) {
+  typedef typename traits::make_unsigned<SignedType>::type UnsignedType;
+  UnsignedType limit = std::numeric_limits<SignedType>::max();
+  UnsignedType uvalue;
+
+  if (*s == '-') {
+    s = digits_(s + 1, end, uvalue, UnsignedType(limit + 1));
+    value = -uvalue;
+  }
+  else {
+    if (*s == '+')  s++;
+    s = digits_(s, end, uvalue, limit);
+    value = uvalue;
+  }
+
   return s;
 }
 
 template <typename IntType>
-const char* decimal(const char* s, IntType& value) {
-  return decimal_(s, value, traits::is_signed<IntType>());
+const char* decimal(const char* s, const char* end, IntType& value) {
+  return decimal_(s, end, value, traits::is_signed<IntType>());
 }
 
 } // namespace parse
@@ -157,6 +261,10 @@ std::string& chomp(std::string& s);
 coord_t to_int(const std::string& str, std::string::size_type begin,
 	       std::string::size_type end);
 
+// Returns the time in seconds according to a monotonic clock, for measuring
+// elapsed intervals.
+double monotonic_time();
+
 class make_string {
 public:
   make_string() { }
@@ -1,6 +1,6 @@
 /*  wire.h -- Access binary data irrespective of endianness and alignment.
 
-    Copyright (C) 2010 Genome Research Ltd.
+    Copyright (C) 2010, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -72,8 +72,8 @@ Return a (host-representation) value...
 Write a (host-represented) value...
    void set_bam_uint16(void*, uint16_t)  ...to unaligned memory in BAM format
 
-Similar functions are provided for {int,uint}{16,32}.  */
-// FIXME Also likely eventually for {int,uint}{64}.
+Similar functions are provided for {int,uint}{16,32}, and the latter two
+kinds also for uint64.  */
 
 #if defined WIRE_NOOP
 
@@ -161,6 +161,17 @@ inline int32_t int32(const void* pv) { return uint32(pv); }
 inline void set_bam_int16(void* pv, int16_t x) { set_bam_uint16(pv, x); }
 inline void set_bam_int32(void* pv, int32_t x) { set_bam_uint32(pv, x); }
 
+inline uint64_t uint64(const void* pv) {
+  const char* p = static_cast<const char*>(pv);
+  return (uint64_t(uint32(&p[4])) << 32) | uint32(p);
+}
+
+inline void set_bam_uint64(void* pv, uint64_t x) {
+  char* p = static_cast<char*>(pv);
+  set_bam_uint32(p, x);
+  set_bam_uint32(&p[4], x >> 32);
+}
+
 } // namespace convert
 } // namespace sam
 
@@ -1,6 +1,6 @@
 /*  test/alignment.cpp -- Tests for alignment records.
 
-    Copyright (C) 2010-2012 Genome Research Ltd.
+    Copyright (C) 2010-2012, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -29,9 +29,20 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 
 #include <iostream> // FIXME NUKE-ME
 #include <sstream>
+#include <vector>
 
 #include "test/test.h"
 #include "cansam/sam/alignment.h"
+#include "cansam/sam/header.h"
+#include "cansam/sam/stream.h"
+#include "cansam/exception.h"
+#include "lib/utilities.h"
+
+namespace sam {
+// Defined in lib/alignment.cpp, for testing the kernels directly.
+int pack_seq_kernel(char* dest, const char* seq, int length);
+int pack_qual_kernel(char* dest, const char* qual, int length);
+}
 
 std::string unpack_seq(const char* raw_seq, int seq_length) {
   std::string s;
@@ -68,6 +79,17 @@ void test_unpack_seq(test_harness& t) {
   test_packing(t, "acmgrsvtwyhkdb.", "\x12\x34\x56\x78\x9a\xbc\xde\xf0",
 		  "ACMGRSVTWYHKDBN");
 
+  // Long enough to be converted many bases at a time.
+  string all = "=ACMGRSVTWYHKDBN", lower = "=acmgrsvtwyhkdb.";
+  string all_packed = "\x01\x23\x45\x67\x89\xab\xcd\xef";
+  string expected;
+  for (int i = 0; i < 5; i++)  expected += all;
+  test_packing(t, all + lower + all + lower + all,
+	       all_packed + all_packed + all_packed + all_packed + all_packed,
+	       expected);
+  test_packing(t, lower + all + "ACG", all_packed + all_packed + "\x12\x40",
+	       all + all + "ACG");
+
   bool threw = false;
   try {
     char buffer[10];
@@ -75,6 +97,67 @@ void test_unpack_seq(test_harness& t) {
   }
   catch (...) { threw = true; }
   t.check(threw, "pack_seq.invalid_char");
+
+  // The kernel, if there is one, must convert runs of every valid character
+  // as far as it converts a run of A's, rather than leaving them to the
+  // slower remainder code.
+  char buffer[16];
+  int full = sam::pack_seq_kernel(buffer, string(32, 'A').data(), 32);
+  t.check(full == 0 || full == 32, "pack_seq_kernel.A");
+  for (size_t i = 0; i < all.length(); i++) {
+    t.check(sam::pack_seq_kernel(buffer, string(32, all[i]).data(), 32), full,
+	    "pack_seq_kernel." + all.substr(i, 1));
+    t.check(sam::pack_seq_kernel(buffer, string(32, lower[i]).data(), 32),
+	    full, "pack_seq_kernel." + lower.substr(i, 1));
+  }
+
+  // Characters that letters' case-folding maps onto valid ones.
+  const char* invalid[] = { "[", "@", "\x1d", "\x0e", "\xc1", "\x7f", "z" };
+  for (size_t i = 0; i < sizeof invalid / sizeof invalid[0]; i++) {
+    string seq = all + all + all;
+    seq[20] = invalid[i][0];
+    threw = false;
+    try {
+      char buffer[24];
+      sam::alignment::pack_seq(buffer, seq.c_str(), seq.length());
+    }
+    catch (...) { threw = true; }
+    t.check(threw, "pack_seq.invalid_char." + seq.substr(20, 1));
+  }
+}
+
+void test_pack_qual(test_harness& t) {
+  string qual, raw;
+  for (int q = 33; q <= 126; q++)  qual += char(q), raw += char(q - 33);
+
+  string packed(qual.length(), '\0');
+  sam::alignment::pack_qual(&packed[0], qual.data(), qual.length());
+  t.check(packed == raw, "pack_qual.all");
+
+  int full = sam::pack_qual_kernel(&packed[0], string(32, '!').data(), 32);
+  t.check(full == 0 || full == 32, "pack_qual_kernel.!");
+  for (int q = 33; q <= 126; q++) {
+    string run(32, char(q));
+    t.check(sam::pack_qual_kernel(&packed[0], run.data(), 32), full,
+	    "pack_qual_kernel." + run.substr(0, 1));
+  }
+
+  string unpacked;
+  sam::alignment::unpack_qual(unpacked, raw.data(), raw.length());
+  t.check(unpacked, qual, "unpack_qual.all");
+
+  // Out of range values are clamped.
+  string extreme;
+  for (int i = 0; i < 40; i++)  extreme += char((i % 2)? -1 - i : 94 + i);
+  sam::alignment::unpack_qual(unpacked, extreme.data(), extreme.length());
+  t.check(unpacked.find_first_not_of("!~") == string::npos &&
+	  unpacked[0] == '~' && unpacked[1] == '!', "unpack_qual.clamped");
+
+  qual[50] = ' ';
+  bool threw = false;
+  try { sam::alignment::pack_qual(&packed[0], qual.data(), qual.length()); }
+  catch (...) { threw = true; }
+  t.check(threw, "pack_qual.invalid_char");
 }
 
 void test_iterators(test_harness& t, sam::alignment& aln) {
@@ -181,6 +264,73 @@ void test_cigar_op(test_harness& t) {
   test_cigar_op(t, 8, 'X', true,  true);
 }
 
+void test_cigar_span(test_harness& t) {
+  sam::alignment aln;
+  aln.set_cigar("*");
+  t.check(aln.cigar_span(), 1, "cigar_span.empty");
+
+  // Long enough to exercise any bulk accumulation, with a ragged tail.
+  const char* opchars = "MIDNSHP=X";
+  std::ostringstream cigar;
+  std::vector<sam::cigar_op> ops;
+  sam::scoord_t span = 0;
+  for (int i = 0; i < 1003; i++) {
+    sam::cigar_op op(i % 37 + 1, opchars[i % 9]);
+    cigar << op;
+    ops.push_back(op);
+    if (op.consumes_reference())  span += op.length();
+  }
+
+  aln.set_cigar(cigar.str());
+  t.check(aln.cigar_length(), ops.size(), "cigar_span.string.length");
+  t.check(aln.cigar_span(), span, "cigar_span.string");
+
+  sam::alignment copy(aln);
+  t.check(copy.cigar_span(), span, "cigar_span.copy");
+
+  aln.set_cigar("5S20M");
+  t.check(aln.cigar_span(), 20, "cigar_span.reset");
+  t.check(aln.right_zpos(), aln.zpos() + 19, "cigar_span.right_zpos");
+
+  aln.set_cigar(ops);
+  t.check(aln.cigar_span(), span, "cigar_span.vector");
+
+  try {
+    aln.set_cigar("M");
+    t.check(false, "cigar.missing_digits");
+  }
+  catch (const sam::bad_format&) {
+  }
+}
+
+// Spans recorded while parsing SAM text, by each parsing path.
+void test_parsed_cigar_span(test_harness& t) {
+  std::ostringstream text;
+  std::vector<sam::scoord_t> spans;
+  text << "@SQ\tSN:chr1\tLN:1000\n";
+  for (int i = 0; i < 300; i++) {
+    text << "r" << i << "\t0\tchr1\t" << i + 1 << "\t30\t" << i % 5 + 1
+	 << "M" << i % 4 << "N1S\t*\t0\t0\tAC\tII\n";
+    spans.push_back(i % 5 + 1 + i % 4);
+  }
+
+  for (int nthreads = 0; nthreads <= 2; nthreads += 2) {
+    std::istringstream textstream(text.str());
+    sam::isamstream in(textstream.rdbuf());
+    in.set_threads(nthreads);
+    sam::collection headers;
+    in >> headers;
+    sam::alignment aln;
+    size_t matching = 0, i;
+    for (i = 0; in >> aln; i++)
+      if (i < spans.size() && aln.cigar_span() == spans[i])  matching++;
+
+    std::ostringstream title;
+    title << "cigar_span.parsed." << nthreads << "_threads";
+    t.check(i == spans.size() && matching == spans.size(), title.str());
+  }
+}
+
 void test_auxen(test_harness& t) {
   sam::alignment aln;
   aln.push_back("XS", "carrot");
@@ -193,6 +343,56 @@ void test_auxen(test_harness& t) {
   t.check(aln.aux<int>("XI"), 37, "aux<int>");
 }
 
+template <typename IntType>
+void test_decimal(test_harness& t, IntType value, const string& text) {
+  char buffer[64];
+  *sam::format::decimal(buffer, value) = '\0';
+  t.check(buffer, text, "format::decimal." + text);
+
+  // Followed by a non-digit, both within and beyond a bulk-readable chunk.
+  for (size_t padding = 0; padding <= 12; padding += 12) {
+    string s = text + "\t" + string(padding, '7');
+    IntType parsed;
+    const char* end = sam::parse::decimal(s.c_str(), s.c_str() + s.length(),
+					  parsed);
+    t.check(parsed == value && *end == '\t', "parse::decimal." + text);
+    t.check(*sam::parse::decimal(s.c_str(), parsed) == '\t' && parsed == value,
+	    "parse::decimal.unbounded." + text);
+  }
+}
+
+template <typename IntType>
+void test_decimal_overflow(test_harness& t, const string& text) {
+  string s = text + "\t0000000000000000";
+  IntType value;
+  t.check(*sam::parse::decimal(s.c_str(), s.c_str() + s.length(), value)
+	  != '\t', "parse::decimal.overflow." + text);
+}
+
+void test_decimal(test_harness& t) {
+  const char* digits = "12345678901234567890";
+  for (int n = 1; n <= 9; n++) {
+    int value = 0;
+    for (int i = 0; i < n; i++)  value = 10 * value + digits[i] - '0';
+    test_decimal(t, value, string(digits, n));
+    test_decimal(t, -value, "-" + string(digits, n));
+  }
+
+  test_decimal(t, 0, "0");
+  test_decimal(t, 100000000, "100000000");
+  test_decimal(t, 2147483647, "2147483647");
+  test_decimal(t, int(-2147483647 - 1), "-2147483648");
+  test_decimal(t, 4294967295U, "4294967295");
+  test_decimal(t, (unsigned char) 255, "255");
+  test_decimal(t, 18446744073709551615ULL, "18446744073709551615");
+
+  test_decimal_overflow<int>(t, "2147483648");
+  test_decimal_overflow<int>(t, "-2147483649");
+  test_decimal_overflow<int>(t, "99999999999");
+  test_decimal_overflow<unsigned>(t, "4294967296");
+  test_decimal_overflow<unsigned char>(t, "256");
+}
+
 void test_format(test_harness& t, std::ios::fmtflags fmt, const char* prefix) {
   char buffer[64];
 
@@ -235,8 +435,12 @@ void test_alignments(test_harness& t) {
   a1.set_qname("JAS5_12:1:3");
 
   test_unpack_seq(t);
+  test_decimal(t);
+  test_pack_qual(t);
   test_iterators(t, a1);
   test_cigar_op(t);
+  test_cigar_span(t);
+  test_parsed_cigar_span(t);
   test_auxen(t);
 
   test_format(t);
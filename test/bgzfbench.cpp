@@ -0,0 +1,225 @@
+/*  bgzfbench.cpp -- Compare BGZF codecs' speed on a BAM file's blocks.
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+    Author: John Marshall <jm18@sanger.ac.uk>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ 3. Neither the names Genome Research Ltd and Wellcome Trust Sanger Institute
+    nor the names of its contributors may be used to endorse or promote products
+    derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND ITS CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH LTD OR ITS CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>  // for getopt()
+
+#include "cansam/exception.h"
+#include "lib/bgzf.h"
+
+using std::string;
+using namespace sam;
+
+// The uncompressed contents of one of the input file's BGZF blocks.
+typedef std::vector<char> block;
+
+// Splits the BGZF file's contents into blocks and decompresses them (with
+// zlib, as a reference) into BLOCKS.
+void read_blocks(const string& filename, std::vector<block>& blocks) {
+  std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+  if (! file)  throw sam::exception("can't open " + filename);
+
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  const string data = contents.str();
+
+  block_inflater inflater(zlib_codec);
+  char buffer[BGZF::uncompressed_max_size];
+
+  size_t pos = 0;
+  while (pos < data.length()) {
+    const char* s = &data[pos];
+    size_t length = data.length() - pos;
+    if (! BGZF::is_bgzf_header(s, length))
+      throw bad_format(filename + " is not a BGZF file");
+
+    size_t size = BGZF::block_size(s);
+    if (size > length)  throw bad_format(filename + " is truncated");
+
+    size_t n = inflater.inflate(buffer, sizeof buffer, s, size);
+    if (n > 0)  blocks.push_back(block(buffer, buffer + n));
+    pos += size;
+  }
+}
+
+double seconds(clock_t start) {
+  return double(clock() - start) / CLOCKS_PER_SEC;
+}
+
+void report(const string& name, const string& operation,
+	    double mbytes, double elapsed, double ratio = 0.0) {
+  std::cout << std::left << std::setw(12) << name
+	    << std::setw(12) << operation << std::right << std::fixed
+	    << std::setprecision(1) << std::setw(10) << mbytes / elapsed;
+  if (ratio > 0.0)  std::cout << std::setprecision(3) << std::setw(10) << ratio;
+  std::cout << '\n';
+}
+
+// Compresses BLOCKS at the given LEVEL with codec C, REPEATS times, and then
+// decompresses the resulting BGZF blocks, checking that the data survives.
+void bench(codec c, int level, const std::vector<block>& blocks, int repeats) {
+  double mbytes = 0.0;
+  for (size_t i = 0; i < blocks.size(); i++)  mbytes += blocks[i].size();
+  mbytes = mbytes * repeats / 1e6;
+
+  std::vector<block> compressed(blocks.size());
+  block_deflater deflater(level, c);
+  char buffer[BGZF::full_block_size];
+  size_t compressed_size = 0;
+
+  clock_t start = clock();
+  for (int r = 0; r < repeats; r++)
+    for (size_t i = 0; i < blocks.size(); i++) {
+      // Blocks from other writers may be larger than Cansam writes them.
+      const block& b = blocks[i];
+      size_t length = std::min(b.size(), size_t(BGZF::uncompressed_block_size));
+      size_t n = deflater.deflate(buffer, &b[0], length);
+      if (r == 0) {
+	compressed[i].assign(buffer, buffer + n);
+	compressed_size += n;
+      }
+    }
+
+  std::ostringstream operation;
+  operation << "deflate ";
+  if (level == Z_DEFAULT_COMPRESSION)  operation << "dflt";
+  else  operation << level;
+  report(codec_name(c), operation.str(), mbytes, seconds(start),
+	 double(compressed_size) * repeats / (mbytes * 1e6));
+
+  block_inflater inflater(c);
+  char output[BGZF::uncompressed_max_size];
+  bool ok = true;
+
+  start = clock();
+  for (int r = 0; r < repeats; r++)
+    for (size_t i = 0; i < compressed.size(); i++) {
+      const block& b = compressed[i];
+      size_t n = inflater.inflate(output, sizeof output, &b[0], b.size());
+      if (r == 0) {
+	size_t length = std::min(blocks[i].size(),
+				 size_t(BGZF::uncompressed_block_size));
+	if (n != length || memcmp(output, &blocks[i][0], n) != 0)  ok = false;
+      }
+    }
+
+  report(codec_name(c), "inflate", mbytes, seconds(start));
+  if (! ok)
+    std::cout << codec_name(c) << ": round trip at level " << level
+	      << " did not reproduce the original data\n";
+}
+
+// Computes the CRC-32 checksums of BLOCKS, REPEATS times, with both zlib's
+// crc32() and BGZF::crc32(), checking that they agree.
+void bench_crc32(const std::vector<block>& blocks, int repeats) {
+  double mbytes = 0.0;
+  for (size_t i = 0; i < blocks.size(); i++)  mbytes += blocks[i].size();
+  mbytes = mbytes * repeats / 1e6;
+
+  std::vector<uint32_t> expected(blocks.size());
+  clock_t start = clock();
+  for (int r = 0; r < repeats; r++)
+    for (size_t i = 0; i < blocks.size(); i++)
+      expected[i] = crc32(crc32(0, NULL, 0),
+			  reinterpret_cast<const unsigned char*>(&blocks[i][0]),
+			  blocks[i].size());
+  report("zlib", "crc32", mbytes, seconds(start));
+
+  bool ok = true;
+  start = clock();
+  for (int r = 0; r < repeats; r++)
+    for (size_t i = 0; i < blocks.size(); i++)
+      if (BGZF::crc32(&blocks[i][0], blocks[i].size()) != expected[i])
+	ok = false;
+  report("bgzf", "crc32", mbytes, seconds(start));
+
+  if (! ok)  std::cout << "BGZF::crc32() disagrees with zlib's crc32()\n";
+}
+
+int main(int argc, char** argv)
+try {
+  static const char usage[] =
+"Usage: bgzfbench [-n REPEATS] [-z LEVEL]... FILE\n"
+"Compresses and decompresses the blocks of FILE, a BGZF-compressed file such as\n"
+"a BAM file, with each available codec, and reports throughput in MB/s of\n"
+"uncompressed data and compression ratios.\n"
+"";
+
+  int repeats = 5;
+  std::vector<int> levels;
+
+  int c;
+  while ((c = getopt(argc, argv, ":n:z:")) >= 0)
+    switch (c) {
+    case 'n':  repeats = atoi(optarg);  break;
+    case 'z':  levels.push_back(atoi(optarg));  break;
+    default:   std::cerr << usage; return EXIT_FAILURE;
+    }
+
+  if (optind != argc - 1 || repeats <= 0)
+    { std::cerr << usage; return EXIT_FAILURE; }
+
+  if (levels.empty()) {
+    levels.push_back(1);
+    levels.push_back(Z_DEFAULT_COMPRESSION);
+    levels.push_back(9);
+  }
+
+  std::vector<block> blocks;
+  read_blocks(argv[optind], blocks);
+  std::cout << blocks.size() << " blocks from " << argv[optind] << '\n';
+
+  std::cout << "codec       operation         MB/s     ratio\n";
+  const codec codecs[] = { zlib_codec, libdeflate_codec };
+  for (size_t i = 0; i < sizeof codecs / sizeof codecs[0]; i++)
+    if (codec_available(codecs[i]))
+      for (size_t j = 0; j < levels.size(); j++)
+	bench(codecs[i], levels[j], blocks, repeats);
+    else
+      std::cout << codec_name(codecs[i]) << " is not available\n";
+
+  bench_crc32(blocks, repeats);
+
+  return EXIT_SUCCESS;
+}
+catch (const std::exception& e) {
+  std::cout << std::flush;
+  std::cerr << "bgzfbench: " << e.what() << std::endl;
+  return EXIT_FAILURE;
+}
@@ -1,6 +1,6 @@
 /*  test/sam.cpp -- Tests for SAM and BAM formatting.
 
-    Copyright (C) 2010-2012 Genome Research Ltd.
+    Copyright (C) 2010-2012, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -27,11 +27,27 @@ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
 OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <zlib.h>
 
 #include "cansam/sam/alignment.h"
+#include "cansam/sam/header.h"
 #include "cansam/sam/stream.h"
+#include "cansam/exception.h"
+#include "cansam/interval.h"
+#include "cansam/streambuf.h"
+#include "lib/bamindex.h"
+#include "lib/bgzf.h"
+#include "lib/wire.h"
 #include "test/test.h"
 
 static void test_reader(test_harness& t) {
@@ -54,6 +70,79 @@ std::cout << "end of loop 1\n";
     std::cout << aln << '\n';
 }
 
+// A string buffer that returns at most CHUNK characters per sgetn() call,
+// as for a pipe.
+class trickle_stringbuf : public std::stringbuf {
+public:
+  trickle_stringbuf(const string& s, std::streamsize chunk)
+    : std::stringbuf(s, std::ios::in), chunk(chunk) { }
+
+protected:
+  std::streamsize xsgetn(char* s, std::streamsize n)
+    { return std::stringbuf::xsgetn(s, std::min(n, chunk)); }
+
+private:
+  std::streamsize chunk;
+};
+
+// Check that lines spanning buffer refills, including those much longer
+// than the buffer, are read correctly.
+static void test_long_lines(test_harness& t) {
+  std::ostringstream records;
+  for (int i = 0; i < 400; i++) {
+    int length = (i % 50 == 7)? 3000000 + i : (i * 997) % 5000;
+    records << "read" << i << "\t0\tchr1\t" << i + 1
+	    << "\t30\t4M\t*\t0\t0\tACGT\tIIII\tXX:Z:"
+	    << string(length, 'a' + i % 26) << '\n';
+  }
+  string expected = records.str();
+
+  string text = "@HD\tVN:1.4\r\n@SQ\tSN:chr1\tLN:1000\n" + expected;
+  text.resize(text.size() - 1);  // Leave the final line unterminated.
+
+  std::streamsize chunks[] = { 1000000, 1000, 7 };
+  for (int i = 0; i < 3; i++) {
+    trickle_stringbuf sbuf(text, chunks[i]);
+    sam::isamstream in(&sbuf);
+    sam::collection headers;
+    in >> headers;
+    std::ostringstream headers_text, actual;
+    headers_text << headers;
+    sam::alignment aln;
+    while (in >> aln)  actual << aln << '\n';
+
+    t.check(headers_text.str(), "@HD\tVN:1.4\n@SQ\tSN:chr1\tLN:1000\n",
+	    "headers read in chunks");
+    t.check(actual.str() == expected, "long lines read in chunks");
+  }
+}
+
+// Check that fields are split correctly wherever the tabs and newlines fall
+// relative to the blocks of characters that are scanned together.
+static void test_field_splitting(test_harness& t) {
+  std::ostringstream records, text;
+  text << "@SQ\tSN:chr1\tLN:1000\n";
+  for (int i = 0; i < 300; i++) {
+    std::ostringstream record;
+    record << "r" << string(i % 23, 'x') << "\t0\tchr1\t" << i + 1
+	   << "\t30\t1M\t*\t0\t0\tA\tI";
+    for (int j = 0; j < i % 7; j++)
+      record << "\tX" << j << ":Z:" << string((i + j) % 19, 'z');
+
+    records << record.str() << '\n';
+    text << record.str() << ((i % 3 == 0)? "\r\n" : "\n");
+  }
+
+  std::istringstream textstream(text.str());
+  sam::isamstream in(textstream.rdbuf());
+  sam::collection headers;
+  in >> headers;
+  std::ostringstream actual;
+  sam::alignment aln;
+  while (in >> aln)  actual << aln << '\n';
+  t.check(actual.str() == records.str(), "fields split at all positions");
+}
+
 static void test_bam_headers(test_harness& t, const string& basename,
 			     const std::stringstream& text) {
   string filename = test_objdir_prefix + basename + "-out.bam";
@@ -139,8 +228,1071 @@ static void test_streams(test_harness& t, const string& extension,
   check_headers(t, in, hdtext);
 }
 
+// Writes a BAM file containing a few hundred BGZF blocks' worth of records.
+// If VARY_THREADS is set, the number of compression threads changes midway.
+static void make_bam(const string& filename, int nrecords,
+		     int nthreads = 0, bool vary_threads = false) {
+  std::stringstream text;
+  text << "@SQ\tSN:chr1\tLN:100000000\n";
+  for (int i = 0; i < nrecords; i++)
+    text << "read" << i << "\t0\tchr1\t" << 1 + i * 7 << "\t60\t40M\t*\t0\t0\t"
+	 << "ACGTACGTACGTACGTACGTACGTACGTACGTACGTACGT\t"
+	 << "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII\tNM:i:" << i % 5 << '\n';
+
+  sam::isamstream in(text.rdbuf());
+  sam::osamstream out(filename, sam::bam_format);
+  out.set_threads(nthreads);
+  sam::collection headers;
+  in >> headers;
+  out << headers;
+
+  sam::alignment aln;
+  for (int i = 0; in >> aln; i++) {
+    if (vary_threads && i == nrecords / 3)  out.set_threads(0);
+    else if (vary_threads && i == 2 * nrecords / 3)  out.set_threads(3);
+    out << aln;
+  }
+}
+
+static string file_contents(const string& filename) {
+  std::ifstream f(filename.c_str(), std::ios::binary);
+  std::ostringstream contents;
+  contents << f.rdbuf();
+  return contents.str();
+}
+
+static string read_all(const string& filename, int nthreads) {
+  sam::isamstream in(filename);
+  in.set_threads(nthreads);
+
+  sam::collection headers;
+  in >> headers;
+
+  std::ostringstream text;
+  sam::alignment aln;
+  while (in >> aln)  text << aln << '\n';
+  return text.str();
+}
+
+static void test_threads(test_harness& t) {
+  string filename = test_objdir_prefix + "threads-out.bam";
+  make_bam(filename, 50000);
+
+  string expected = read_all(filename, 0);
+  t.check(expected.size() > 0, "single-threaded BAM reading");
+  t.check(read_all(filename, 1) == expected, "BAM reading with 1 thread");
+  t.check(read_all(filename, 4) == expected, "BAM reading with 4 threads");
+
+  sam::isamstream in(filename);
+  sam::collection headers;
+  in >> headers;
+  std::ostringstream text;
+  sam::alignment aln;
+  for (int i = 0; in >> aln; i++) {
+    // Change the number of threads while records are outstanding.
+    if (i == 1000)  in.set_threads(3);
+    else if (i == 20000)  in.set_threads(0);
+    else if (i == 30000)  in.set_threads(2);
+    text << aln << '\n';
+  }
+  t.check(text.str() == expected, "BAM reading with varying threads");
+
+  string expected_bytes = file_contents(filename);
+  make_bam(filename, 50000, 1);
+  t.check(file_contents(filename) == expected_bytes, "BAM writing with 1 thread");
+  make_bam(filename, 50000, 4);
+  t.check(file_contents(filename) == expected_bytes, "BAM writing with 4 threads");
+  make_bam(filename, 50000, 2, true);
+  t.check(file_contents(filename) == expected_bytes,
+	  "BAM writing with varying threads");
+}
+
+// Reads NLINES records from SAM TEXT using NTHREADS parsing threads, noting
+// those that could not be parsed.
+static string read_sam_lines(const string& text, int nlines, int nthreads) {
+  std::istringstream textstream(text);
+  sam::isamstream in(textstream.rdbuf());
+  in.exceptions(std::ios::goodbit);
+  in.set_threads(nthreads);
+  sam::collection headers;
+  in >> headers;
+
+  std::ostringstream out;
+  sam::alignment aln;
+  for (int i = 0; i < nlines; i++)
+    if (in >> aln)  out << aln << '\n';
+    else  out << "(failed)\n", in.clear();
+
+  if (in >> aln)  out << "(excess)\n";
+  return out.str();
+}
+
+static void test_threaded_sam(test_harness& t) {
+  // Sequences whose lengths are not multiples of 16, so that each record
+  // leaves some bases to pack_seq()'s table, parsed by several threads
+  // before any serial parsing.
+  std::ostringstream seqtext;
+  seqtext << "@SQ\tSN:chr1\tLN:100000000\n";
+  const string bases = "ACGTNacgtn=MRSVWYHKDBmrsvwyhkdb.";
+  const int nseqlines = 20000;
+  for (int i = 0; i < nseqlines; i++) {
+    int length = 1 + (i * 7) % 45;
+    string seq;
+    for (int j = 0; j < length; j++)  seq += bases[(i + j) % bases.length()];
+    seqtext << "seq" << i << "\t0\tchr1\t" << i + 1 << "\t60\t" << length
+	    << "M\t*\t0\t0\t" << seq << '\t' << string(length, 'I') << '\n';
+  }
+
+  string threaded = read_sam_lines(seqtext.str(), nseqlines, 4);
+  string serial = read_sam_lines(seqtext.str(), nseqlines, 0);
+  t.check(threaded.find("(failed)") == string::npos && threaded == serial,
+	  "SAM sequences parsed with 4 threads");
+
+  // Several chunks' worth of lines, including CR-LF-terminated lines, a line
+  // longer than a chunk, lines that fail to parse, and an unterminated line.
+  std::ostringstream text;
+  text << "@SQ\tSN:chr1\tLN:100000000\n";
+  const int nlines = 30000;
+  for (int i = 0; i < nlines; i++) {
+    text << "read" << i << "\t0\t" << ((i == 7000)? "chrX" : "chr1") << '\t'
+	 << i + 1 << ((i == 9000)? "x" : "") << "\t60\t4M\t*\t0\t0\tACGT\tIIII"
+	 << "\tXA:Z:" << string((i == 5000)? 1500000 : i % 97, 'a');
+    if (i < nlines - 1)  text << ((i % 3 == 0)? "\r\n" : "\n");
+  }
+
+  string expected = read_sam_lines(text.str(), nlines, 0);
+  size_t failed = 0;
+  for (size_t pos = 0; (pos = expected.find("(failed)", pos)) != string::npos;
+       pos++)
+    failed++;
+  t.check(failed, 2, "SAM text with unparseable records");
+  t.check(read_sam_lines(text.str(), nlines, 1) == expected,
+	  "SAM parsing with 1 thread");
+  t.check(read_sam_lines(text.str(), nlines, 3) == expected,
+	  "SAM parsing with 3 threads");
+
+  string filename = test_objdir_prefix + "tellseek-out.sam";
+  expected = read_all(filename, 0);
+  t.check(read_all(filename, 4) == expected, "SAM reading with 4 threads");
+
+  sam::isamstream in(filename);
+  sam::collection headers;
+  in >> headers;
+  std::ostringstream actual;
+  sam::alignment aln;
+  for (int i = 0; in >> aln; i++) {
+    // Change the number of threads while records are outstanding.
+    if (i == 1000)  in.set_threads(3);
+    else if (i == 20000)  in.set_threads(0);
+    else if (i == 30000)  in.set_threads(2);
+    actual << aln << '\n';
+  }
+  t.check(actual.str() == expected, "SAM reading with varying threads");
+
+  filename = test_objdir_prefix + "compressed-out.sam.gz";
+  t.check(read_all(filename, 2) == read_all(filename, 0),
+	  "compressed SAM reading with 2 threads");
+}
+
+static void test_alignment_views(test_harness& t, const string& filename,
+				 int nthreads) {
+  string expected = read_all(filename, 0);
+
+  sam::isamstream in(filename);
+  in.set_threads(nthreads);
+  sam::collection headers;
+  in >> headers;
+
+  std::ostringstream text;
+  std::vector<sam::alignment> kept;
+  sam::alignment_view view;
+  for (int i = 0; in >> view; i++) {
+    text << view << '\n';
+    if (i % 1000 == 0)  kept.push_back(view);
+  }
+  t.check(text.str() == expected, "reading alignment views from " + filename);
+
+  // Copies taken from views must outlive the stream's buffers.
+  std::istringstream lines(expected);
+  std::ostringstream expected_kept, kept_text;
+  string line;
+  for (int i = 0; getline(lines, line); i++)
+    if (i % 1000 == 0)  expected_kept << line << '\n';
+  for (size_t i = 0; i < kept.size(); i++)  kept_text << kept[i] << '\n';
+  t.check(kept_text.str() == expected_kept.str(),
+	  "alignments copied from views of " + filename);
+}
+
+// Collects the text of each part's records, optionally failing after LIMIT.
+class text_collector : public sam::alignment_handler {
+public:
+  text_collector(int nparts, int limit = -1) : text(nparts), limit(limit) { }
+
+  virtual void process(const sam::alignment& aln, int part) {
+    if (part == 0 && limit >= 0 && limit-- == 0)
+      throw std::runtime_error("handler failed");
+
+    std::ostringstream line;
+    line << aln << '\n';
+    text[part] += line.str();
+  }
+
+  string all() const {
+    string s;
+    for (size_t i = 0; i < text.size(); i++)  s += text[i];
+    return s;
+  }
+
+  std::vector<string> text;
+  int limit;
+};
+
+static void test_scan(test_harness& t, const string& filename, int nparts) {
+  string expected = read_all(filename, 0);
+
+  sam::isamstream in(filename);
+  sam::collection headers;
+  in >> headers;
+  text_collector collector(nparts);
+  t.check(in.scan(collector, nparts), "scanning " + filename);
+  t.check(collector.all() == expected, "records scanned from " + filename);
+
+  sam::alignment aln;
+  t.check(! (in >> aln) && in.eof(), "EOF after scanning " + filename);
+
+  string contents = file_contents(filename);
+  sam::membuf mbuf(contents.data(), contents.size());
+  sam::isamstream memin(&mbuf);
+  memin >> headers;
+  memin >> aln;
+  text_collector memcollector(nparts);
+  memin.scan(memcollector, nparts);
+  std::ostringstream first;
+  first << aln << '\n';
+  t.check(first.str() + memcollector.all() == expected,
+	  "records scanned after reading one from " + filename);
+
+  sam::isamstream failin(filename);
+  failin >> headers;
+  text_collector failing(nparts, 100);
+  bool threw = false;
+  try { failin.scan(failing, nparts); }
+  catch (const std::exception&) { threw = true; }
+  t.check(threw && failin.bad(), "handler exceptions propagated from scan");
+}
+
+// Check that corrupted BGZF blocks are detected via their trailers.
+static void test_block_checksums(test_harness& t) {
+  string filename = test_objdir_prefix + "corrupt-out.bam";
+  string original = file_contents(test_objdir_prefix + "threads-out.bam");
+
+  for (int nthreads = 0; nthreads <= 2; nthreads += 2) {
+    // Alter the CRC-32 and then the ISIZE field of the third block's trailer.
+    for (int field = 0; field < 8; field += 4) {
+      string data = original;
+      size_t pos = 0;
+      for (int i = 0; i < 3; i++)
+	pos += sam::BGZF::block_size(&data[pos]);
+      data[pos - 8 + field] ^= 0x20;
+
+      {
+	std::ofstream f(filename.c_str(), std::ios::binary);
+	f << data;
+      }
+
+      bool threw = false;
+      try { read_all(filename, nthreads); }
+      catch (const sam::bad_format&) { threw = true; }
+      t.check(threw, string("detecting corrupted BGZF ")
+		     + ((field == 0)? "CRC" : "ISIZE")
+		     + ((nthreads > 0)? " with threads" : ""));
+    }
+  }
+}
+
+static string read_cached(const string& filename, sam::block_cache& cache,
+			  int nthreads) {
+  sam::isamstream in(filename);
+  in.set_threads(nthreads);
+  in.set_block_cache(&cache);
+
+  sam::collection headers;
+  in >> headers;
+
+  std::ostringstream text;
+  sam::alignment aln;
+  while (in >> aln)  text << aln << '\n';
+  return text.str();
+}
+
+// Returns the stream's tell() after reading each record, one per line.
+static string tells(const string& filename, sam::block_cache* cache,
+		    int nthreads) {
+  sam::isamstream in(filename);
+  in.set_threads(nthreads);
+  in.set_block_cache(cache);
+
+  sam::collection headers;
+  in >> headers;
+
+  std::ostringstream text;
+  sam::alignment aln;
+  while (in >> aln)  text << in.tell() << '\n';
+  return text.str();
+}
+
+static void test_block_cache(test_harness& t) {
+  string filename = test_objdir_prefix + "threads-out.bam";
+  string expected = read_all(filename, 0);
+
+  // Large enough for all of the file's blocks.
+  sam::block_cache cache(16 << 20);
+  t.check(read_cached(filename, cache, 0) == expected, "reading via cache");
+  uint64_t nblocks = cache.misses();
+  t.check(cache.hits() == 0 && nblocks > 10, "cache initially misses");
+
+  t.check(read_cached(filename, cache, 0) == expected, "rereading via cache");
+  t.check(cache.hits() >= nblocks - 2 && cache.misses() <= nblocks + 2,
+	  "rereading hits cache");
+
+  t.check(read_cached(filename, cache, 3) == expected,
+	  "rereading via cache with threads");
+  t.check(cache.hits() >= 2 * (nblocks - 2), "threaded reading hits cache");
+
+  // Blocks found in the cache must still report their compressed size.
+  t.check(tells(filename, &cache, 3) == tells(filename, NULL, 0),
+	  "tell() after cache hits with threads");
+
+  // Too small to hold the blocks that are revisited.
+  cache.clear();
+  cache.set_capacity(100000);
+  t.check(read_cached(filename, cache, 2) == expected &&
+	  read_cached(filename, cache, 0) == expected,
+	  "reading via small cache");
+  t.check(cache.size() <= 100000 && cache.hits() == 0,
+	  "small cache evicts blocks");
+}
+
+// Check that memory-mapped files read the same as via read(2).
+static void test_mmapfilebuf(test_harness& t, const string& filename) {
+  string contents = file_contents(filename);
+
+  sam::mmapfilebuf mbuf;
+  t.check(mbuf.open(filename.c_str()) != NULL, "mapping " + filename);
+  std::streamsize length;
+  const char* data = mbuf.unread(length);
+  t.check(string(data, length) == contents, "mapped contents of " + filename);
+
+  char buffer[100];
+  mbuf.pubseekpos(contents.size() - 50);
+  t.check(mbuf.sgetn(buffer, sizeof buffer) == 50 &&
+	  string(buffer, 50) == contents.substr(contents.size() - 50) &&
+	  mbuf.sgetn(buffer, sizeof buffer) == 0, "reading mapped file at EOF");
+  t.check(mbuf.pubseekoff(-10, std::ios::cur) ==
+	  std::streampos(contents.size() - 10), "seeking within mapped file");
+  mbuf.close();
+
+  sam::mmapfilebuf dirbuf;
+  t.check(dirbuf.open((test_objdir_prefix + ".").c_str()) == NULL,
+	  "mapping a directory fails");
+
+  sam::rawfilebuf rbuf;
+  rbuf.open(filename.c_str(), std::ios::in);
+  sam::isamstream in(&rbuf);
+  sam::collection headers;
+  in >> headers;
+  std::ostringstream text;
+  sam::alignment aln;
+  while (in >> aln)  text << aln << '\n';
+  t.check(text.str() == read_all(filename, 0),
+	  "reading " + filename + " via read(2) and mapped");
+}
+
+static string read_all(std::streambuf* sbuf) {
+  sam::isamstream in(sbuf);
+  sam::collection headers;
+  in >> headers;
+
+  std::ostringstream text;
+  sam::alignment aln;
+  while (in >> aln)  text << aln << '\n';
+  return text.str();
+}
+
+static void test_membuf(test_harness& t, const string& filename) {
+  string contents = file_contents(filename);
+  string expected = read_all(filename, 0);
+
+  sam::membuf mbuf(contents.data(), contents.size());
+  std::streamsize length;
+  t.check(mbuf.unread(length) == contents.data() &&
+	  length == std::streamsize(contents.size()),
+	  "membuf over the contents of " + filename);
+  t.check(read_all(&mbuf) == expected, "reading " + filename + " from memory");
+
+  sam::membuf mbuf2(contents.data(), contents.size());
+  sam::isamstream in(&mbuf2);
+  in.set_threads(2);
+  sam::collection headers;
+  in >> headers;
+  std::ostringstream text;
+  sam::alignment aln;
+  while (in >> aln)  text << aln << '\n';
+  t.check(text.str() == expected,
+	  "reading " + filename + " from memory with threads");
+
+  bool threw = false;
+  try { mbuf2.sputn("x", 1); }
+  catch (const std::logic_error&) { threw = true; }
+  t.check(threw, "writing to a read-only membuf fails");
+}
+
+static void test_membuf_output(test_harness& t) {
+  string from = test_objdir_prefix + "threads-out.bam";
+
+  sam::membuf out;
+  t.check(out.sputn("", 0) == 0 && out.size() == 0,
+	  "writing nothing to a new membuf");
+  {
+    sam::isamstream in(from);
+    sam::osamstream outstr(&out, sam::bam_format);
+    sam::collection headers;
+    sam::alignment aln;
+    in >> headers;
+    outstr << headers;
+    while (in >> aln)  outstr << aln;
+    outstr.close();
+  }
+
+  t.check(! out.is_open() && string(out.data(), out.size()) ==
+	  file_contents(from), "writing BAM to a membuf");
+  t.check(read_all(&out) == read_all(from, 0),
+	  "reading BAM back from the membuf written");
+}
+
+static void test_readahead(test_harness& t, const string& filename) {
+  string expected = read_all(filename, 0);
+
+  {
+    // A small window, so that the ring of buffers wraps around many times.
+    sam::rawfilebuf rbuf;
+    rbuf.open(filename.c_str(), std::ios::in);
+    rbuf.set_readahead(200000);
+    t.check(read_all(&rbuf) == expected, "read-ahead from " + filename);
+  }
+
+  {
+    sam::rawfilebuf rbuf;
+    rbuf.open(filename.c_str(), std::ios::in);
+    rbuf.set_readahead(1 << 20);
+    sam::isamstream in(&rbuf);
+    sam::collection headers;
+    in >> headers;
+
+    sam::alignment aln;
+    for (int i = 0; i < 1000; i++)  in >> aln;
+    uint64_t offset = in.tell();
+    in >> aln;
+    string name = aln.qname();
+    while (in >> aln) { }
+
+    in.seek(offset);
+    t.check(in >> aln && aln.qname() == name, "seeking with read-ahead");
+
+    // Stopping reading ahead mid-file continues at the right position.
+    in.seek(offset);
+    rbuf.set_readahead(0);
+    t.check(in >> aln && aln.qname() == name, "stopping read-ahead");
+  }
+
+  FILE* pipe = popen(("cat " + filename).c_str(), "r");
+  if (pipe) {
+    {
+      sam::rawfilebuf rbuf;
+      rbuf.attach(fileno(pipe));
+      rbuf.set_readahead(4 << 20);
+      t.check(read_all(&rbuf) == expected, "read-ahead from a pipe");
+    }
+    pclose(pipe);
+  }
+}
+
+static void test_writebehind(test_harness& t) {
+  string from = test_objdir_prefix + "threads-out.bam";
+  string filename = test_objdir_prefix + "writebehind-out.bam";
+  string expected = file_contents(from);
+
+  {
+    // A small limit, so that the producer frequently waits for the writer.
+    sam::rawfilebuf wbuf;
+    wbuf.open(filename.c_str(), std::ios::out);
+    wbuf.set_writebehind(100000);
+    sam::isamstream in(from);
+    sam::osamstream out(&wbuf, sam::bam_format);
+    out.set_threads(2);
+    sam::collection headers;
+    sam::alignment aln;
+    in >> headers;
+    out << headers;
+    while (in >> aln)  out << aln;
+    out.close();
+    t.check(out.good(), "writing behind to " + filename);
+  }
+  t.check(file_contents(filename) == expected, "contents written behind");
+
+  {
+    sam::isamstream in(from);
+    sam::osamstream out(filename, sam::bam_format);
+    out.set_writebehind(100000);
+    sam::collection headers;
+    sam::alignment aln;
+    in >> headers;
+    out << headers;
+    while (in >> aln)  out << aln;
+    out.close();
+    t.check(out.good(), "osamstream writing behind to " + filename);
+  }
+  t.check(file_contents(filename) == expected,
+	  "contents written behind by osamstream");
+
+  sam::rawfilebuf fullbuf;
+  if (fullbuf.open("/dev/full", std::ios::out)) {
+    fullbuf.set_writebehind(100000);
+    sam::isamstream in(from);
+    sam::osamstream out(&fullbuf, sam::sam_format);
+    sam::collection headers;
+    sam::alignment aln;
+    in >> headers;
+    out << headers;
+    bool reported = false;
+    try { while (in >> aln)  out << aln; }
+    catch (const sam::system_error& e) { reported = (e.errnum() == ENOSPC); }
+    t.check(reported && out.bad(), "write-behind error reported by operator<<");
+  }
+}
+
+static void test_dropbehind(test_harness& t) {
+  string from = test_objdir_prefix + "threads-out.bam";
+  string filename = test_objdir_prefix + "dropbehind-out.bam";
+  string expected = file_contents(from);
+
+  {
+    sam::isamstream in(from);
+    sam::osamstream out(filename, sam::bam_format);
+    out.set_dropbehind(true);
+    sam::collection headers;
+    sam::alignment aln;
+    in >> headers;
+    out << headers;
+    while (in >> aln)  out << aln;
+    out.close();
+    t.check(out.good(), "writing " + filename + " with drop-behind");
+  }
+  t.check(file_contents(filename) == expected, "contents with drop-behind");
+
+  {
+    // Repeatedly, so that several windows' worth are written and dropped.
+    sam::rawfilebuf wbuf;
+    wbuf.open(filename.c_str(), std::ios::out);
+    wbuf.set_writebehind(100000);
+    wbuf.set_dropbehind(true);
+    for (int i = 0; i < 40; i++)  wbuf.sputn(expected.data(), expected.size());
+    wbuf.pubseekpos(0);
+    wbuf.sputn(expected.data(), expected.size());
+    wbuf.close();
+  }
+  string contents = file_contents(filename);
+  t.check(contents.size() == 40 * expected.size() &&
+	  contents.compare(39 * expected.size(), string::npos, expected) == 0 &&
+	  contents.compare(0, expected.size(), expected) == 0,
+	  "writing behind with drop-behind");
+}
+
+static void test_positional(test_harness& t, const string& filename) {
+  string expected = read_all(filename, 0);
+
+  sam::rawfilebuf shared;
+  shared.open(filename.c_str(), std::ios::in);
+
+  {
+    // Two streams reading in lockstep via the same file descriptor.
+    sam::rawfilebuf abuf, bbuf;
+    abuf.attach(shared.fd());
+    abuf.set_positional(true);
+    bbuf.attach(shared.fd());
+    bbuf.set_positional(true);
+    bbuf.set_readahead(200000);
+
+    sam::isamstream a(&abuf), b(&bbuf);
+    sam::collection aheaders, bheaders;
+    a >> aheaders;
+    b >> bheaders;
+
+    std::ostringstream atext, btext;
+    sam::alignment aln;
+    while (a >> aln) {
+      atext << aln << '\n';
+      if (b >> aln)  btext << aln << '\n';
+    }
+
+    t.check(atext.str() == expected && btext.str() == expected,
+	    "interleaved positional reading of " + filename);
+    t.check(shared.pubseekoff(0, std::ios::cur) == 0,
+	    "positional reading leaves the descriptor's offset alone");
+
+    // Seeking one stream does not disturb the other.
+    sam::rawfilebuf cbuf;
+    cbuf.attach(shared.fd());
+    cbuf.set_positional(true);
+    sam::isamstream c(&cbuf);
+    sam::collection cheaders;
+    c >> cheaders;
+    for (int i = 0; i < 1000; i++)  c >> aln;
+    uint64_t offset = c.tell();
+    c >> aln;
+    string name = aln.qname();
+
+    a.seek(offset);
+    c >> aln;
+    string next = aln.qname();
+    c.seek(offset);
+    t.check(a >> aln && aln.qname() == name && c >> aln &&
+	    aln.qname() == name && c >> aln && aln.qname() == next,
+	    "seeking positional streams independently");
+  }
+
+  string contents = file_contents(filename);
+  string outname = test_objdir_prefix + "positional-out.bam";
+  std::streamsize half = contents.size() / 2;
+
+  {
+    // Write the second half first, then the first half before it.
+    sam::rawfilebuf wbuf;
+    wbuf.open(outname.c_str(), std::ios::out);
+    wbuf.set_positional(true);
+    wbuf.set_writebehind(100000);
+    wbuf.pubseekpos(half);
+    wbuf.sputn(&contents[half], contents.size() - half);
+    std::streamoff end = contents.size();
+    t.check(wbuf.pubseekoff(0, std::ios::cur) == end,
+	    "positional writing advances the position");
+    wbuf.pubseekpos(0);
+    wbuf.sputn(contents.data(), half);
+    wbuf.close();
+  }
+  t.check(file_contents(outname) == contents, "positional writing behind");
+}
+
+// Builds up the binary contents of a BAI index file.
+class bai_builder {
+public:
+  bai_builder() : data("BAI\1") { }
+
+  bai_builder& int32(int32_t x)
+    { char b[4]; sam::convert::set_bam_int32(b, x); data.append(b, 4);
+      return *this; }
+  bai_builder& uint64(uint64_t x)
+    { char b[8]; sam::convert::set_bam_uint64(b, x); data.append(b, 8);
+      return *this; }
+  bai_builder& bin(int32_t bin, uint64_t begin, uint64_t end)
+    { return int32(bin).int32(1).uint64(begin).uint64(end); }
+
+  void write(const string& filename) const
+    { std::ofstream f(filename.c_str(), std::ios::binary); f << data; }
+
+  string data;
+};
+
+static string chunks_text(const std::vector<sam::bam_index::chunk>& chunks) {
+  std::ostringstream s;
+  for (size_t i = 0; i < chunks.size(); i++)
+    s << (chunks[i].begin >> 16) << '.' << (chunks[i].begin & 0xffff) << '-'
+      << (chunks[i].end >> 16) << '.' << (chunks[i].end & 0xffff) << ';';
+  return s.str();
+}
+
+static void test_index_chunks(test_harness& t) {
+  string filename = test_objdir_prefix + "chunks-out.bam.bai";
+
+  bai_builder bai;
+  bai.int32(2);
+  bai.int32(4).bin(0, 100 << 16, 200 << 16)
+     .bin(4681, 300 << 16, 400 << 16).bin(4682, (400 << 16) | 5, 500 << 16)
+     .bin(4690, 900 << 16, 950 << 16);
+  bai.int32(2).uint64(300 << 16).uint64((400 << 16) | 5);
+  bai.int32(0).int32(0);
+  bai.write(filename);
+
+  sam::bam_index index;
+  index.load(filename);
+  std::vector<sam::bam_index::chunk> chunks;
+
+  index.find_chunks(chunks, 0, 0, 20000);
+  t.check(chunks_text(chunks), "300.0-500.0;", "index chunks merged");
+  index.find_chunks(chunks, 0, 16384, 16385);
+  t.check(chunks_text(chunks), "400.5-500.0;", "index chunks linear");
+  index.find_chunks(chunks, 0, 150000, 150001);
+  t.check(chunks_text(chunks), "900.0-950.0;", "index chunks beyond linear");
+  index.find_chunks(chunks, 1, 0, 1000000);
+  t.check(chunks_text(chunks), "", "index chunks empty reference");
+  index.find_chunks(chunks, 5, 0, 1000000);
+  t.check(chunks_text(chunks), "", "index chunks invalid reference");
+
+  bai.data[3] = '\2';
+  bai.write(filename);
+  try { index.load(filename); t.check(false, "index invalid magic"); }
+  catch (const sam::bad_format&) { t.check(true, "index invalid magic"); }
+}
+
+static bool overlaps(const sam::alignment& aln, const sam::seqinterval& r) {
+  return aln.rname() == r.name() && aln.zpos() < r.zlimit() &&
+	 aln.zpos() + std::max(aln.cigar_span(), sam::scoord_t(1)) > r.zstart();
+}
+
+static void test_region_queries(test_harness& t) {
+  string filename = test_objdir_prefix + "threads-out.bam";
+
+  // A coarse index listing all of the file's records in a single chunk, from
+  // just after the header, which is small enough to be in the first block.
+  const size_t header_size = 4 + 4 + strlen("@SQ\tSN:chr1\tLN:100000000\n") +
+			     4 + 4 + strlen("chr1") + 1 + 4;
+  uint64_t eof_offset = file_contents(filename).length();
+  bai_builder bai;
+  bai.int32(1).int32(1).bin(0, header_size, eof_offset << 16).int32(0);
+  bai.int32(0);
+  bai.write(filename + ".bai");
+
+  sam::seqinterval regions[] = {
+    sam::seqinterval("chr1", 10000, 10500), sam::seqinterval("chr1", 0, 1),
+    sam::seqinterval("chr1", 349950, 500000), sam::seqinterval("chr1", 0, 0) };
+  const int nregions = sizeof regions / sizeof regions[0];
+
+  std::vector<string> expected(nregions);
+  {
+    sam::isamstream in(filename);
+    sam::collection headers;
+    in >> headers;
+    sam::alignment aln;
+    while (in >> aln)
+      for (int i = 0; i < nregions; i++)
+	if (overlaps(aln, regions[i]))  expected[i] += aln.qname() + ' ';
+  }
+
+  for (int nthreads = 0; nthreads <= 2; nthreads += 2) {
+    sam::isamstream in(filename);
+    in.set_threads(nthreads);
+    sam::collection headers;
+    in >> headers;
+
+    for (int i = 0; i < nregions; i++) {
+      string actual;
+      sam::alignment aln;
+      in.seek(regions[i]);
+      while (in >> aln)  actual += aln.qname() + ' ';
+      t.check(actual, expected[i], "region query");
+
+      actual.clear();
+      sam::alignment_view view;
+      in.seek(regions[i]);
+      while (in >> view)  actual += view.qname() + ' ';
+      t.check(actual, expected[i], "region query via alignment views");
+    }
+  }
+
+  sam::isamstream in(filename);
+  sam::collection headers;
+  in >> headers;
+  in.exceptions(std::ios::goodbit);
+  in.seek(sam::seqinterval("chrX", 0, 1000));
+  t.check(in.bad(), "region query on unknown reference");
+}
+
+// Write the SAM-formatted TEXT as a BAM file, building an index as it goes.
+static void write_indexed(const string& filename, const string& text,
+			  int nthreads) {
+  std::istringstream textstream(text);
+  sam::isamstream in(textstream.rdbuf());
+  sam::osamstream out(filename, sam::bam_format);
+  out.set_threads(nthreads);
+  out.build_index();
+
+  sam::collection headers;
+  in >> headers;
+  out << headers;
+
+  sam::alignment aln;
+  while (in >> aln)  out << aln;
+}
+
+// Check that region queries on the indexed FILENAME find the same records
+// as a brute-force scan through the whole file.
+static void check_region_queries(test_harness& t, const string& filename,
+				 const sam::seqinterval* regions, int nregions) {
+  std::vector<string> expected(nregions);
+  {
+    sam::isamstream in(filename);
+    sam::collection headers;
+    in >> headers;
+    sam::alignment aln;
+    while (in >> aln)
+      for (int i = 0; i < nregions; i++)
+	if (overlaps(aln, regions[i]))  expected[i] += aln.qname() + ' ';
+  }
+
+  sam::isamstream in(filename);
+  sam::collection headers;
+  in >> headers;
+  for (int i = 0; i < nregions; i++) {
+    string actual;
+    sam::alignment aln;
+    in.seek(regions[i]);
+    while (in >> aln)  actual += aln.qname() + ' ';
+    t.check(actual, expected[i], "query using built index");
+  }
+}
+
+static void test_index_building(test_harness& t) {
+  std::ostringstream text;
+  text << "@SQ\tSN:chr1\tLN:100000000\n@SQ\tSN:chr2\tLN:5000000\n";
+  for (int i = 0; i < 30000; i++)
+    text << "r" << i << "\t0\tchr1\t" << 1 + i * 97 << "\t60\t"
+	 << ((i % 50 == 0)? "20M300000N20M" : "40M") << "\t*\t0\t0\t*\t*\n";
+  for (int i = 0; i < 100; i++)
+    text << "s" << i << "\t4\tchr2\t" << 1 + i * 4000 << "\t0\t*\t*\t0\t0\t*\t*\n";
+  text << "u0\t4\t*\t0\t0\t*\t*\t0\t0\t*\t*\n";
+
+  const sam::seqinterval regions[] = {
+    sam::seqinterval("chr1", 10000, 10500), sam::seqinterval("chr1", 0, 1),
+    sam::seqinterval("chr1", 1200000, 1300000),
+    sam::seqinterval("chr1", 2900000, 100000000),
+    sam::seqinterval("chr2", 7999, 8001), sam::seqinterval("chr2", 0, 5000000) };
+  const int nregions = sizeof regions / sizeof regions[0];
+
+  string filename = test_objdir_prefix + "indexed-out.bam";
+  write_indexed(filename, text.str(), 0);
+  string index = file_contents(filename + ".bai");
+  t.check(index.compare(0, 4, "BAI\1") == 0, "built BAI index");
+  check_region_queries(t, filename, regions, nregions);
+
+  write_indexed(filename, text.str(), 3);
+  t.check(file_contents(filename + ".bai") == index, "built index w/threads");
+
+  // References longer than 2^29 bases require a CSI index.
+  std::ostringstream bigtext;
+  bigtext << "@SQ\tSN:chrBig\tLN:1500000000\n";
+  for (int i = 0; i < 20000; i++)
+    bigtext << "b" << i << "\t0\tchrBig\t" << 1 + i * 74999 << "\t60\t"
+	    << ((i % 7 == 0)? "20M900000N20M" : "40M") << "\t*\t0\t0\t*\t*\n";
+
+  const sam::seqinterval bigregions[] = {
+    sam::seqinterval("chrBig", 0, 100),
+    sam::seqinterval("chrBig", 700000000, 700100000),
+    sam::seqinterval("chrBig", 1400000000, 1500000000) };
+
+  string bigfilename = test_objdir_prefix + "indexed-big-out.bam";
+  write_indexed(bigfilename, bigtext.str(), 2);
+  t.check(file_contents(bigfilename + ".bai").empty() &&
+	  file_contents(bigfilename + ".csi").length() > 28, "built CSI index");
+  check_region_queries(t, bigfilename, bigregions,
+		       sizeof bigregions / sizeof bigregions[0]);
+
+  std::istringstream unsorted("@SQ\tSN:chr1\tLN:1000\n"
+			      "r1\t0\tchr1\t500\t60\t4M\t*\t0\t0\t*\t*\n"
+			      "r2\t0\tchr1\t100\t60\t4M\t*\t0\t0\t*\t*\n");
+  sam::isamstream in(unsorted.rdbuf());
+  sam::osamstream out(test_objdir_prefix + "unsorted-out.bam",
+		      sam::bam_format);
+  out.exceptions(std::ios::goodbit);
+  out.build_index();
+  sam::collection headers;
+  sam::alignment aln;
+  in >> headers;
+  out << headers;
+  while (in >> aln)  out << aln;
+  t.check(out.fail() && ! out.bad(), "building index for unsorted records");
+
+  sam::osamstream samout(test_objdir_prefix + "indexed-out.sam");
+  samout.exceptions(std::ios::goodbit);
+  samout.build_index();
+  t.check(samout.bad(), "building index for SAM output");
+}
+
+// Check that seeking to positions noted via tell() revisits those records.
+static void test_tell_seek(test_harness& t, const string& filename,
+			   int nthreads) {
+  sam::isamstream in(filename);
+  in.set_threads(nthreads);
+  sam::collection headers;
+  in >> headers;
+
+  std::vector<uint64_t> offsets;
+  std::vector<string> names;
+  sam::alignment aln;
+  for (uint64_t offset = in.tell(); in >> aln; offset = in.tell()) {
+    offsets.push_back(offset);
+    names.push_back(aln.qname());
+  }
+
+  t.check(offsets.size() > 1000, "tell() while reading " + filename);
+
+  bool ok = true;
+  for (size_t step = 0; step < 20; step++) {
+    size_t i = (offsets.size() - 1) * (step * 7 % 20) / 19;
+    in.seek(offsets[i]);
+    for (size_t j = i; j < i + 3 && j < offsets.size(); j++)
+      if (! (in >> aln) || aln.qname() != names[j])  ok = false;
+  }
+
+  in.seek(offsets.back());
+  if (! (in >> aln) || (in >> aln))  ok = false;
+
+  t.check(ok, "seek() to positions from tell() in " + filename);
+}
+
+// Copies the records in FROM to TO, compressing with NTHREADS threads
+// (and at LEVEL, if specified).
+static void copy_records(const string& from, const string& to,
+			 std::ios::openmode mode, int nthreads,
+			 int level = sam::default_compression) {
+  sam::isamstream in(from);
+  sam::osamstream out(to, mode);
+  out.set_threads(nthreads);
+  if (level != sam::default_compression)  out.set_compression(level);
+  sam::collection headers;
+  sam::alignment aln;
+  in >> headers;
+  out << headers;
+  while (in >> aln)  out << aln;
+}
+
+static void test_compressed_sam(test_harness& t) {
+  string bamfile = test_objdir_prefix + "threads-out.bam";
+  string filename = test_objdir_prefix + "compressed-out.sam.gz";
+  string expected = read_all(bamfile, 0);
+
+  copy_records(bamfile, filename, sam::compressed, 0);
+  string expected_bytes = file_contents(filename);
+  t.check(expected_bytes.compare(0, 4, "\x1f\x8b\x08\x04") == 0,
+	  "compressed SAM is written as BGZF");
+  t.check(read_all(filename, 0) == expected, "BGZF SAM reading");
+  t.check(read_all(filename, 3) == expected, "BGZF SAM reading with 3 threads");
+
+  copy_records(bamfile, filename, sam::compressed, 2);
+  t.check(file_contents(filename) == expected_bytes,
+	  "BGZF SAM writing with 2 threads");
+
+  // Write the same SAM text as an ordinary gzip file of several members,
+  // as produced by concatenating gzipped files.
+  string samfile = test_objdir_prefix + "tellseek-out.sam";
+  string text = file_contents(samfile);
+  filename = test_objdir_prefix + "multimember-out.sam.gz";
+  size_t pieces[] = { 0, 10, text.size() / 3, text.size() };
+  for (int i = 0; i < 3; i++) {
+    gzFile f = gzopen(filename.c_str(), (i == 0)? "wb" : "ab");
+    gzwrite(f, text.data() + pieces[i], pieces[i+1] - pieces[i]);
+    gzclose(f);
+  }
+
+  t.check(read_all(filename, 0) == expected, "multi-member gzip SAM reading");
+  t.check(read_all(filename, 2) == expected,
+	  "multi-member gzip SAM reading with threads");
+
+  // Truncate the final gzip member.
+  string truncated = file_contents(filename);
+  truncated.resize(truncated.size() - 100);
+  {
+    std::ofstream f(filename.c_str(), std::ios::binary);
+    f << truncated;
+  }
+
+  bool threw = false;
+  try {
+    sam::isamstream in(filename);
+    sam::collection headers;
+    sam::alignment aln;
+    in >> headers;
+    while (in >> aln) { }
+  }
+  catch (const sam::bad_format&) { threw = true; }
+  t.check(threw, "truncated gzip SAM reading fails");
+}
+
+static void test_compression_levels(test_harness& t) {
+  string bamfile = test_objdir_prefix + "threads-out.bam";
+  string filename = test_objdir_prefix + "levels-out.bam";
+  string expected = read_all(bamfile, 0);
+
+  size_t sizes[10];
+  for (int level = 0; level <= 9; level += 3) {
+    copy_records(bamfile, filename, sam::bam_format, 0, level);
+    sizes[level] = file_contents(filename).size();
+    t.check(read_all(filename, 0) == expected,
+	    "BAM written at level " + string(1, '0' + level));
+  }
+  t.check(sizes[0] > sizes[3] && sizes[3] > sizes[9],
+	  "higher levels compress better");
+
+  copy_records(bamfile, filename, sam::bam_format & ~sam::compressed, 0);
+  string stored = file_contents(filename);
+  t.check(stored.size() == sizes[0], "level 0 is the same as uncompressed BAM");
+  t.check(stored[sam::BGZF::hsize] == '\x01' &&
+	  stored.compare(sam::BGZF::hsize + 5, 4, "BAM\1") == 0,
+	  "uncompressed BAM is written as stored blocks");
+
+  // Stored blocks are recognised and copied, rather than inflated.
+  char block[sam::BGZF::full_block_size];
+  char data[sam::BGZF::uncompressed_max_size];
+  const char text[] = "ACGTACGTAC";
+  sam::block_inflater inflater;
+  size_t size = sam::block_deflater(0).deflate(block, text, 10);
+  t.check(size == sam::BGZF::hsize + 5 + 10 + sam::BGZF::tsize &&
+	  inflater.inflate(data, sizeof data, block, size) == 10 &&
+	  memcmp(data, text, 10) == 0, "stored block round trip");
+  size = sam::block_deflater(0).deflate(block, text, 0);
+  t.check(inflater.inflate(data, sizeof data, block, size) == 0,
+	  "empty stored block");
+
+  bool corrupt_detected = false;
+  size = sam::block_deflater(0).deflate(block, text, 10);
+  block[sam::BGZF::hsize + 7] ^= 0x20;
+  try { inflater.inflate(data, sizeof data, block, size); }
+  catch (const sam::bad_format&) { corrupt_detected = true; }
+  t.check(corrupt_detected, "corrupted stored block detected by CRC");
+
+  copy_records(bamfile, filename, sam::bam_format, 0, sam::adaptive_compression);
+  t.check(read_all(filename, 0) == expected, "BAM written adaptively");
+  copy_records(bamfile, filename, sam::bam_format, 3, sam::adaptive_compression);
+  t.check(read_all(filename, 2) == expected,
+	  "BAM written adaptively with 3 threads");
+
+  filename = test_objdir_prefix + "levels-out.sam.gz";
+  copy_records(bamfile, filename, sam::compressed, 2, 1);
+  t.check(read_all(filename, 0) == expected, "BGZF SAM written at level 1");
+
+  bool threw = false;
+  try {
+    sam::osamstream out(filename, sam::bam_format);
+    out.set_compression(10);
+  }
+  catch (const sam::exception&) { threw = true; }
+  t.check(threw, "invalid compression level rejected");
+
+  // Compression that takes longer than everything else lowers the level,
+  // while compression that keeps well ahead of it raises the level again.
+  sam::adaptive_level adaptive;
+  int level = adaptive.level();
+  for (int i = 0; i < sam::adaptive_level::window; i++)
+    level = adaptive.update(0.002, 0.001);
+  t.check(level == 5, "adaptive level lowered");
+  for (int i = 0; i < 4 * sam::adaptive_level::window; i++)
+    level = adaptive.update(0.001, 0.005);
+  t.check(level == 9, "adaptive level raised");
+}
+
 void test_sam_io(test_harness& t) {
   test_reader(t);
+  test_long_lines(t);
+  test_field_splitting(t);
 
   std::stringstream text;
   for (int i = 1; i <= 20000; i++)
@@ -157,4 +1309,51 @@ void test_sam_io(test_harness& t) {
 
   test_streams(t, ".sam", sam::sam_format);
   test_streams(t, ".bam", sam::bam_format);
+  test_streams(t, ".sam.gz", sam::compressed);
+
+  test_threads(t);
+  test_block_checksums(t);
+  test_block_cache(t);
+  test_tell_seek(t, test_objdir_prefix + "threads-out.bam", 0);
+  test_tell_seek(t, test_objdir_prefix + "threads-out.bam", 2);
+  {
+    sam::isamstream in(test_objdir_prefix + "threads-out.bam");
+    sam::osamstream out(test_objdir_prefix + "tellseek-out.sam");
+    sam::collection headers;
+    sam::alignment aln;
+    in >> headers;
+    out << headers;
+    while (in >> aln)  out << aln;
+  }
+  test_tell_seek(t, test_objdir_prefix + "tellseek-out.sam", 0);
+  test_tell_seek(t, test_objdir_prefix + "tellseek-out.sam", 3);
+  test_compressed_sam(t);
+  test_threaded_sam(t);
+  test_compression_levels(t);
+  test_mmapfilebuf(t, test_objdir_prefix + "threads-out.bam");
+  test_mmapfilebuf(t, test_objdir_prefix + "compressed-out.sam.gz");
+  test_mmapfilebuf(t, test_objdir_prefix + "tellseek-out.sam");
+  test_membuf(t, test_objdir_prefix + "threads-out.bam");
+  test_membuf(t, test_objdir_prefix + "compressed-out.sam.gz");
+  test_membuf(t, test_objdir_prefix + "tellseek-out.sam");
+  test_membuf_output(t);
+  test_readahead(t, test_objdir_prefix + "threads-out.bam");
+  test_readahead(t, test_objdir_prefix + "tellseek-out.sam");
+  test_writebehind(t);
+  test_dropbehind(t);
+  test_positional(t, test_objdir_prefix + "threads-out.bam");
+  test_positional(t, test_objdir_prefix + "tellseek-out.sam");
+  test_alignment_views(t, test_objdir_prefix + "threads-out.bam", 0);
+  test_alignment_views(t, test_objdir_prefix + "threads-out.bam", 2);
+  test_alignment_views(t, test_objdir_prefix + "compressed-out.sam.gz", 0);
+  test_alignment_views(t, test_objdir_prefix + "tellseek-out.sam", 0);
+  test_alignment_views(t, test_objdir_prefix + "tellseek-out.sam", 2);
+  test_scan(t, test_objdir_prefix + "threads-out.bam", 1);
+  test_scan(t, test_objdir_prefix + "threads-out.bam", 4);
+  test_scan(t, test_objdir_prefix + "threads-out.bam", 37);
+  test_scan(t, test_objdir_prefix + "compressed-out.sam.gz", 4);
+  test_scan(t, test_objdir_prefix + "tellseek-out.sam", 4);
+  test_index_chunks(t);
+  test_region_queries(t);
+  test_index_building(t);
 }
@@ -1,6 +1,6 @@
 /*  samcat.cpp -- Concatenate and print SAM and BAM files.
 
-    Copyright (C) 2010-2013 Genome Research Ltd.
+    Copyright (C) 2010-2013, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -66,7 +66,8 @@ void cat(isamstream& in, osamstream& out, bool suppress_headers) {
     out << headers;
   }
 
-  alignment aln;
+  // Records are only filtered and rewritten, so needn't be copied.
+  alignment_view aln;
   while (in >> aln) {
     stats.nin++;
     if (should_emit(aln)) { out << aln; stats.nout++; }
@@ -77,7 +78,7 @@ void cat_to_fastq(isamstream& in, std::ostream& out) {
   collection headers;
   in >> headers;
 
-  alignment aln;
+  alignment_view aln;
   string seq_buffer, qual_buffer;
   while (in >> aln) {
     out << '@' << aln.qname_c_str();
@@ -95,6 +96,7 @@ void parse_format(const string& s,
 		  std::ios::openmode& mode, std::ios::fmtflags& format) {
   if (s == "bam")  mode = bam_format;
   else if (s == "hex")  format = std::ios::hex;
+  else if (s == "samgz")  mode = sam_format | compressed;
   else if (s == "text")  format = std::ios::boolalpha;
   else if (s == "ubam")  mode = bam_format & ~compressed;
   else  throw bad_format("Invalid output format ('" + s + "')");
@@ -103,17 +105,23 @@ void parse_format(const string& s,
 int main(int argc, char** argv)
 try {
   const char usage[] =
-"Usage: samcat [-bnv] [-f FLAGS] [-o FILE] [-O FORMAT] [FILE]...\n"
+"Usage: samcat [-bnvx] [-f FLAGS] [-o FILE] [-O FORMAT] [-t NUM] [-z NUM]\n"
+"              [FILE]...\n"
 "Options:\n"
 "  -b         Write output in BAM format (equivalent to -Obam)\n"
 "  -f FLAGS   Display only alignment records matching FLAGS\n"
 "  -n         Suppress '@' headers in the output\n"
 "  -o FILE    Write to FILE rather than standard output\n"
 "  -O FORMAT  Write output in the specified FORMAT\n"
+"  -t NUM     Use NUM threads for BGZF compression and decompression\n"
 "  -v         Display file information and statistics\n"
+"  -x         Also write an index for the (sorted) BAM output file\n"
+"  -z NUM     Compress BAM or samgz output at level NUM, from 0 to 9 or\n"
+"             \"adaptive\" to keep pace with the input and output [6]\n"
 "Output formats:\n"
 "  bam        Compressed binary BAM format\n"
 "  hex        SAM format, with flags displayed in hexadecimal\n"
+"  samgz      SAM format, compressed with BGZF\n"
 "  text       SAM format, with flags displayed as readable strings\n"
 "  ubam       Uncompressed binary BAM format\n"
 "";
@@ -123,6 +131,9 @@ try {
   std::ios::fmtflags output_format = std::ios::dec;
   bool suppress_headers = false;
   bool verbose = false;
+  bool build_index = false;
+  int nthreads = 0;
+  int compression_level = default_compression;
 
   if (argc == 2) {
     string arg = argv[1];
@@ -139,14 +150,17 @@ try {
   opt.pos_flags = opt.neg_flags = 0;
 
   int c;
-  while ((c = getopt(argc, argv, ":bf:no:O:v")) >= 0)
+  while ((c = getopt(argc, argv, ":bf:no:O:t:vxz:")) >= 0)
     switch (c) {
     case 'b':  output_mode = bam_format;  break;
     case 'f':  parse_flags(optarg, opt.pos_flags, opt.neg_flags);  break;
     case 'n':  suppress_headers = true;  break;
     case 'o':  output_fname = optarg;  break;
     case 'O':  parse_format(optarg, output_mode, output_format);  break;
+    case 't':  nthreads = atoi(optarg);  break;
     case 'v':  verbose = true;  break;
+    case 'x':  build_index = true;  break;
+    case 'z':  compression_level = parse_compression_level(optarg);  break;
     default:
       std::cerr << usage;
       return EXIT_FAILURE;
@@ -155,21 +169,32 @@ try {
   if (argc == 1 && cin_likely_from_user())
     { std::cerr << usage; return EXIT_FAILURE; }
 
+  if (build_index && output_fname == "-") {
+    std::cerr << "samcat: an output file (-o) is required for indexing\n";
+    return EXIT_FAILURE;
+  }
+
   stats.nin = stats.nout = 0;
 
   osamstream out(output_fname, std::ios::out | output_mode);
   out.setf(output_format, std::ios::basefield | std::ios::boolalpha);
+  out.set_threads(nthreads);
+  if (compression_level != default_compression)
+    out.set_compression(compression_level);
+  if (build_index)  out.build_index();
 
   int status = EXIT_SUCCESS;
 
   if (optind == argc) {
     isamstream in("-");
+    in.set_threads(nthreads);
     cat(in, out, suppress_headers);
   }
   else
     for (int i = optind; i < argc; i++) {
       try {
 	isamstream in(argv[i]);
+	in.set_threads(nthreads);
 	cat(in, out, suppress_headers);
       }
       catch (const sam::exception& e) {
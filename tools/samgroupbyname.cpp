@@ -1,6 +1,6 @@
 /*  samgroupbyname.cpp -- Order a SAM/BAM file so that read pairs are together.
 
-    Copyright (C) 2010-2013 Genome Research Ltd.
+    Copyright (C) 2010-2013, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -87,11 +87,12 @@ void group_alignments(isamstream& in, osamstream& out) {
 
 int main(int argc, char** argv) {
   const char usage[] =
-"Usage: samgroupbyname [-bpv] [-o FILE] [FILE]\n"
+"Usage: samgroupbyname [-bpv] [-o FILE] [-t NUM] [FILE]\n"
 "Options:\n"
 "  -b       Write output in BAM format\n"
 "  -o FILE  Write to FILE rather than standard output\n"
 "  -p       Emit pairs only, discarding any leftover singleton reads\n"
+"  -t NUM   Use NUM threads for BAM compression and decompression\n"
 "  -v       Display file information and statistics\n"
 "";
 
@@ -109,13 +110,15 @@ int main(int argc, char** argv) {
 
   string output_fname = "-";
   std::ios::openmode output_mode = sam_format;
+  int nthreads = 0;
 
   int c;
-  while ((c = getopt(argc, argv, ":bo:pv")) >= 0)
+  while ((c = getopt(argc, argv, ":bo:pt:v")) >= 0)
     switch (c) {
     case 'b':  output_mode = bam_format;  break;
     case 'o':  output_fname = optarg;  break;
     case 'p':  emit_singletons = false;  break;
+    case 't':  nthreads = atoi(optarg);  break;
     case 'v':  verbose = true;  break;
     default:
       std::cerr << usage;
@@ -135,6 +138,8 @@ int main(int argc, char** argv) {
   try {
     isamstream in(input_fname);
     osamstream out(output_fname, output_mode);
+    in.set_threads(nthreads);
+    out.set_threads(nthreads);
 
     collection headers;
     in >> headers;
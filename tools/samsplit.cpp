@@ -1,6 +1,6 @@
 /*  samsplit.cpp -- Split a SAM or BAM file into separate read groups.
 
-    Copyright (C) 2011-2013 Genome Research Ltd.
+    Copyright (C) 2011-2013, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -143,7 +143,10 @@ try {
 "  -f FLAGS  Emit only alignment records matching FLAGS\n"
 "  -o FILE   Write all selected records to FILE, in addition to splitting\n"
 "  -q NUM    Discard reads with mapping quality less than NUM\n"
-"  -z NUM    Compress output files at level NUM (default for BAM; none for SAM)\n"
+"  -t NUM    Use NUM threads for BAM decompression and for compressing each\n"
+"            output file\n"
+"  -z NUM    Compress output files at level NUM, from 0 to 9 or \"adaptive\"\n"
+"            (default for BAM; none for SAM)\n"
 "Template and output file expansions:\n"
 "  %XY       Read group header's XY field\n"
 "  %#        Index of the read group (within the @RG headers, from 1)\n"
@@ -165,15 +168,21 @@ try {
 
   std::ios::openmode output_mode = sam_format;
   output_extension = "sam";
+  int nthreads = 0;
+  int compression_level = default_compression;
+  bool set_compression = false;
 
   int c;
-  while ((c = getopt(argc, argv, ":bf:o:q:z:")) >= 0)
+  while ((c = getopt(argc, argv, ":bf:o:q:t:z:")) >= 0)
     switch (c) {
     case 'b':  output_mode |= std::ios::binary; output_extension = "bam"; break;
     case 'f':  parse_flags(optarg, opt.pos_flags, opt.neg_flags);  break;
     case 'o':  output_filename = optarg;  break;
     case 'q':  opt.min_quality = atoi(optarg);  break;
-    case 'z':  if (atoi(optarg) > 0)  output_mode |= compressed;
+    case 't':  nthreads = atoi(optarg);  break;
+    case 'z':  compression_level = parse_compression_level(optarg);
+	       set_compression = true;
+	       if (compression_level != 0)  output_mode |= compressed;
 	       else  output_mode &= ~compressed;
 	       break;
     default:   std::cerr << usage; return EXIT_FAILURE;
@@ -187,6 +196,7 @@ try {
   if (nargs >= 2)  split_template = argv[optind+1];
 
   isamstream in(filename);
+  in.set_threads(nthreads);
   input_basename = (filename != "-")? basename(filename) : "stdin";
 
   collection headers;
@@ -197,6 +207,8 @@ try {
     header empty("@RG");
     string copyname = expand(output_filename, empty, 0);
     copy_out.open(copyname, output_mode);
+    copy_out.set_threads(nthreads);
+    if (set_compression)  copy_out.set_compression(compression_level);
     copy_out << headers;
   }
 
@@ -214,6 +226,8 @@ try {
       osamstream* out = &out_array[rg_index++];
       string splitname = expand(split_template, *it, rg_index);
       out->open(splitname, output_mode);
+      out->set_threads(nthreads);
+      if (set_compression)  out->set_compression(compression_level);
       rg_split.insert(make_pair(it->field<string>("ID"), split(out)));
 
       // TODO Remove the other @RG headers.
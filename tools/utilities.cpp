@@ -1,6 +1,6 @@
 /*  utilities.cpp -- Support routines common to the various utilities.
 
-    Copyright (C) 2010-2015 Genome Research Ltd.
+    Copyright (C) 2010-2015, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -33,6 +33,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  */
 
 #include <unistd.h>  // for STDIN_FILENO, isatty()
 
+#include "cansam/sam/stream.h"
+#include "cansam/exception.h"
 #include "cansam/version.h"
 
 using std::string;
@@ -55,3 +57,11 @@ string basename(const string& path) {
   size_t length = (dotpos != string::npos)? dotpos - basepos : string::npos;
   return path.substr(basepos, length);
 }
+
+int parse_compression_level(const string& text) {
+  if (text == "adaptive")  return sam::adaptive_compression;
+  else if (text.length() == 1 && text[0] >= '0' && text[0] <= '9')
+    return text[0] - '0';
+  else
+    throw sam::bad_format("Invalid compression level ('" + text + "')");
+}
@@ -1,6 +1,6 @@
 /*  utilities.cpp -- Support routines common to the various utilities.
 
-    Copyright (C) 2010-2011 Genome Research Ltd.
+    Copyright (C) 2010-2011, 2026 Genome Research Ltd.
 
     Author: John Marshall <jm18@sanger.ac.uk>
 
@@ -48,4 +48,8 @@ bool cin_likely_from_user();
 // Returns PATH with any leading directories and trailing extensions removed.
 std::string basename(const std::string& path);
 
+// Parses a compression level option, which is a digit from 0 to 9 or
+// "adaptive" (giving sam::adaptive_compression).
+int parse_compression_level(const std::string& text);
+
 #endif